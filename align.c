@@ -0,0 +1,185 @@
+#include <math.h>
+#include "audio.h"
+
+#define ALIGN_RATE 1000     // Hz, roughly, the coarse search runs at
+#define ALIGN_CHUNK 65536   // frames mixed down per task
+#define ALIGN_WINDOW 65536  // frames compared at full rate to refine the coarse offset
+#define LANES 8
+
+typedef unsigned char u8;
+
+typedef struct {
+	audio_t *track;
+	long off, n;  // Frames [off, off+n) of the track, zero outside it
+	int dec;      // Frames averaged into each output value
+	long chunk;   // Frames per task, a multiple of dec so no value is shared by two tasks
+	float *out;   // n / dec values
+} mono_ctx_t;
+
+// Mono sum of the channels, added up over every 'dec' frames. Silent runs stay zero
+static void mono_task(void *ctx, int task, int thread) {
+	(void)thread;
+	mono_ctx_t *c = ctx;
+	audio_t *t = c->track;
+	long a = (long)task * c->chunk, b = c->n - a < c->chunk ? c->n : a + c->chunk, p, q, next, i;
+	float *tmp = t->packed ? malloc(c->chunk * sizeof(float)) : NULL, *restrict y = c->out;
+	int es = store_size(t->store), dec = c->dec, ch;
+	if (advance_progress(b - a)) {
+		free(tmp);
+		return;
+	}
+
+	for (i = a / dec; i < b / dec; i++) y[i] = 0.0f;
+	long first = c->off + a > 0 ? c->off + a : 0, last = c->off + b < t->sz ? c->off + b : t->sz;
+	for (p = first; p < last; p = next) {
+		if (silent_run(t, p, last, &next)) continue;
+		long n = next - p, at = p - c->off;
+		for (ch = 0; ch < t->n_ch; ch++) {
+			if (t->frames) {
+				const float *f = t->frames + (size_t)p * t->n_ch + ch;
+				for (q = 0; q < n; q++) y[(at + q) / dec] += f[q * t->n_ch];
+				continue;
+			}
+			const float *x = t->buf ? t->buf[ch] + p : tmp;
+			if (!t->buf) unpack_block(tmp, (u8*)t->packed[ch] + (size_t)p * es, n, t->store);
+			if (dec == 1) for (q = 0; q < n; q++) y[at + q] += x[q];
+			else for (q = 0; q < n; q++) y[(at + q) / dec] += x[q];
+		}
+	}
+	free(tmp);
+}
+
+// Frames [off, off+n) of a track mixed down and decimated, with the mean removed
+static float *mono(audio_t *t, long off, long n, int dec) {
+	long chunk = ALIGN_CHUNK / dec * dec > 0 ? ALIGN_CHUNK / dec * dec : dec;
+	mono_ctx_t c = {t, off, n - n % dec, dec, chunk, malloc((n / dec + 1) * sizeof(float))};
+	run_parallel((c.n + chunk - 1) / chunk, 0, mono_task, &c);
+	long i, m = n / dec;
+	double mean = 0.0;
+	for (i = 0; i < m; i++) mean += c.out[i];
+	mean = m ? mean / m : 0.0;
+	for (i = 0; i < m; i++) c.out[i] -= (float)mean;
+	return c.out;
+}
+
+static double dot(const float *restrict x, const float *restrict y, long n) {
+	float acc[LANES] = {0};
+	double s = 0.0;
+	long i;
+	int l;
+	for (i = 0; i + LANES <= n; i += LANES) {
+		for (l = 0; l < LANES; l++) acc[l] += x[i+l] * y[i+l];
+		if (!(i & 4095)) {
+			for (l = 0; l < LANES; l++) s += acc[l], acc[l] = 0.0f;
+		}
+	}
+	for (; i < n; i++) s += x[i] * y[i];
+	for (l = 0; l < LANES; l++) s += acc[l];
+	return s;
+}
+
+int align_audio(audio_t *dst, audio_t *src, align_t *a) {
+	TRACE();
+	TRACE_SAMPLES(dst && src ? (long)dst->sz * dst->n_ch + (long)src->sz * src->n_ch : 0);
+	if (!dst || !src || !a) return -1;
+	use_audio(dst);
+	use_audio(src);
+	if (dst->sz < 1 || dst->n_ch < 1 || (!dst->buf && !dst->packed && !dst->frames)) return -1;
+	if (src->sz < 1 || src->n_ch < 1 || (!src->buf && !src->packed && !src->frames)) return -1;
+	if (dst->rate != src->rate) return -2;
+
+	// Coarse: both tracks averaged down to about ALIGN_RATE, correlated at every offset at once.
+	// c[k] = sum of d[n+k] * s[n] is the inverse transform of D * conj(S), zero-padded so it does not wrap
+	int dec = dst->rate / ALIGN_RATE > 1 ? dst->rate / ALIGN_RATE : 1;
+	long nd = dst->sz / dec, ns = src->sz / dec, k;
+	if (nd < 1 || ns < 1) dec = 1, nd = dst->sz, ns = src->sz;
+	long n = 2;
+	while (n < nd + ns) n <<= 1;
+	if (n > 1 << 30) return -4;
+
+	report_progress(0, dst->sz + src->sz);
+	float *d = mono(dst, 0, dst->sz, dec), *s = mono(src, 0, src->sz, dec);
+	if (advance_progress(0)) {
+		free(d);
+		free(s);
+		return -3;
+	}
+
+	fft_t f;
+	if (fft_init(&f, n) < 0) {
+		free(d);
+		free(s);
+		return -4;
+	}
+	long bins = n / 2 + 1;
+	float *x = calloc(n, sizeof(float)), *dr = malloc(bins * 4 * sizeof(float));
+	float *di = dr + bins, *sr = di + bins, *si = sr + bins;
+	memcpy(x, d, nd * sizeof(float));
+	fft_forward(&f, x, dr, di);
+	memset(x, 0, n * sizeof(float));
+	memcpy(x, s, ns * sizeof(float));
+	fft_forward(&f, x, sr, si);
+	for (k = 0; k < bins; k++) {
+		float re = dr[k] * sr[k] + di[k] * si[k], im = di[k] * sr[k] - dr[k] * si[k];
+		dr[k] = re;
+		di[k] = im;
+	}
+	fft_inverse(&f, dr, di, x);
+	fft_close(&f);
+
+	// Offsets run from src ending where dst starts to src starting where dst ends
+	long lo = -(ns - 1), hi = nd - 1, best = 0;
+	if (a->max_offset > 0) {
+		long m = a->max_offset / dec + 1;
+		lo = lo > -m ? lo : -m;
+		hi = hi < m ? hi : m;
+	}
+	float peak = -1.0f;
+	for (k = lo; k <= hi; k++) {
+		float v = x[k < 0 ? n + k : k];
+		v = a->any_polarity ? fabsf(v) : v;
+		if (v > peak) peak = v, best = k;
+	}
+	free(x);
+	free(dr);
+
+	// Refine: at full rate, around the coarse offset, over the loudest stretch of src both tracks cover
+	long off = best * dec, r = 2 * dec, w = ALIGN_WINDOW, from = off < 0 ? -off : 0, to = dst->sz - off < src->sz ? dst->sz - off : src->sz;
+	if (w > to - from) w = to - from;
+	if (w < 1) w = from = to = 0;
+	long start = from, p;
+	double e = -1.0;
+	int wd = w / dec;
+	for (p = from / dec; wd > 0 && p + wd <= to / dec && p + wd <= ns; p += wd / 2 > 0 ? wd / 2 : 1) {
+		double v = dot(s + p, s + p, wd);
+		if (v > e) e = v, start = p * dec;
+	}
+	free(d);
+	free(s);
+
+	a->offset = off;
+	a->polarity = 1;
+	a->confidence = 0.0f;
+	if (w > 0) {
+		s = mono(src, start, w, 1);
+		d = mono(dst, start + off - r, w + 2 * r, 1);
+		double ss = dot(s, s, w), v, top = 0.0, dd = 0.0;
+		long j;
+		int found = 0;
+		for (j = -r; j <= r; j++) {
+			if (a->max_offset > 0 && labs(off + j) > a->max_offset) continue;
+			v = dot(d + r + j, s, w);
+			if (!found++ || (a->any_polarity ? fabs(v) > fabs(top) : v > top)) {
+				top = v;
+				a->offset = off + j;
+			}
+		}
+		j = a->offset - off;
+		dd = dot(d + r + j, d + r + j, w);
+		a->polarity = top < 0.0 ? -1 : 1;
+		a->confidence = ss > 0.0 && dd > 0.0 ? (float)(fabs(top) / sqrt(ss * dd)) : 0.0f;
+		free(s);
+		free(d);
+	}
+	return advance_progress(0) ? -3 : 0;
+}
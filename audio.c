@@ -21,11 +21,13 @@ int is_valid(audio_t *t) {
 }
 
 int create_audio(audio_t *track, int n_ch, int bps, int rate, int fmt, int sz, char *name) {
+	TRACE();
+	TRACE_SAMPLES((long)sz * n_ch);
 	if (!track) return -1;
 	if (n_ch < 1) return -2;
 	if (bps < 1 || bps > 4 && bps != 8) return -3;
 	if (rate < 1) return -4;
-	if (fmt != 1 || fmt != 3) return -5;
+	if (fmt != 1 && fmt != 3) return -5;
 	if (fmt == 1 && bps > 4 || fmt == 3 && bps != 4 && bps != 8) return -6;
 	if (sz < 0) return -7;
 
@@ -36,28 +38,76 @@ int create_audio(audio_t *track, int n_ch, int bps, int rate, int fmt, int sz, c
 	track->fmt = fmt;
 	track->sz = sz;
 	track->buf = calloc(n_ch, sizeof(void*));
+	track->silent = NULL;
+	track->n_silent = 0;
 
 	if (sz) {
 		int i;
 		for (i = 0; i < n_ch; i++) track->buf[i] = calloc(sz, sizeof(float));
+		mark_silent(track, 0, sz);
 	}
 	return 0;
 }
 
 void transfer_audio(audio_t *dst, audio_t *src) {
+	TRACE();
+	TRACE_SAMPLES(src ? (long)src->sz * src->n_ch : 0);
 	if (!dst || !src) return;
+	use_audio(src);
 
 	memcpy(dst, src, sizeof(audio_t));
-	dst->buf = calloc(dst->n_ch, sizeof(void*));
+	if (src->packed) copy_packed(dst, src);
+	else if (src->frames) {
+		dst->frames = malloc((size_t)dst->sz * dst->n_ch * sizeof(float) + 1);
+		copy_sound(src, dst->frames, src->frames, dst->n_ch * sizeof(float), 1);
+	}
+	else {
+		dst->buf = calloc(dst->n_ch, sizeof(void*));
 
-	int i;
-	for (i = 0; i < dst->n_ch; i++) {
-		dst->buf[i] = calloc(dst->sz, sizeof(float));
-		memcpy(dst->buf[i], src->buf[i], dst->sz * sizeof(float));
+		int i;
+		for (i = 0; i < dst->n_ch; i++) {
+			dst->buf[i] = malloc(dst->sz * sizeof(float) + 1);
+			copy_sound(src, dst->buf[i], src->buf[i], sizeof(float), 1);
+		}
 	}
 
 	if (dst->name) dst->name = strdup(dst->name);
 	else dst->name = strdup("Untitled");
+	dst->stats = NULL;
+	dst->conv = NULL;
+	copy_source(dst, src);
+	copy_silent(dst, src);
+}
+
+int slice_audio(audio_t *dst, audio_t *src, long offset, long size) {
+	if (!dst || !src) return -1;
+	use_audio(src);
+	if ((!src->buf && !src->packed && !src->frames) || offset < 0 || size < 1 || offset + size > src->sz) return -2;
+
+	memcpy(dst, src, sizeof(audio_t));
+	dst->sz = size;
+	dst->stats = NULL;
+	dst->conv = NULL;
+	dst->source = NULL;
+	dst->silent = NULL;
+	dst->n_silent = 0;
+	if (src->frames) {
+		dst->frames = src->frames + offset * src->n_ch;
+		return 0;
+	}
+
+	int i, es = src->packed ? store_size(src->store) : sizeof(float);
+	void **chans = calloc(src->n_ch, sizeof(void*));
+	for (i = 0; i < src->n_ch; i++) chans[i] = (u8*)(src->packed ? src->packed[i] : (void*)src->buf[i]) + offset * es;
+	if (src->packed) dst->packed = chans;
+	else dst->buf = (float**)chans;
+	return 0;
+}
+
+void free_slice(audio_t *slice) {
+	if (!slice) return;
+	free(slice->packed ? (void*)slice->packed : (void*)slice->buf);
+	memset(slice, 0, sizeof(audio_t));
 }
 
 void rename_audio(audio_t *track, char *name) {
@@ -67,8 +117,23 @@ void rename_audio(audio_t *track, char *name) {
 	track->name = strdup(name);
 }
 
+void touch_audio(audio_t *track) {
+	if (!track) return;
+	track->version++;
+	if (track->stats) free(track->stats);
+	track->stats = NULL;
+	free_conversions(track);
+	free_source(track);
+	free_silent(track);
+}
+
 void free_audio_data(audio_t *track) {
 	if (!track) return;
+	touch_audio(track);
+	release_spill(track);
+	free_packed(track);
+	free(track->frames);
+	track->frames = NULL;
 	if (track->buf) {
 		int i;
 		for (i = 0; i < track->n_ch; i++) {
@@ -109,15 +174,20 @@ double read_sample(void *ptr, int len, int wavfmt) {
 
 	double f = 0;
 	if (wavfmt == 1) { // Integer PCM
-		int s = 0;
-		memcpy(&s, ptr, len);
+		unsigned int u = 0;
+		int s, i;
+		for (i = 0; i < len; i++) u |= (unsigned int)((u8*)ptr)[i] << (i * 8);
 
-		f = (double)s / (double)((1 << (len * 8 - 1)) - 0.5);
-		if (len == 1) f -= 1.0;
-		else if (f > 1.0) f -= 2.0;
+		if (len == 1) s = (int)u - 128; // 8-bit samples are unsigned
+		else s = (int)(u << (32 - len * 8)) >> (32 - len * 8); // sign extend
+		f = (double)s / (double)(1u << (len * 8 - 1));
 	}
 	if (wavfmt == 3) { // Floating-point
-		if (len == 4) memcpy(&f+4, ptr, 4);
+		if (len == 4) {
+			float v;
+			memcpy(&v, ptr, 4);
+			f = v;
+		}
 		if (len == 8) memcpy(&f, ptr, 8);
 	}
 	return f;
@@ -127,183 +197,138 @@ void write_sample(void *ptr, double sample, int len, int wavfmt) {
 	if (!ptr || len < 1 || (wavfmt == 1 && len > 4)) return;
 
 	if (wavfmt == 1) { // Integer PCM
-		if (len == 1) sample += 1.0;
-		else if (sample < 0.0) sample += 2.0;
-		sample *= (double)((1 << (len * 8 - 1)) - 0.5);
+		double scale = (double)(1u << (len * 8 - 1));
+		sample *= scale;
+		if (sample < -scale) sample = -scale;
+		if (sample > scale - 1.0) sample = scale - 1.0;
 
-		int i;
-		for (i = 0; i < len; i++) {
-			((u8*)ptr)[i] = (u8)(((unsigned int)sample & (0xff << (i * 8))) >> (i * 8));
-		}
+		int s = (int)(sample + (sample >= 0.0 ? 0.5 : -0.5)), i;
+		if (len == 1) s += 128;
+		for (i = 0; i < len; i++) ((u8*)ptr)[i] = (u8)(s >> (i * 8));
 	}
 	if (wavfmt == 3) { // Floating-point
-		if (len == 4) memcpy(ptr, &sample+4, 4);
+		if (len == 4) {
+			float v = sample;
+			memcpy(ptr, &v, 4);
+		}
 		if (len == 8) memcpy(ptr, &sample, 8);
 	}
 }
 
-void load_samples(audio_t *track, void *buf, int size) {
-	if (!track || !buf || size < 1) return;
+void decode_samples(audio_t *track, void *buf, int offset, int n) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)n * track->n_ch : 0);
+	use_audio(track);
+	if (track && track->packed) expand_audio(track);
+	if (!track || (!track->buf && !track->frames) || !buf || offset < 0 || n < 1 || offset + n > track->sz) return;
 
 	int i, j, p = 0, n_ch = track->n_ch, bps = track->bps;
-	track->sz = size / (bps * n_ch);
-
-	free_audio_data(track);
-	track->buf = calloc(n_ch, sizeof(void*));
-	for (i = 0; i < n_ch; i++) track->buf[i] = calloc(track->sz, sizeof(float));
-
-	for (i = 0; i < track->sz && p < size; i++, p += bps*n_ch) {
+	if (track->frames) {
+		float *f = track->frames + (size_t)offset * n_ch;
+		for (i = 0; i < n * n_ch; i++, p += bps) f[i] = read_sample((u8*)buf + p, bps, track->fmt);
+		touch_audio(track);
+		return;
+	}
+	for (i = offset; i < offset + n; i++, p += bps*n_ch) {
 		for (j = 0; j < n_ch; j++) {
 			track->buf[j][i] = read_sample((u8*)buf + p + bps*j, bps, track->fmt);
 		}
 	}
+	touch_audio(track);
 }
 
-void save_samples(audio_t *track, void *buf) {
-	if (!track || !is_valid(track) || !track->buf || !buf) return;
-
-	int i, j, p = 0, n_ch = track->n_ch, bps = track->bps;
-	for (i = 0; i < track->sz; i++, p += n_ch*bps) {
-		for (j = 0; j < n_ch; j++) {
-			write_sample((u8*)buf + p + bps*j, track->buf[j][i], bps, track->fmt);
-		}
-	}
+void encode_samples(audio_t *track, void *buf, int offset, int n) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)n * track->n_ch : 0);
+	quantize_samples(NULL, track, buf, offset, n);
 }
 
-int load_wav(audio_t *track, char *fname, char *name) {
-	if (!track || !fname) return -1;
-
-	FILE *f = fopen(fname, "rb");
-	if (!f) {
-		printf("Error: could not open \"%s\"\n", fname);
-		return -2;
-	}
-
-	fseek(f, 0, SEEK_END);
-	int sz = ftell(f);
-	rewind(f);
-	if (sz <= sizeof(wav_t)) {
-		printf("Error: \"%s\" is too small to be a WAV file\n", fname);
-		return -3;
-	}
-
-	u8 *file = malloc(sz);
-	fread(file, 1, sz, f);
-	fclose(f);
-
-	wav_t header = {0};
-	memcpy(&header, file, sizeof(wav_t));
-	if (memcmp(header.riff_magic, "RIFF", 4) || memcmp(header.riff_fmt, "WAVE", 4) || memcmp(header.fmt_magic, "fmt ", 4)) {
-		printf("Error: \"%s\" is not a valid WAV file\n", fname);
-		free(file);
-		return -4;
-	}
-
-	int off = 0x24;
-	while (memcmp(header.data_magic, "data", 4)) {
-		off += header.data_size + 8;
-		if (off >= sz || off < 0x24) break;
-		memcpy(&header.data_magic, file + off, 8);
-	}
-	if (off >= sz || off < 0x24) {
-		printf("Error: could not find data chunk\n");
-		free(file);
-		return -5;
-	}
-	off += 8;
+void load_samples(audio_t *track, void *buf, int size) {
+	TRACE();
+	if (!track || !buf || size < 1) return;
 
-	//debug_header(&header);
+	int i, n_ch = track->n_ch, bps = track->bps;
+	track->sz = size / (bps * n_ch);
+	TRACE_SAMPLES((long)track->sz * n_ch);
 
-	int n_ch = header.n_channels, bps = (header.bits_per_sample + 7) / 8;
-	if (header.audio_fmt != 1 && header.audio_fmt != 3) {
-		free(file);
-		return -6;
-	}
-	if (n_ch < 1) {
-		free(file);
-		return -7;
-	}
-	if (bps < 1 || (header.audio_fmt == 1 && bps > 4) || (header.audio_fmt == 3 && bps != 4 && bps != 8)) {
-		free(file);
-		return -8;
-	}
+	free_audio_data(track);
+	track->buf = calloc(n_ch, sizeof(void*));
+	for (i = 0; i < n_ch; i++) track->buf[i] = calloc(track->sz, sizeof(float));
 
-	if (name) track->name = strdup(name);
-	track->n_ch = n_ch;
-	track->bps = bps;
-	track->rate = header.sample_rate;
-	track->fmt = header.audio_fmt;
-	load_samples(track, file+off, header.data_size);
+	decode_samples(track, buf, 0, track->sz);
+}
 
+int save_samples(audio_t *track, void *buf) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	use_audio(track);
+	if (!track || !buf || track->sz < 1 || (!track->buf && !track->packed && !track->frames)) return -1;
+
+	// Evicted tracks are faulted in first. Compacted and interleaved tracks have no float buffers, and
+	// are encoded from their packed samples or frames as a WAV save would
+	quantizer_t q;
+	init_quantizer(&q, track);
+	quantize_samples(&q, track, buf, 0, track->sz);
+	close_quantizer(&q);
 	return 0;
 }
 
-void write_wav(audio_t *track, char *fname) {
-	if (!fname || !track || !track->buf || !track->name || track->n_ch < 1 || track->bps < 1 || !track->fmt || track->sz < 1 ||
-	    (track->fmt == 3 && track->bps != 4 && track->bps != 8) || (track->fmt != 3 && track->bps > 4)) {
-		fprintf(stderr, "Invalid audio track\n");
-		return;
-	}
-
-	int sz = track->sz * track->n_ch * track->bps;
-	wav_t header = {0};
-
-	memcpy(header.riff_magic, "RIFF", 4);
-	header.riff_size = sz + 36;
-	memcpy(header.riff_fmt, "WAVE", 4);
-	memcpy(header.fmt_magic, "fmt ", 4);
-	header.fmt_size = 16;
-	header.audio_fmt = track->fmt;
-	header.n_channels = track->n_ch;
-	header.sample_rate = track->rate;
-	header.byte_rate = track->rate * track->n_ch * track->bps;
-	header.block_align = header.byte_rate / track->rate;
-	header.bits_per_sample = track->bps * 8;
-	memcpy(header.data_magic, "data", 4);
-	header.data_size = sz;
-
-	FILE *f = fopen(fname, "wb");
-	if (!f) {
-		fprintf(stderr, "Could not create new file\n");
-		return;
-	}
-	fwrite(&header, sizeof(wav_t), 1, f);
-
-	u8 *file = calloc(sz, 1);
-	save_samples(track, file);
-	fwrite(file, 1, sz, f);
+int load_wav(audio_t *track, char *fname, char *name) {
+	TRACE();
+	if (is_flac(fname)) return load_flac(track, fname, name, NULL);
+	return load_wav_stream(track, fname, name, NULL);
+}
 
-	fclose(f);
-	return;
+void write_wav(audio_t *track, char *fname) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	if (is_flac(fname)) write_flac(track, fname, NULL);
+	else write_wav_stream(track, fname, NULL);
 }
 
 // Audio Editing
 
 void amplify_audio(audio_t *track, float factor) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	expand_audio(track);
 	if (!track || !track->buf || !is_valid(track) || factor == 1.0) return;
 
-	int i, j;
-	for (i = 0; i < track->n_ch; i++) {
-		for (j = 0; j < track->sz; j++) {
-			if (factor > 1.0) track->buf[i][j] = smooth_sample(track->buf[i][j] * factor);
-			else track->buf[i][j] *= factor;
+	// Silent blocks stay silent at any gain, so they are neither read nor touched
+	int i;
+	long j, k, next;
+	for (j = 0; j < track->sz; j = next) {
+		if (silent_run(track, j, track->sz, &next)) continue;
+		for (i = 0; i < track->n_ch; i++) {
+			float *x = track->buf[i];
+			for (k = j; k < next; k++) {
+				if (factor > 1.0) x[k] = smooth_sample(x[k] * factor);
+				else x[k] *= factor;
+			}
 		}
+		touch_range(track, j, next - j);
 	}
 }
 
 void resample_audio(audio_t *track, float factor) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	expand_audio(track);
 	if (!track || !track->buf || !track->sz) return;
 	if (factor <= 0.0) return;
 	if (factor == 1.0) return;
 
-	int i, j, sz = (int)((float)track->sz / factor);
-	for (i = 0; i < track->n_ch; i++) {
-		float *new_buf = calloc(sz, sizeof(float));
+	// The old samples are only replaced once every channel is done, so a cancelled call changes nothing
+	int i, j, sz = (int)((float)track->sz / factor), stop = 0;
+	float **new_buf = calloc(track->n_ch, sizeof(void*));
+	for (i = 0; i < track->n_ch && !stop; i++) {
+		new_buf[i] = calloc(sz, sizeof(float));
 
 		double pos = 0.0;
 		for (j = 0; j < sz; j++) {
+			if (!(j & 0xffff) && (stop = report_progress((long)i * sz + j, (long)track->n_ch * sz))) break;
 			if (pos >= (float)(track->sz-1)) {
-				new_buf[j] = track->buf[i][track->sz-1];
+				new_buf[i][j] = track->buf[i][track->sz-1];
 				break;
 			}
 
@@ -311,26 +336,38 @@ void resample_audio(audio_t *track, float factor) {
 			double r = pos - (double)p;
 			float x = track->buf[i][p], y = track->buf[i][p+1];
 
-			new_buf[j] = x + (float)r * (y-x);
+			new_buf[i][j] = x + (float)r * (y-x);
 			pos += (double)factor;
 		}
-		free(track->buf[i]);
-		track->buf[i] = new_buf;
 	}
 
+	for (i = 0; i < track->n_ch; i++) {
+		if (stop) free(new_buf[i]);
+		else {
+			free(track->buf[i]);
+			track->buf[i] = new_buf[i];
+		}
+	}
+	free(new_buf);
+	if (stop) return;
+
 	track->sz = sz;
+	touch_audio(track);
 }
 
 void mix_audio(audio_t *track, int n_ch) {
-	if (!track || !track->buf || !track->sz || track->n_ch < 1 || n_ch < 1) return;
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	use_audio(track);
+	if (track && track->packed) expand_audio(track);
+	if (!track || (!track->buf && !track->frames) || !track->sz || track->n_ch < 1 || n_ch < 1) return;
 	if (n_ch == track->n_ch) return;
 
-	int i, j;
-	float **new_buf = calloc(n_ch, sizeof(void*));
-	for (i = 0; i < n_ch; i++) new_buf[i] = calloc(track->sz, sizeof(float));
-
-	float pos = 0.0, factor = (float)n_ch / (float)track->n_ch;
-	for (i = 0; i < track->n_ch; i++) {
+	// Each input channel is spread over the output channels its share of the range covers
+	int i, n_in = track->n_ch;
+	float *m = calloc((size_t)n_ch * n_in, sizeof(float));
+	float pos = 0.0, factor = (float)n_ch / (float)n_in;
+	for (i = 0; i < n_in; i++) {
 		float f = factor;
 		while (f > 0.0) {
 			int p = (int)pos;
@@ -344,49 +381,89 @@ void mix_audio(audio_t *track, int n_ch) {
 				pos += f;
 				f = 0.0;
 			}
-			for (j = 0; j < track->sz; j++) new_buf[p][j] += track->buf[i][j] * v;
+			m[p * n_in + i] += v;
 		}
-		free(track->buf[i]);
-		track->buf[i] = NULL;
 	}
-	free(track->buf);
-	track->buf = new_buf;
-	track->n_ch = n_ch;
+	matrix_audio(track, m, n_ch);
+	free(m);
 }
 
 void reverse_audio(audio_t *track) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	if (reverse_packed(track) == 0) {
+		touch_audio(track);
+		return;
+	}
+	int i, j;
+	if (track && track->frames) {
+		size_t frame = track->n_ch * sizeof(float);
+		float *tmp = malloc(frame), *f = track->frames;
+		for (j = 0; j < track->sz / 2; j++) {
+			float *a = f + (size_t)j * track->n_ch, *b = f + (size_t)(track->sz - 1 - j) * track->n_ch;
+			memcpy(tmp, a, frame);
+			memcpy(a, b, frame);
+			memcpy(b, tmp, frame);
+		}
+		free(tmp);
+		touch_audio(track);
+		return;
+	}
 	if (!track || !is_valid(track)) return;
 
 	float *buf = calloc(track->sz, sizeof(float));
-	int i, j;
 	for (i = 0; i < track->n_ch; i++) {
 		memcpy(buf, track->buf[i], track->sz * sizeof(float));
 		for (j = 0; j < track->sz; j++) track->buf[i][j] = buf[track->sz-j-1];
 	}
 	free(buf);
+	touch_audio(track);
 }
 
 void resize_audio(audio_t *track, int sz) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)sz * track->n_ch : 0);
 	if (!track || sz < 1) return;
+	expand_audio(track);
 	if (!track->buf) {
 		if (track->n_ch < 1) return;
 		track->buf = calloc(track->n_ch, sizeof(void*));
 	}
 
-	int i;
+	int i, old = track->sz;
 	for (i = 0; i < track->n_ch; i++) {
 		track->buf[i] = realloc(track->buf[i], sz * sizeof(float));
-		if (sz > track->sz) memset(track->buf[i] + track->sz, 0, (sz - track->sz) * sizeof(float));
+		if (sz > track->sz) zero_samples(track->buf[i] + track->sz, (long)(sz - track->sz) * sizeof(float));
 	}
+	if (sz < track->sz) touch_range(track, sz, track->sz - sz);
+	else touch_range(track, track->sz, 0);
 	track->sz = sz;
+	if (sz > old) mark_silent(track, old, sz - old);
 }
 
 void remove_audio(audio_t *track, int offset, int size) {
-	if (!track || !is_valid(track) || offset < 0 || offset >= track->sz || !size) return;
+	TRACE();
+	TRACE_SAMPLES(track ? (long)size * track->n_ch : 0);
+	use_audio(track);
+	if (!track || (!is_valid(track) && !track->packed && !track->frames) || offset < 0 || offset >= track->sz || !size) return;
 	if (size < 0 || size > track->sz) size = track->sz;
 	if (offset+size > track->sz) size = track->sz - offset;
 
+	shift_source(track, offset, -size);
+	if (remove_packed(track, offset, size) == 0) {
+		touch_range(track, offset, 0);
+		return;
+	}
+
 	int i, j, p, sz = track->sz - size;
+	if (track->frames) {
+		float *f = track->frames;
+		memmove(f + (size_t)offset * track->n_ch, f + (size_t)(offset + size) * track->n_ch, (size_t)(sz - offset) * track->n_ch * sizeof(float));
+		track->frames = realloc(f, (size_t)sz * track->n_ch * sizeof(float) + 1);
+		track->sz = sz;
+		touch_range(track, offset, 0);
+		return;
+	}
 	for (i = 0; i < track->n_ch; i++) {
 		float *buf = calloc(sz, sizeof(float));
 		for (j = 0, p = 0; j < sz; j++, p++) {
@@ -397,10 +474,25 @@ void remove_audio(audio_t *track, int offset, int size) {
 		track->buf[i] = buf;
 	}
 	track->sz = sz;
+	touch_range(track, offset, 0);
 }
 
 void apply_audio(audio_t *dst, audio_t *src, int offset, int size, float amplitude, int insert) {
-	if (!dst || !is_valid(src) || size < 1) return;
+	TRACE();
+	TRACE_SAMPLES(src ? (long)(size > 0 ? size : src->sz) * src->n_ch : 0);
+	if (!dst || !src) return;
+
+	// Compacted tracks of the same layout are spliced without converting their samples
+	int old = dst->sz;
+	if (insert && size == src->sz && insert_packed(dst, src, offset) == 0) {
+		shift_source(dst, offset, src->sz);
+		touch_range(dst, offset, src->sz);
+		if (offset > old) mark_silent(dst, old, offset - old);
+		return;
+	}
+	expand_audio(dst);
+	expand_audio(src);
+	if (!is_valid(src) || size < 1) return;
 
 	if (dst->n_ch < 1) dst->n_ch = src->n_ch;
 	if (dst->bps < 1) dst->bps = src->bps;
@@ -408,19 +500,33 @@ void apply_audio(audio_t *dst, audio_t *src, int offset, int size, float amplitu
 	if (!dst->fmt) dst->fmt = src->fmt;
 
 	int i, j, alt = 1;
-	audio_t track = {0};
+	audio_t track = {0}, *conv = NULL;
 	if (src) {
 		char *name = track.name;
 		memcpy(&track, src, sizeof(audio_t));
+		track.stats = NULL;
+		track.source = NULL;
+		track.silent = NULL;
+		track.conv = NULL;
 		if (name) track.name = name;
 		else track.name = strdup(track.name);
 
-		if (src->rate != dst->rate || src->n_ch != dst->n_ch || dst == src || !name) {
+		// A source at another rate or channel count is read from its converted copy, which later
+		// calls share until the source changes
+		if (src->rate != dst->rate || src->n_ch != dst->n_ch) {
+			free(track.name);
+			conv = convert_source(src, dst->rate, dst->n_ch);
+			if (!conv) return;
+			memcpy(&track, conv, sizeof(audio_t));
+			alt = 0;
+		}
+		else if (dst == src || !name) {
 			track.buf = calloc(track.n_ch, sizeof(void*));
 			for (i = 0; i < track.n_ch; i++) {
 				track.buf[i] = malloc(track.sz * sizeof(float));
-				memcpy(track.buf[i], src->buf[i], track.sz * sizeof(float));
+				copy_sound(src, track.buf[i], src->buf[i], sizeof(float), 1);
 			}
+			copy_silent(&track, src);
 
 			resample_audio(&track, (float)dst->rate / (float)track.rate);
 			track.rate = dst->rate;
@@ -431,16 +537,25 @@ void apply_audio(audio_t *dst, audio_t *src, int offset, int size, float amplitu
 	}
 	else {
 		memcpy(&track, dst, sizeof(audio_t));
+		track.stats = NULL;
+		track.source = NULL;
+		track.silent = NULL;
 		track.buf = calloc(track.n_ch, sizeof(void*));
 	}
 	track.name = NULL;
 
+	// The shared copy is only ever read, so it is cut short in place but padded on a copy of its own
+	if (conv && size > 0 && size < track.sz) track.sz = size;
+	else if (conv && size > track.sz) transfer_audio(&track, conv);
+
 	if (size > 0 && size != track.sz) {
+		int old = track.sz;
 		for (i = 0; i < track.n_ch; i++) {
 			track.buf[i] = realloc(track.buf[i], size * sizeof(void*));
-			if (size > track.sz) memset(track.buf[i] + track.sz, 0, (size - track.sz) * sizeof(float));
+			if (size > track.sz) zero_samples(track.buf[i] + track.sz, (long)(size - track.sz) * sizeof(float));
 		}
 		track.sz = size;
+		mark_silent(&track, old, size - old);
 		alt = 1;
 	}
 
@@ -450,6 +565,7 @@ void apply_audio(audio_t *dst, audio_t *src, int offset, int size, float amplitu
 	}
 
 	int sz = 0;
+	old = dst->sz;
 	for (i = 0; i < dst->n_ch; i++) {
 		sz = dst->sz;
 		int off = offset;
@@ -458,12 +574,11 @@ void apply_audio(audio_t *dst, audio_t *src, int offset, int size, float amplitu
 			if (insert && off < track.sz) off = track.sz;
 			dst->buf[i] = realloc(dst->buf[i], (sz + off) * sizeof(float));
 			memmove(dst->buf[i] + off, dst->buf[i], sz * sizeof(float));
+			zero_samples(dst->buf[i], (long)off * sizeof(float));
 			if (insert) {
-				memset(dst->buf[i], 0, off * sizeof(float));
 				memcpy(dst->buf[i], track.buf[i], track.sz * sizeof(float));
 				continue;
 			}
-			memset(dst->buf[i], 0, off * sizeof(float));
 			sz += off;
 			off = 0;
 		}
@@ -474,38 +589,67 @@ void apply_audio(audio_t *dst, audio_t *src, int offset, int size, float amplitu
 			dst->buf[i] = realloc(dst->buf[i], (dst->sz + move + track.sz) * sizeof(float));
 
 			if (off < dst->sz) memmove(dst->buf[i] + off+track.sz, dst->buf[i] + off, (dst->sz - off) * sizeof(float));
-			else memset(dst->buf[i] + dst->sz, 0, (move + track.sz) * sizeof(float));
+			else zero_samples(dst->buf[i] + dst->sz, (long)move * sizeof(float));
 
 			memcpy(dst->buf[i] + off, track.buf[i], track.sz * sizeof(float));
 		}
 		else {
 			if (off+track.sz > sz) {
 				dst->buf[i] = realloc(dst->buf[i], (off + track.sz) * sizeof(float));
-				memset(dst->buf[i] + sz, 0, ((off + track.sz) - sz) * sizeof(float));
+				zero_samples(dst->buf[i] + sz, (long)((off + track.sz) - sz) * sizeof(float));
 				sz = off + track.sz;
 			}
 
-			for (j = 0; j < track.sz && j < sz - off; j++) {
-				if (track.buf[i][j] == 0.0 && amplitude <= 1.0) dst->buf[i][off+j] = track.buf[i][j] * amplitude;
-				else dst->buf[i][off+j] = smooth_sample(dst->buf[i][off+j] + track.buf[i][j] * amplitude);
+			// Where both tracks are known to be silent the sum is too. The destination's blocks
+			// are only where they were if it did not grow at the front
+			long n = track.sz < sz - off ? track.sz : sz - off, next, end;
+			for (j = 0; j < n; j = next) {
+				int quiet = silent_run(&track, j, n, &next);
+				if (quiet) {
+					quiet = offset >= 0 && silent_run(dst, off + j, off + next, &end);
+					if (offset >= 0) next = end - off;
+				}
+				if (quiet) continue;
+
+				for (; j < next; j++) {
+					if (track.buf[i][j] == 0.0 && amplitude <= 1.0) dst->buf[i][off+j] = track.buf[i][j] * amplitude;
+					else dst->buf[i][off+j] = smooth_sample(dst->buf[i][off+j] + track.buf[i][j] * amplitude);
+				}
 			}
 		}
 	}
 	if (insert) dst->sz += track.sz;
 	else dst->sz = sz;
 
+	// Only the frames written to are dirty, unless the track grew at the front
+	if (offset < 0) {
+		touch_audio(dst);
+		mark_silent(dst, track.sz, -offset - track.sz);
+	}
+	else {
+		if (insert) shift_source(dst, offset, track.sz);
+		touch_range(dst, offset, track.sz);
+		if (offset > old) mark_silent(dst, old, offset - old);
+	}
+
 	if (alt) close_audio(&track);
 }
 
 void add_audio(audio_t *dst, audio_t *src, int offset, int size, float amplitude) {
+	TRACE();
 	apply_audio(dst, src, offset, size, amplitude, 0);
 }
 
 void insert_audio(audio_t *dst, audio_t *src, int offset, int size, float amplitude) {
+	TRACE();
 	apply_audio(dst, src, offset, size, amplitude, 1);
 }
 
 void replace_channel(audio_t *dst, audio_t *src, int dst_ch, int src_ch) {
+	TRACE();
+	TRACE_SAMPLES(src ? src->sz : 0);
+	expand_audio(dst);
+	expand_audio(src);
 	if (!dst || !is_valid(src) || dst_ch < 0 || src_ch < 0 ||
 	   (is_valid(dst) && dst_ch >= dst->n_ch) ||
 	   (!is_valid(dst) && dst_ch > 0) ||
@@ -530,6 +674,7 @@ void replace_channel(audio_t *dst, audio_t *src, int dst_ch, int src_ch) {
 		memset(dst->buf[dst_ch], 0, dst->sz * sizeof(float));
 	}
 	memcpy(dst->buf[dst_ch], src->buf[src_ch], dst->sz);
+	touch_audio(dst);
 }
 
 void fcopy(float *dst, float *src, int dst_sz, int src_sz) {
@@ -541,6 +686,10 @@ void fcopy(float *dst, float *src, int dst_sz, int src_sz) {
 }
 
 void insert_channel(audio_t *dst, audio_t *src, int dst_ch, int src_ch) {
+	TRACE();
+	TRACE_SAMPLES(src ? src->sz : 0);
+	expand_audio(dst);
+	expand_audio(src);
 	if (!dst || !src || !is_valid(src) || src_ch < 0 || src_ch >= src->n_ch) return;
 
 	int i;
@@ -587,9 +736,13 @@ void insert_channel(audio_t *dst, audio_t *src, int dst_ch, int src_ch) {
 		dst->buf[dst_ch] = calloc(dst->sz, sizeof(float));
 		fcopy(dst->buf[dst_ch], src->buf[src_ch], dst->sz, src->sz);
 	}
+	touch_audio(dst);
 }
 
 void remove_channel(audio_t *track, int ch) {
+	TRACE();
+	TRACE_SAMPLES(track ? track->sz : 0);
+	expand_audio(track);
 	if (!track || !is_valid(track) || ch < 0 || ch >= track->n_ch) return;
 	free(track->buf[ch]);
 
@@ -597,4 +750,5 @@ void remove_channel(audio_t *track, int ch) {
 	for (i = ch; i < track->n_ch; i++) track->buf[i] = track->buf[i+1];
 
 	track->buf[--track->n_ch] = NULL;
+	touch_audio(track);
 }
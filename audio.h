@@ -5,6 +5,36 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Tracing. Built with -DAUDIO_TRACE, the public functions record a span with their duration, the
+// samples they processed and the bytes allocated on their thread while a trace is running.
+// Without it the hooks compile to nothing
+typedef struct {
+	const char *name;
+	double start;
+	long samples, bytes;
+} trace_span_t;
+
+trace_span_t trace_begin(const char *name);
+void trace_end(trace_span_t *s);
+void *trace_malloc(size_t n);
+void *trace_calloc(size_t n, size_t sz);
+void *trace_realloc(void *p, size_t n);
+
+#ifdef AUDIO_TRACE
+#define TRACE() trace_span_t trace_span __attribute__((cleanup(trace_end))) = trace_begin(__func__)
+#define TRACE_SAMPLES(n) (trace_span.samples = (n))
+#define malloc(n) trace_malloc(n)
+#define calloc(n, sz) trace_calloc(n, sz)
+#define realloc(p, n) trace_realloc(p, n)
+#else
+#define TRACE()
+#define TRACE_SAMPLES(n)
+#endif
+
+int trace_start(); // -1 if tracing was not compiled in
+void trace_stop();
+int trace_dump(char *fname); // Chrome trace JSON of the recorded spans; returns how many were written
+
 typedef struct {
 	char riff_magic[4];
 	int riff_size;
@@ -21,6 +51,55 @@ typedef struct {
 	int data_size;
 } wav_t;
 
+typedef struct {
+	char id[4];
+	long off;   // Of the chunk's contents, past its 8 byte header
+	long size;  // Cut short at the end of the file
+} wav_chunk_t;
+
+typedef struct {
+	char name[64];
+	long start, len; // Frames
+} wav_marker_t;
+
+typedef struct {
+	wav_t header;        // fmt and data as a plain WAV header would have them. Extensible formats give their sub-format
+	long data_off;
+	wav_chunk_t *chunks;
+	int n_chunks;
+	wav_marker_t *markers; // Sorted by start
+	int n_markers;
+} wav_index_t;
+
+typedef struct {
+	int version;    // audio_t version the statistics were taken from
+	int n_ch;
+	float *peak;    // Per channel: largest absolute sample
+	double *rms;    // Per channel: root mean square
+	double *dc;     // Per channel: mean (DC offset)
+	int *clips;     // Per channel: number of samples at or beyond full scale
+	float peak_all; // Largest absolute sample of any channel
+	double lufs;    // EBU R128 integrated loudness, -INFINITY if the track is silent
+} audio_stats_t;
+
+typedef struct {
+	long start;  // First frame of the track
+	long len;
+	long src;    // First frame in the source file
+} span_t;
+
+typedef struct {
+	char *path;
+	long data_off; // Offset of the data chunk's samples
+	int n_ch, bps, fmt;
+	long frames;
+	long size;     // File size and modification time when it was loaded
+	long mtime;
+	long dev, ino;
+	span_t *span;  // Ranges of the track still equal to the file, in order
+	int n_span;
+} source_t;
+
 typedef struct {
 	char *name;  // File name
 	int n_ch;    // Number of channels
@@ -29,19 +108,135 @@ typedef struct {
 	int fmt;     // WAV format. 1 = Integer PCM, 3 = Floating-point. Other values are not supported.
 	float **buf; // An array of sample buffers, one for each channel
 	int sz;      // Length in samples
+	int dither;  // Quantization used when saving as integer PCM. See DITHER_*
+	int version; // Incremented by every change to the samples
+	audio_stats_t *stats; // Cached analysis, dropped by touch_audio()
+	int store;   // Precision the samples are kept in between edits. See STORE_*
+	void **packed; // While compacted: one array of 'store' samples per channel, and buf is NULL
+	int spilled; // 1 = float samples, 2 = packed samples, 3 = interleaved frames were evicted to the scratch file
+	long spill_off; // Where the evicted samples are in the scratch file
+	int spill_fd; // Descriptor of the snapshot holding the evicted samples, shared by its tracks. 0 for the scratch file
+	unsigned long used; // Ordering of the last access, for least recently used eviction
+	source_t *source; // The WAV file the track was loaded from and which parts are unchanged, or NULL
+	unsigned char *silent; // Per SILENT_BLOCK frames: 1 if the block is known to be zero in every channel
+	long n_silent; // Number of blocks in 'silent'
+	int layout;  // Sample order kept between edits. See LAYOUT_*
+	float *frames; // While interleaved: sz frames of n_ch floats each, and buf is NULL
+	struct conversions *conv; // Copies converted for add/insert, dropped by touch_audio(). See convert_source()
 } audio_t;
 
+// Sample storage precisions
+#define STORE_FLOAT 0 // 32-bit float, the working format
+#define STORE_INT8  1
+#define STORE_INT16 2
+#define STORE_INT24 3 // packed in 3 bytes
+#define STORE_INT32 4
+#define STORE_HALF  5 // IEEE 754 half precision
+
+// Sample layouts
+#define LAYOUT_PLANAR      0 // one array per channel, the working layout
+#define LAYOUT_INTERLEAVED 1 // frame-major, for per-frame work across many channels
+
+// Quantization modes for saving integer PCM
+#define DITHER_NONE   0 // round to nearest
+#define DITHER_TPDF   1 // triangular dither of +/- 1 LSB
+#define DITHER_SHAPED 2 // triangular dither with second order noise shaping
+
+typedef struct {
+	int mode;          // One of DITHER_*
+	int n_ch;
+	unsigned int seed[8]; // Dither generator state, one per vector lane
+	float *err;        // Noise shaping error history, two per channel
+} quantizer_t;
+
+typedef void (*task_fn)(void *ctx, int task, int thread);
+
+typedef struct {
+	long done, total; // Units of work of the current step, read from other threads
+	int cancel;
+} progress_t;
+
+typedef struct {
+	double wall; // Seconds from opening to closing the file
+	double io;   // Seconds the I/O thread spent reading or writing
+	double cpu;  // Seconds spent converting samples
+	long bytes;  // Number of sample data bytes transferred
+} io_stats_t;
+
+// Biquad filter types
+#define FILTER_LOWPASS   0
+#define FILTER_HIGHPASS  1
+#define FILTER_BANDPASS  2
+#define FILTER_NOTCH     3
+#define FILTER_PEAK      4
+#define FILTER_LOWSHELF  5
+#define FILTER_HIGHSHELF 6
+
+#define FILTER_LANES 8 // channels filtered together in one vector
+
+typedef struct {
+	float b0, b1, b2, a1, a2; // Normalised coefficients (a0 = 1)
+} biquad_t;
+
+typedef struct {
+	int n_ch;      // Number of channels
+	int n_grp;     // Number of FILTER_LANES wide channel groups
+	int n_sec;     // Number of cascaded sections
+	biquad_t *sec; // Section coefficients, shared by every channel
+	float *z;      // Filter state, kept between calls so blocks can be filtered one after another
+} filter_t;
+
+typedef struct {
+	int n;         // Transform size, a power of two
+	int *rev;      // Bit-reversal permutation for the n/2 point complex pass
+	float *tw_re;  // Twiddle factors for the complex pass
+	float *tw_im;
+	float *rtw_re; // Twiddle factors for splitting the packed real transform
+	float *rtw_im;
+	float *re;     // Scratch buffers, n/2 each
+	float *im;
+} fft_t;
+
+typedef struct {
+	int block;    // Partition size in samples. The FFT size is twice this
+	int n_part;   // Number of impulse response partitions
+	int ir_len;   // Impulse response length in samples
+	int n_in;     // Number of input channels
+	int n_out;    // Number of output channels
+	int n_ir;     // Number of impulse response channels
+	int matrix;   // 1 = every input feeds every output (true stereo), 0 = one IR per channel
+	int pos;      // Current slot in the frequency-domain delay line
+	fft_t fft;
+	float **ir;   // IR partition spectra, one array per IR channel
+	float **fdl;  // Frequency-domain delay line of input spectra, one array per input channel
+	float **hist; // The previous and current input block, one array per input channel
+	float *acc;   // Output spectrum accumulator
+	float *tmp;   // Time-domain scratch buffer
+} convolver_t;
+
 // Custom Clipping Reduction
 float smooth_sample(float x);
 
+int is_valid(audio_t *t);
+void fcopy(float *dst, float *src, int dst_sz, int src_sz);
+
 // audio_t Constructor
 int create_audio(audio_t *track, int n_ch, int bps, int rate, int fmt, int sz, char *name);
 
 // Create a copy of an existing audio track so that is has no reference to the original
 void transfer_audio(audio_t *dst, audio_t *src);
 
+// A view of frames [offset, offset+size) of a track that shares its samples instead of copying them.
+// It is only valid while the track is not changed, and is released with free_slice(), not close_audio()
+int slice_audio(audio_t *dst, audio_t *src, long offset, long size);
+void free_slice(audio_t *slice);
+
 void rename_audio(audio_t *track, char *name);
 
+// Must be called after changing the samples of a track directly, invalidates everything cached about them
+void touch_audio(audio_t *track);
+void touch_range(audio_t *track, long offset, long size); // the same, for changes only to frames [offset, offset+size)
+
 // audio_t Destructors
 void free_audio_data(audio_t *track); // frees all memory containing audio channel data
 void close_audio(audio_t *track); // frees and resets all memory and variables in an audio_t struct
@@ -52,11 +247,30 @@ void debug_header(wav_t *h, FILE *file);
 // I/O functions
 double read_sample(void *ptr, int len, int wavfmt);
 void write_sample(void *ptr, double sample, int len, int wavfmt);
+void decode_samples(audio_t *track, void *buf, int offset, int n); // n interleaved frames -> track samples [offset, offset+n)
+void encode_samples(audio_t *track, void *buf, int offset, int n); // track samples [offset, offset+n) -> n interleaved frames
+void quantize_samples(quantizer_t *q, audio_t *track, void *buf, int offset, int n); // encode_samples() with dither state
+int init_quantizer(quantizer_t *q, audio_t *track);
+void close_quantizer(quantizer_t *q);
 void load_samples(audio_t *track, void *buf, int size);
-void save_samples(audio_t *track, void *buf);
+int save_samples(audio_t *track, void *buf); // -1 if the track holds no samples
 int load_wav(audio_t *track, char *fname, char *name);
 void write_wav(audio_t *track, char *fname);
 
+// WAV chunk index, built from the chunk headers alone. Cue points (named by LIST adtl labl notes,
+// sized by ltxt notes or else running to the next cue) and sampler loops become named regions
+int index_wav(FILE *f, wav_index_t *idx); // -3 = too small, -4 = not a WAV file, -5 = no data chunk
+void free_wav_index(wav_index_t *idx);
+wav_marker_t *find_marker(wav_index_t *idx, char *name);
+
+// Pipelined I/O: a dedicated thread reads or writes one buffer while the previous one is converted
+int read_wav_header(FILE *f, wav_t *header, long *data_off);
+void make_wav_header(audio_t *track, wav_t *header); // the header of a plain WAV holding the whole track
+int load_wav_stream(audio_t *track, char *fname, char *name, io_stats_t *st);
+int load_wav_region(audio_t *track, char *fname, char *name, char *region, io_stats_t *st); // only the frames of a named region, the whole file if NULL
+int write_wav_stream(audio_t *track, char *fname, io_stats_t *st);
+double io_overlap(io_stats_t *st); // fraction of the shorter of I/O and conversion time hidden behind the other
+
 // Audio Effects
 void amplify_audio(audio_t *track, float factor);
 void resample_audio(audio_t *track, float factor);
@@ -75,4 +289,270 @@ void replace_channel(audio_t *dst, audio_t *src, int dst_ch, int src_ch);
 void insert_channel(audio_t *dst, audio_t *src, int dst_ch, int src_ch);
 void remove_channel(audio_t *track, int ch);
 
+// FFT (real input, unnormalised: fft_inverse(fft_forward(x)) == n * x)
+int fft_init(fft_t *p, int n);
+void fft_close(fft_t *p);
+void fft_forward(fft_t *p, float *in, float *out_re, float *out_im); // n samples -> n/2+1 bins
+void fft_inverse(fft_t *p, float *in_re, float *in_im, float *out);  // n/2+1 bins -> n samples
+
+// Uniformly partitioned overlap-save convolution
+// In matrix mode the IR holds n_in * n_out channels ordered input-major (LL, LR, RL, RR for stereo)
+int create_convolver(convolver_t *c, audio_t *ir, int n_in, int block, int matrix);
+void run_convolver(convolver_t *c, float **in, float **out); // processes one block; a NULL input is silence
+void reset_convolver(convolver_t *c);
+void close_convolver(convolver_t *c);
+int convolve_audio(audio_t *dst, audio_t *src, audio_t *ir, int block);
+
+// Cascaded biquad filters
+// freq is in Hz, res is the Q factor (<= 0 for 1/sqrt(2)), gain is in dB and only used by peak and shelf filters
+int design_biquad(biquad_t *q, int type, float freq, float res, float gain, int rate);
+int create_filter(filter_t *f, int n_ch);
+int add_biquad(filter_t *f, int type, float freq, float res, float gain, int rate);
+int add_section(filter_t *f, biquad_t *q);
+void run_filter(filter_t *f, float **buf, int n); // filters n samples of each channel in place
+void reset_filter(filter_t *f);
+void close_filter(filter_t *f);
+void filter_audio(audio_t *track, filter_t *f);
+int antialias_audio(audio_t *track, int rate); // low-pass a track before it is downsampled to 'rate'
+
+// Track statistics, computed in one pass and cached on the track until it changes
+#define NORMALIZE_PEAK 0 // target is in dBFS
+#define NORMALIZE_LUFS 1 // target is in LUFS
+audio_stats_t *analyze_audio(audio_t *track);
+int normalize_audio(audio_t *track, float target, int mode);
+
+// Compact storage. Kernels that work on floats call expand_audio() first; copies, cuts, inserts,
+// reversal and saving work on the compacted samples directly
+int store_size(int store); // bytes per sample
+int native_store(audio_t *track); // the precision of the track's WAV format
+void pack_block(void *dst, float *src, int n, int store);
+void unpack_block(float *dst, void *src, int n, int store);
+int compact_audio(audio_t *track, int store);
+void expand_audio(audio_t *track);
+void free_packed(audio_t *track);
+long audio_memory(audio_t *track); // bytes held by sample data, converted copies included
+int copy_packed(audio_t *dst, audio_t *src);
+int remove_packed(audio_t *track, int offset, int size);
+int reverse_packed(audio_t *track);
+int insert_packed(audio_t *dst, audio_t *src, int offset);
+void read_channel(audio_t *track, int ch, int offset, int n, float *dst);
+
+// Out-of-core tracks. Evicted samples live in an unlinked scratch file and are faulted back in
+// by use_audio(), which every function reading samples calls first (directly or via expand_audio())
+int set_scratch_dir(char *dir); // must be called before the first eviction. Default is $TMPDIR or /tmp
+int spill_audio(audio_t *track);
+int fault_audio(audio_t *track);
+void release_spill(audio_t *track); // drops evicted samples without reading them back
+void use_audio(audio_t *track);
+
+// Session snapshots. The samples of each track are written as they are kept, page aligned, so
+// loading only reads the index: the tracks come back evicted to the snapshot and use_audio()
+// maps each one in the first time it is needed
+int save_snapshot(char *fname, audio_t **tracks, int n);
+int load_snapshot(char *fname, audio_t **tracks); // returns the track count, *tracks is an array of them
+
+// FLAC: LPC and Rice coded frames, encoded and decoded on every core. Files carry a seek table
+int is_flac(char *fname); // by extension
+int load_flac(audio_t *track, char *fname, char *name, io_stats_t *st);
+int write_flac(audio_t *track, char *fname, io_stats_t *st); // integer PCM of up to 24 bits
+
+// Source tracking. Saving copies the spans still equal to the source file instead of encoding them
+void set_source(audio_t *track, char *path, long data_off);
+void free_source(audio_t *track);
+void copy_source(audio_t *dst, audio_t *src);
+void dirty_range(audio_t *track, long offset, long size);
+void shift_source(audio_t *track, long offset, long delta); // frames from offset on moved by delta
+int source_usable(audio_t *track); // the format matches and the file has not changed since loading
+long clean_frames(audio_t *track);
+
+// In-place saves. When a track has the length and format of the file it came from and is saved over
+// it, only the dirty ranges are written, through a journal that makes the update all or nothing
+int can_save_in_place(audio_t *track, char *fname);
+int save_in_place(audio_t *track, char *fname, io_stats_t *st);
+int replay_journal(char *fname); // finishes an interrupted save, 1 if there was one to finish, negative if it could not be
+
+// Test signal generators, appending frames to a track. Every block of frames is computed from its
+// position alone, so the result does not depend on how many threads fill it
+#define GEN_SILENCE 0
+#define GEN_SINE    1 // freq[0]
+#define GEN_TONES   2 // n_freq sines of equal level
+#define GEN_SWEEP   3 // exponential sweep from freq[0] to freq[1] over the generated frames
+#define GEN_WHITE   4
+#define GEN_PINK    5
+#define GEN_IMPULSE 6 // one sample at amp every period frames, or only the first if period < 1
+
+#define GEN_MAX_TONES 8
+
+typedef struct {
+	int kind;   // One of GEN_*
+	float amp;  // Peak level of tones, sweeps and impulses, and of the white noise pink noise is made from
+	float freq[GEN_MAX_TONES]; // Hz
+	int n_freq;
+	long period;
+	unsigned int seed;
+} gen_t;
+
+int generate_audio(audio_t *track, int size, gen_t *g);
+
+// Real-time rendering. A producer thread runs the chain into a lock-free ring and a consumer thread
+// hands the sink one period per tick of its clock, counting the periods the producer missed
+typedef struct render_sink_s render_sink_t;
+struct render_sink_s {
+	int (*open)(render_sink_t *s, int n_ch, int rate, int period); // optional
+	void (*write)(render_sink_t *s, float *buf, int n); // n interleaved frames, a period or fewer, on the consumer thread
+	void (*close)(render_sink_t *s);                    // optional
+	void *ctx;   // State of other sinks
+	char *path;  // File sink
+	FILE *f;
+	int n_ch, rate;
+	long frames;
+};
+
+typedef struct {
+	int period;          // Frames per callback
+	int periods;         // Ring size in periods, 4 if < 2
+	double speed;        // 1 = real time, 0 = as fast as the sink takes the periods
+	float gain;          // Chain, in this order. Filter and convolver state carries across blocks
+	filter_t *filter;    // Optional
+	convolver_t *conv;   // Optional, sets the block size of the producer
+} render_opts_t;
+
+typedef struct {
+	long periods, frames, xruns;
+	double wall;
+	double latency[5];   // Seconds from deadline to the period being delivered: 50th, 90th, 99th, 99.9th percentile, max
+	double headroom[5];  // Seconds of audio buffered at each callback: min, 1st, 10th, 50th percentile, max
+} render_stats_t;
+
+int render_audio(audio_t *track, render_sink_t *sink, render_opts_t *o, render_stats_t *st);
+void null_sink(render_sink_t *s);
+void file_sink(render_sink_t *s, char *path); // 32-bit float WAV
+
+// Sparse silence. Blocks known to be zero are skipped by the kernels, and zero-filling gives whole
+// pages back to the system, so untouched silence takes no memory until something is written there
+#define SILENT_BLOCK 16384 // frames
+void zero_samples(void *p, long bytes); // memset(p, 0, bytes) for heap memory, releasing the pages inside
+void mark_silent(audio_t *track, long offset, long size); // frames [offset, offset+size) are zero, call after changing track->sz
+void forget_silent(audio_t *track, long offset, long size); // size < 0 forgets everything from offset on
+void free_silent(audio_t *track);
+void copy_silent(audio_t *dst, audio_t *src);
+int silent_run(audio_t *track, long offset, long end, long *next); // 1 if [offset, *next) is silent, 0 if it may not be
+long silent_frames(audio_t *track);
+void copy_sound(audio_t *track, void *dst, void *src, int es, int fill); // a channel of es byte samples, zero-filling silence if fill
+int find_silence(audio_t *track); // marks and releases the blocks that are zero; returns how many were found
+
+// Activity detection. Block energies are measured on every core, then the blocks above the
+// threshold are joined into regions
+typedef struct {
+	long start, len; // frames
+} region_t;
+
+typedef struct {
+	float threshold; // dBFS: a block is active when its RMS over all channels is above it
+	int block;       // frames per measurement, 10 ms if < 1
+	long hangover;   // frames a region stays open after its last active block
+	long min_len;    // shorter regions are dropped
+} detect_t;
+
+int detect_activity(audio_t *track, detect_t *d, region_t **regions); // returns the number of regions in *regions
+int split_audio(audio_t *track, region_t *regions, int n, char *prefix); // regions to <prefix>0001.wav... in parallel
+
+// Interleaved tracks keep every frame contiguous, so matrixing many channels and WAV I/O need no
+// gather. Kernels that work on channels call expand_audio(), which makes the track planar again
+int interleave_audio(audio_t *track); // also expands a compacted track, interleaving is float only
+void deinterleave_audio(audio_t *track);
+int matrix_audio(audio_t *track, float *m, int n_out); // output o = sum over i of m[o*n_ch+i] * input i
+
+// Timelines. Clips are rendered in one pass over the output, a tile of frames per task. A source
+// whose rate or channel count differs from the output is converted once for all its clips
+typedef struct {
+	char *name;     // Source track as named in an EDL file
+	audio_t *src;   // Source track, set by the caller for clips read from a file
+	long src_off;   // First source frame
+	long len;       // Source frames, < 1 for the rest of the source
+	long dst_off;   // First output frame
+	float gain;     // Linear
+	long fade_in, fade_out; // Output frames ramped up from and down to silence at the ends of the clip
+} clip_t;
+
+// The output takes the sample format of the first clip's source, and its rate and channel count
+// unless they are given. Clips overlapping in time are summed
+int render_timeline(audio_t *dst, char *name, clip_t *clips, int n, int n_ch, int rate);
+int read_edl(char *fname, clip_t **clips); // "<track> <src_off> <len> <dst_off> [gain] [fade in] [fade out]" per line; returns the clip count
+void free_edl(clip_t *clips, int n);
+
+// Dynamics. The gain follows the peak level of each frame through a static curve, attack and
+// release, and a moving average over the lookahead. Linked channels share one gain
+#define DYN_COMPRESS 0
+#define DYN_LIMIT    1 // brickwall: with a lookahead, no peak ends up above the threshold
+#define DYN_GATE     2
+
+typedef struct {
+	int mode;        // One of DYN_*
+	float threshold; // dBFS
+	float ratio;     // Compressor: dB of input above the threshold per dB of output
+	float range;     // Gate: gain while closed, in dB
+	float attack;    // ms to move towards more reduction, or for a gate to open. The limiter's is the lookahead
+	float release;   // ms
+	float lookahead; // ms
+	float makeup;    // dB of gain after the processing
+	int link;        // 1 = every channel gets the same gain
+	float reduction; // Set by dynamics_audio(): the largest gain reduction applied, in dB
+} dynamics_t;
+
+int dynamics_audio(audio_t *track, dynamics_t *d);
+
+// Alignment. Cross-correlation of the mono mixdowns, first decimated to about 1 kHz over every
+// offset through one FFT, then at full rate around the best one over the loudest stretch of src
+typedef struct {
+	long max_offset;  // Frames either way, < 1 for any
+	int any_polarity; // 1 = src may be inverted relative to dst
+	long offset;      // Set by align_audio(): the dst frame src's first frame lines up with, negative if src starts first
+	int polarity;     // Set: 1, or -1 when src is inverted
+	float confidence; // Set: correlation coefficient at the offset, 0...1
+} align_t;
+
+int align_audio(audio_t *dst, audio_t *src, align_t *a); // tracks of the same rate
+
+// Gain envelopes. Breakpoints give the gain at frames, and from each one the gain ramps to the next
+// along the shape it names. Gains are plain multipliers, so above 1 the samples are not soft clipped
+#define RAMP_LINEAR 0
+#define RAMP_EXP    1 // equal steps in dB, from or to -80 dB where an end is silent
+#define RAMP_SCURVE 2 // smoothstep: flat at both ends
+
+typedef struct {
+	long at;     // Frame
+	float gain;  // Linear
+	int shape;   // RAMP_* of the ramp to the next breakpoint
+} breakpoint_t;
+
+// Applies to frames [offset, offset+size), size < 1 for the rest of the track. The gain holds the
+// first point's before it and the last point's after it. Points must be in order
+int envelope_audio(audio_t *track, breakpoint_t *pts, int n, long offset, long size);
+int fade_audio(audio_t *track, long offset, long size, float from, float to, int shape); // reaches 'to' on the last frame
+// insert_audio() with the clip crossfaded over the 'fade' frames before and after offset, which it replaces
+int insert_crossfade(audio_t *dst, audio_t *src, int offset, int size, float amplitude, long fade, int shape);
+
+// Conversion cache. A source added or inserted at another rate or channel count is converted once
+// per version and target, and the copy is kept on the source for later calls until it changes
+audio_t *convert_source(audio_t *src, int rate, int n_ch); // owned by src, NULL if cancelled
+void free_conversions(audio_t *track);
+long conversion_memory(audio_t *track); // bytes held by the converted copies
+
+// Work-stealing thread pool
+int n_cores();
+int run_parallel(int n_tasks, int n_threads, task_fn fn, void *ctx); // n_threads < 1 uses every core
+
+// Progress of long operations. Kernels report to the progress_t set on the calling thread, which
+// pool tasks inherit. Setting cancel makes them return early. Resampling, convolution and generation
+// then leave their track as it was, loading leaves it empty and filtering partly done. Saves always finish
+void set_progress(progress_t *p); // NULL stops reporting
+int report_progress(long done, long total); // returns 1 if the operation should stop
+int advance_progress(long n);               // for pool tasks: adds to done, same return value
+
+// Errors and notices from the library go to the FILE set on the calling thread, which pool tasks
+// inherit like progress, so a batch job's messages land in its own log
+void set_log(FILE *f); // NULL writes to stdout
+void log_message(const char *fmt, ...);
+
 #endif
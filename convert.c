@@ -0,0 +1,86 @@
+#include "audio.h"
+
+#define CONV_VARIANTS 4 // converted copies kept per source track, the least recently used is replaced
+
+struct conversions {
+	int n;
+	unsigned long clock;
+	struct {
+		int version;     // Source version the copy was made from
+		int store;       // and its precision, as compacting rounds the samples without a new version
+		int rate, n_ch;  // What it was converted to
+		unsigned long used;
+		audio_t track;
+	} v[CONV_VARIANTS];
+};
+
+audio_t *convert_source(audio_t *src, int rate, int n_ch) {
+	TRACE();
+	if (!src || rate < 1 || n_ch < 1) return NULL;
+	expand_audio(src);
+	if (!is_valid(src)) return NULL;
+
+	struct conversions *c = src->conv;
+	if (!c) c = src->conv = calloc(1, sizeof(struct conversions));
+	int i, slot = 0;
+	for (i = 0; i < c->n; i++) {
+		if (c->v[i].version == src->version && c->v[i].store == src->store && c->v[i].rate == rate && c->v[i].n_ch == n_ch) {
+			c->v[i].used = ++c->clock;
+			return &c->v[i].track;
+		}
+		if (c->v[i].used < c->v[slot].used) slot = i;
+	}
+
+	TRACE_SAMPLES((long)src->sz * src->n_ch);
+	audio_t t = {0};
+	memcpy(&t, src, sizeof(audio_t));
+	t.name = NULL;
+	t.stats = NULL;
+	t.source = NULL;
+	t.silent = NULL;
+	t.conv = NULL;
+	t.buf = calloc(t.n_ch, sizeof(void*));
+	for (i = 0; i < t.n_ch; i++) {
+		t.buf[i] = malloc(t.sz * sizeof(float));
+		copy_sound(src, t.buf[i], src->buf[i], sizeof(float), 1);
+	}
+	copy_silent(&t, src);
+
+	resample_audio(&t, (float)rate / (float)t.rate);
+	t.rate = rate;
+	mix_audio(&t, n_ch);
+
+	// A cancelled resample leaves the copy at the old rate, which must not be handed out
+	if (advance_progress(0)) {
+		close_audio(&t);
+		return NULL;
+	}
+
+	if (c->n < CONV_VARIANTS) slot = c->n++;
+	else close_audio(&c->v[slot].track);
+	c->v[slot].version = src->version;
+	c->v[slot].store = src->store;
+	c->v[slot].rate = rate;
+	c->v[slot].n_ch = n_ch;
+	c->v[slot].used = ++c->clock;
+	c->v[slot].track = t;
+	return &c->v[slot].track;
+}
+
+void free_conversions(audio_t *track) {
+	if (!track || !track->conv) return;
+	struct conversions *c = track->conv;
+	int i;
+	for (i = 0; i < c->n; i++) close_audio(&c->v[i].track);
+	free(c);
+	track->conv = NULL;
+}
+
+long conversion_memory(audio_t *track) {
+	if (!track || !track->conv) return 0;
+	struct conversions *c = track->conv;
+	long n = 0;
+	int i;
+	for (i = 0; i < c->n; i++) n += audio_memory(&c->v[i].track);
+	return n;
+}
@@ -0,0 +1,218 @@
+#include "audio.h"
+
+// acc += x * h over n complex bins stored as n real parts followed by n imaginary parts
+static void spectrum_mac(float *restrict acc, const float *restrict x, const float *restrict h, int n) {
+	float *restrict ar = acc, *restrict ai = acc + n;
+	const float *xr = x, *xi = x + n, *hr = h, *hi = h + n;
+
+	int i;
+	for (i = 0; i < n; i++) {
+		float r = xr[i] * hr[i] - xi[i] * hi[i];
+		float m = xr[i] * hi[i] + xi[i] * hr[i];
+		ar[i] += r;
+		ai[i] += m;
+	}
+}
+
+int create_convolver(convolver_t *c, audio_t *ir, int n_in, int block, int matrix) {
+	TRACE();
+	TRACE_SAMPLES(ir ? (long)ir->sz * ir->n_ch : 0);
+	if (!c) return -1;
+	expand_audio(ir);
+	if (!is_valid(ir)) return -2;
+	if (n_in < 1) return -3;
+	if (matrix && ir->n_ch % n_in) return -4;
+
+	if (block < 1) block = 1024;
+	int b = 16;
+	while (b < block) b <<= 1;
+
+	memset(c, 0, sizeof(convolver_t));
+	c->block = b;
+	c->n_part = (ir->sz + b - 1) / b;
+	c->ir_len = ir->sz;
+	c->n_in = n_in;
+	c->n_out = matrix ? ir->n_ch / n_in : n_in;
+	c->matrix = matrix;
+	c->n_ir = ir->n_ch;
+
+	if (fft_init(&c->fft, 2*b) < 0) return -5;
+
+	int i, k, bins = b + 1, spec = 2 * bins;
+	float scale = 1.0f / (float)(2*b);
+
+	c->tmp = calloc(2*b, sizeof(float));
+	c->acc = calloc(spec, sizeof(float));
+
+	c->ir = calloc(c->n_ir, sizeof(void*));
+	for (i = 0; i < c->n_ir; i++) {
+		c->ir[i] = malloc(c->n_part * spec * sizeof(float));
+		for (k = 0; k < c->n_part; k++) {
+			int off = k * b, len = ir->sz - off < b ? ir->sz - off : b;
+			memset(c->tmp, 0, 2*b * sizeof(float));
+			memcpy(c->tmp, ir->buf[i] + off, len * sizeof(float));
+
+			float *h = c->ir[i] + k * spec;
+			fft_forward(&c->fft, c->tmp, h, h + bins);
+
+			int j;
+			for (j = 0; j < spec; j++) h[j] *= scale; // fold the inverse transform's gain into the IR
+		}
+	}
+
+	c->fdl = calloc(n_in, sizeof(void*));
+	c->hist = calloc(n_in, sizeof(void*));
+	for (i = 0; i < n_in; i++) {
+		c->fdl[i] = calloc(c->n_part * spec, sizeof(float));
+		c->hist[i] = calloc(2*b, sizeof(float));
+	}
+	return 0;
+}
+
+void run_convolver(convolver_t *c, float **in, float **out) {
+	if (!c || !c->ir || !out) return;
+
+	int i, j, k, b = c->block, bins = b + 1, spec = 2 * bins;
+
+	// Push the new block into the frequency-domain delay line
+	for (i = 0; i < c->n_in; i++) {
+		float *h = c->hist[i], *x = c->fdl[i] + c->pos * spec;
+		memmove(h, h + b, b * sizeof(float));
+		if (in && in[i]) memcpy(h + b, in[i], b * sizeof(float));
+		else memset(h + b, 0, b * sizeof(float));
+		fft_forward(&c->fft, h, x, x + bins);
+	}
+
+	for (j = 0; j < c->n_out; j++) {
+		if (!out[j]) continue;
+		memset(c->acc, 0, spec * sizeof(float));
+
+		int first = c->matrix ? 0 : j, last = c->matrix ? c->n_in : j+1;
+		for (i = first; i < last; i++) {
+			int path = c->matrix ? i * c->n_out + j : j % c->n_ir;
+			int slot = c->pos;
+			for (k = 0; k < c->n_part; k++) {
+				spectrum_mac(c->acc, c->fdl[i] + slot * spec, c->ir[path] + k * spec, bins);
+				if (--slot < 0) slot = c->n_part - 1;
+			}
+		}
+
+		// Overlap-save: only the second half of the circular result is alias-free
+		fft_inverse(&c->fft, c->acc, c->acc + bins, c->tmp);
+		memcpy(out[j], c->tmp + b, b * sizeof(float));
+	}
+
+	if (++c->pos >= c->n_part) c->pos = 0;
+}
+
+void reset_convolver(convolver_t *c) {
+	if (!c || !c->ir) return;
+
+	int i, spec = 2 * (c->block + 1);
+	for (i = 0; i < c->n_in; i++) {
+		memset(c->fdl[i], 0, c->n_part * spec * sizeof(float));
+		memset(c->hist[i], 0, 2 * c->block * sizeof(float));
+	}
+	c->pos = 0;
+}
+
+void close_convolver(convolver_t *c) {
+	if (!c) return;
+
+	int i;
+	if (c->ir) {
+		for (i = 0; i < c->n_ir; i++) free(c->ir[i]);
+		free(c->ir);
+	}
+	if (c->fdl) {
+		for (i = 0; i < c->n_in; i++) {
+			free(c->fdl[i]);
+			free(c->hist[i]);
+		}
+		free(c->fdl);
+		free(c->hist);
+	}
+	free(c->acc);
+	free(c->tmp);
+	fft_close(&c->fft);
+	memset(c, 0, sizeof(convolver_t));
+}
+
+int convolve_audio(audio_t *dst, audio_t *src, audio_t *ir, int block) {
+	TRACE();
+	TRACE_SAMPLES(src ? (long)src->sz * src->n_ch : 0);
+	expand_audio(src);
+	expand_audio(ir);
+	if (!dst || !is_valid(src) || !is_valid(ir)) return -1;
+
+	// Bring the IR to the rate of the source
+	audio_t h = {0};
+	transfer_audio(&h, ir);
+	if (h.rate != src->rate) {
+		resample_audio(&h, (float)h.rate / (float)src->rate);
+		h.rate = src->rate;
+	}
+
+	// A square IR (LL, LR, RL, RR for stereo) is treated as a true-stereo matrix
+	int matrix = src->n_ch > 1 && h.n_ch == src->n_ch * src->n_ch;
+	if (!matrix && h.n_ch != 1 && h.n_ch != src->n_ch) {
+		close_audio(&h);
+		return -2;
+	}
+
+	convolver_t c;
+	int r = create_convolver(&c, &h, src->n_ch, block, matrix), sz = src->sz + h.sz - 1;
+	close_audio(&h);
+	if (r < 0) return -3;
+
+	audio_t out = {0};
+	if (create_audio(&out, c.n_out, src->bps, src->rate, src->fmt, sz, NULL) < 0) {
+		close_convolver(&c);
+		return -4;
+	}
+
+	int i, p, b = c.block;
+	float **in = calloc(c.n_in, sizeof(void*)), **o = calloc(c.n_out, sizeof(void*));
+	float *pad_in = calloc(c.n_in * b, sizeof(float)), *pad_out = calloc(c.n_out * b, sizeof(float));
+
+	for (p = 0; p < sz; p += b) {
+		if (report_progress(p, sz)) break;
+
+		// A silent input block is fed to the convolver as silence without being read
+		long end = p + b < src->sz ? p + b : src->sz, next;
+		int quiet = p < src->sz && silent_run(src, p, end, &next) && next == end;
+		for (i = 0; i < c.n_in; i++) {
+			if (quiet) in[i] = NULL;
+			else if (p + b <= src->sz) in[i] = src->buf[i] + p;
+			else if (p < src->sz) {
+				in[i] = pad_in + i*b;
+				fcopy(in[i], src->buf[i] + p, b, src->sz - p);
+			}
+			else in[i] = NULL;
+		}
+		for (i = 0; i < c.n_out; i++) o[i] = p + b <= sz ? out.buf[i] + p : pad_out + i*b;
+
+		run_convolver(&c, in, o);
+
+		if (p + b > sz) {
+			for (i = 0; i < c.n_out; i++) memcpy(out.buf[i] + p, o[i], (sz - p) * sizeof(float));
+		}
+	}
+
+	free(in);
+	free(o);
+	free(pad_in);
+	free(pad_out);
+	close_convolver(&c);
+	if (p < sz) {
+		close_audio(&out);
+		return -5;
+	}
+
+	out.name = dst->name;
+	free_audio_data(dst);
+	out.version = dst->version;
+	memcpy(dst, &out, sizeof(audio_t));
+	touch_audio(dst);
+	return 0;
+}
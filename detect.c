@@ -0,0 +1,177 @@
+#include <math.h>
+#include "audio.h"
+
+#define LANES 8
+#define DETECT_TASK 256       // energy blocks measured per task
+#define SPLIT_BUFFER (1<<18)  // bytes encoded per write while saving a clip
+
+typedef unsigned char u8;
+
+typedef struct {
+	audio_t *track;
+	int block;
+	long n_blocks;
+	float *energy; // per block: sum of squares over every channel
+} scan_ctx_t;
+
+typedef struct {
+	audio_t *clips;
+	char *prefix;
+	int failed;
+} split_ctx_t;
+
+// Sum of squares in LANES independent accumulators, which the compiler keeps in one vector register
+static float sum_squares(const float *restrict x, int n) {
+	float acc[LANES] = {0}, s = 0.0f;
+	int i, l;
+	for (i = 0; i + LANES <= n; i += LANES) {
+		for (l = 0; l < LANES; l++) acc[l] += x[i+l] * x[i+l];
+	}
+	for (; i < n; i++) s += x[i] * x[i];
+	for (l = 0; l < LANES; l++) s += acc[l];
+	return s;
+}
+
+static void scan_blocks(void *ctx, int task, int thread) {
+	(void)thread;
+	scan_ctx_t *c = ctx;
+	audio_t *t = c->track;
+	long b = (long)task * DETECT_TASK, last = b + DETECT_TASK < c->n_blocks ? b + DETECT_TASK : c->n_blocks;
+	float *tmp = t->packed ? malloc(c->block * sizeof(float)) : NULL;
+	int es = store_size(t->store);
+
+	for (; b < last; b++) {
+		long p = b * c->block, next;
+		int n = t->sz - p < c->block ? t->sz - p : c->block, ch;
+		c->energy[b] = 0.0f;
+		if (silent_run(t, p, p + n, &next) && next == p + n) continue;
+		if (t->frames) {
+			c->energy[b] = sum_squares(t->frames + p * t->n_ch, n * t->n_ch);
+			continue;
+		}
+
+		for (ch = 0; ch < t->n_ch; ch++) {
+			float *x = tmp;
+			if (t->packed) unpack_block(tmp, (u8*)t->packed[ch] + p * es, n, t->store);
+			else x = t->buf[ch] + p;
+			c->energy[b] += sum_squares(x, n);
+		}
+	}
+	free(tmp);
+	advance_progress(last - (long)task * DETECT_TASK);
+}
+
+int detect_activity(audio_t *track, detect_t *d, region_t **out) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	if (!out) return -1;
+	*out = NULL;
+	use_audio(track);
+	if (!track || !d || track->sz < 1 || track->n_ch < 1 || (!track->buf && !track->packed && !track->frames)) return -1;
+
+	scan_ctx_t c = {0};
+	c.track = track;
+	c.block = d->block > 0 ? d->block : (track->rate / 100 > 0 ? track->rate / 100 : 1);
+	c.n_blocks = (track->sz + c.block - 1) / c.block;
+	c.energy = malloc(c.n_blocks * sizeof(float));
+
+	report_progress(0, c.n_blocks);
+	run_parallel((c.n_blocks + DETECT_TASK - 1) / DETECT_TASK, 0, scan_blocks, &c);
+	if (advance_progress(0)) {
+		free(c.energy);
+		return -2;
+	}
+
+	// A block is active when its mean square over all channels is above the threshold. A region
+	// stays open for the hangover after its last active block, so shorter gaps do not split it
+	double level = pow(10.0, d->threshold / 10.0) * track->n_ch;
+	long b, start = -1, end = 0;
+	int n = 0, cap = 0;
+	region_t *r = NULL;
+	for (b = 0; b <= c.n_blocks; b++) {
+		long p = b * c.block;
+		int len = track->sz - p < c.block ? track->sz - p : c.block;
+		int active = b < c.n_blocks && c.energy[b] > level * len;
+		if (start >= 0 && (b == c.n_blocks || (active && p > end) || (!active && p >= end))) {
+			if (end - start >= d->min_len) {
+				if (n == cap) {
+					cap = cap ? cap * 2 : 64;
+					r = realloc(r, cap * sizeof(region_t));
+				}
+				r[n].start = start;
+				r[n].len = end - start;
+				n++;
+			}
+			start = -1;
+		}
+		if (!active) continue;
+
+		if (start < 0) start = p;
+		end = p + len + d->hangover < track->sz ? p + len + d->hangover : track->sz;
+	}
+	free(c.energy);
+	*out = r;
+	return n;
+}
+
+static int write_clip(audio_t *t, char *fname) {
+	FILE *f = fopen(fname, "wb");
+	if (!f) return -1;
+
+	wav_t h;
+	make_wav_header(t, &h);
+	int r = fwrite(&h, sizeof(wav_t), 1, f) == 1 ? 0 : -1;
+
+	quantizer_t q;
+	init_quantizer(&q, t);
+	int frame = t->n_ch * t->bps, per = SPLIT_BUFFER / frame > 0 ? SPLIT_BUFFER / frame : 1, pos;
+	u8 *buf = malloc((long)per * frame);
+	for (pos = 0; pos < t->sz && r == 0; pos += per) {
+		int n = t->sz - pos < per ? t->sz - pos : per;
+		quantize_samples(&q, t, buf, pos, n);
+		if (fwrite(buf, frame, n, f) != (size_t)n) r = -1;
+	}
+	close_quantizer(&q);
+	free(buf);
+	if (fclose(f) != 0) r = -1;
+	return r;
+}
+
+static void split_task(void *ctx, int task, int thread) {
+	(void)thread;
+	split_ctx_t *c = ctx;
+	if (advance_progress(0)) return;
+
+	char fname[1024];
+	snprintf(fname, sizeof(fname), "%s%04d.wav", c->prefix, task + 1);
+	if (write_clip(&c->clips[task], fname) < 0) {
+		__atomic_add_fetch(&c->failed, 1, __ATOMIC_RELAXED);
+		log_message("Error: could not write \"%s\"\n", fname);
+	}
+	advance_progress(1);
+}
+
+int split_audio(audio_t *track, region_t *regions, int n, char *prefix) {
+	TRACE();
+	if (!track || !regions || !prefix || n < 1) return -1;
+	use_audio(track);
+	if (!track->buf && !track->packed && !track->frames) return -1;
+	if (track->fmt == 3 ? track->bps != 4 && track->bps != 8 : track->bps < 1 || track->bps > 4) return -2;
+
+	// Every clip is a slice of the track, so nothing is copied and the tasks only read the samples
+	split_ctx_t c = {calloc(n, sizeof(audio_t)), prefix, 0};
+	int i;
+	for (i = 0; i < n; i++) {
+		if (slice_audio(&c.clips[i], track, regions[i].start, regions[i].len) < 0) break;
+	}
+	if (i == n) {
+		report_progress(0, n);
+		run_parallel(n, 0, split_task, &c);
+	}
+	else c.failed = 1;
+
+	for (i = 0; i < n; i++) free_slice(&c.clips[i]);
+	free(c.clips);
+	if (advance_progress(0)) return -3;
+	return c.failed ? -4 : n;
+}
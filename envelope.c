@@ -0,0 +1,165 @@
+#include <math.h>
+#include "audio.h"
+
+#define ENV_TILE 65536 // frames per task, a multiple of SILENT_BLOCK
+#define RAMP 4096      // gains computed at a time
+#define EXP_FLOOR 1e-4 // -80 dB: exponential ramps start from or end at this instead of silence
+
+typedef struct {
+	audio_t *track;
+	breakpoint_t *pt;
+	int n_pt;
+	long offset, size;
+} env_ctx_t;
+
+// Gains k...k+n-1 of a ramp from a to b over len frames
+static void ramp(float a, float b, int shape, long k, long len, int n, float *restrict g) {
+	double inv = 1.0 / len;
+	int i;
+	switch (shape) {
+		case RAMP_EXP: {
+			if (a <= 0.0f && b <= 0.0f) {
+				for (i = 0; i < n; i++) g[i] = 0.0f;
+				break;
+			}
+			// Equal steps in dB, by repeated multiplication from an exact start
+			double la = log(a > EXP_FLOOR ? a : EXP_FLOOR), d = (log(b > EXP_FLOOR ? b : EXP_FLOOR) - la) * inv;
+			double v = exp(la + d * k), r = exp(d);
+			for (i = 0; i < n; i++, v *= r) g[i] = (float)v;
+			break;
+		}
+		case RAMP_SCURVE:
+			for (i = 0; i < n; i++) {
+				float t = (float)((k + i) * inv);
+				g[i] = a + (b - a) * t * t * (3.0f - 2.0f * t);
+			}
+			break;
+		default:
+			for (i = 0; i < n; i++) g[i] = a + (b - a) * (float)((k + i) * inv);
+	}
+}
+
+// Gains of frames f...f+n-1. Before the first point the gain is its own, after the last point the last's
+static void fill_gains(const breakpoint_t *pt, int n_pt, long f, int n, float *restrict g) {
+	int lo = 0, hi = n_pt, s, i = 0, k;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (pt[mid].at <= f) lo = mid + 1;
+		else hi = mid;
+	}
+	for (s = lo - 1; i < n; s++) {
+		long pos = f + i;
+		if (s < 0 || s == n_pt - 1) {
+			const breakpoint_t *p = s < 0 ? &pt[0] : &pt[n_pt - 1];
+			int m = s < 0 && p->at - pos < n - i ? p->at - pos : n - i;
+			for (k = 0; k < m; k++) g[i + k] = p->gain;
+			i += m;
+			continue;
+		}
+		long end = pt[s + 1].at;
+		int m = end - pos < n - i ? end - pos : n - i;
+		if (m > 0) ramp(pt[s].gain, pt[s + 1].gain, pt[s].shape, pos - pt[s].at, end - pt[s].at, m, g + i);
+		i += m > 0 ? m : 0;
+	}
+}
+
+static void env_task(void *ctx, int task, int thread) {
+	(void)thread;
+	env_ctx_t *c = ctx;
+	audio_t *t = c->track;
+	long a = c->offset + (long)task * ENV_TILE, b = c->offset + c->size - a < ENV_TILE ? c->offset + c->size : a + ENV_TILE, p, q, next;
+	float g[RAMP];
+	int ch, i;
+	if (advance_progress(b - a)) return;
+
+	for (p = a; p < b; p += RAMP) {
+		int n = b - p < RAMP ? b - p : RAMP, filled = 0;
+		for (q = p; q < p + n; q = next) {
+			if (silent_run(t, q, p + n, &next)) continue;
+			if (!filled++) fill_gains(c->pt, c->n_pt, p, n, g);
+			for (ch = 0; ch < t->n_ch; ch++) {
+				float *restrict x = t->buf[ch] + q;
+				const float *restrict gg = g + (q - p);
+				for (i = 0; i < next - q; i++) x[i] *= gg[i];
+			}
+		}
+	}
+}
+
+int envelope_audio(audio_t *track, breakpoint_t *pts, int n, long offset, long size) {
+	TRACE();
+	if (!pts || n < 1) return -1;
+	expand_audio(track);
+	if (!is_valid(track)) return -1;
+	if (offset < 0 || offset >= track->sz) return -2;
+	if (size < 1 || size > track->sz - offset) size = track->sz - offset;
+	TRACE_SAMPLES(size * track->n_ch);
+
+	int i;
+	for (i = 1; i < n; i++) {
+		if (pts[i].at < pts[i-1].at) return -2;
+	}
+
+	env_ctx_t c = {track, pts, n, offset, size};
+	report_progress(0, size);
+	run_parallel((size + ENV_TILE - 1) / ENV_TILE, 0, env_task, &c);
+
+	// Silent blocks stay silent at any gain, so they are not touched
+	long p, next;
+	for (p = offset; p < offset + size; p = next) {
+		if (!silent_run(track, p, offset + size, &next)) touch_range(track, p, next - p);
+	}
+	return advance_progress(0) ? -3 : 0;
+}
+
+int fade_audio(audio_t *track, long offset, long size, float from, float to, int shape) {
+	TRACE();
+	if (!track || size < 1) return -1;
+	breakpoint_t pt[2] = {{offset, from, shape}, {offset + size - 1, to, shape}};
+	if (size == 1) pt[0].gain = to;
+	return envelope_audio(track, pt, 2, offset, size);
+}
+
+// Frames [at, at+len) of the inserted clip are summed with the frames at 'other' they overlap.
+// The clip fades in over them if 'in', else out, and the frames under it the opposite way
+static void cross(audio_t *t, long at, long other, long len, int in, int shape) {
+	float gc[RAMP], go[RAMP];
+	long j;
+	int n, ch, i;
+	for (j = 0; j < len; j += n) {
+		n = len - j < RAMP ? len - j : RAMP;
+		ramp(!in, in, shape, j, len, n, gc);
+		ramp(in, !in, shape, j, len, n, go);
+		for (ch = 0; ch < t->n_ch; ch++) {
+			float *restrict y = t->buf[ch] + at + j;
+			const float *restrict x = t->buf[ch] + other + j;
+			for (i = 0; i < n; i++) y[i] = y[i] * gc[i] + x[i] * go[i];
+		}
+	}
+	touch_range(t, at, len);
+}
+
+int insert_crossfade(audio_t *dst, audio_t *src, int offset, int size, float amplitude, long fade, int shape) {
+	TRACE();
+	if (!dst || !src || size < 1 || offset < 0) return -1;
+
+	// The clip overlaps the end of what comes before it by 'fade' frames and the start of what
+	// follows by as many, and the overlapped frames are taken out once they are mixed in
+	long head = fade > offset ? offset : fade, tail = dst->sz - offset < fade ? dst->sz - offset : fade;
+	if (head < 0) head = 0;
+	if (tail < 0) tail = 0;
+	if (head > size / 2) head = size / 2;
+	if (tail > size / 2) tail = size / 2;
+
+	insert_audio(dst, src, offset, size, amplitude);
+	if (advance_progress(0)) return -3;
+	if (!head && !tail) return 0;
+	expand_audio(dst);
+	if (!is_valid(dst)) return -2;
+
+	if (head) cross(dst, offset, offset - head, head, 1, shape);
+	if (tail) cross(dst, offset + size - tail, offset + size, tail, 0, shape);
+	if (tail) remove_audio(dst, offset + size, tail);
+	if (head) remove_audio(dst, offset - head, head);
+	return 0;
+}
@@ -0,0 +1,135 @@
+#include <math.h>
+#include "audio.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+int fft_init(fft_t *p, int n) {
+	if (!p) return -1;
+	if (n < 2 || (n & (n-1))) return -2;
+
+	memset(p, 0, sizeof(fft_t));
+	p->n = n;
+
+	int i, j, m = n / 2, bits = 0;
+	while ((1 << bits) < m) bits++;
+
+	p->rev = malloc(m * sizeof(int));
+	for (i = 0; i < m; i++) {
+		int r = 0;
+		for (j = 0; j < bits; j++) r |= ((i >> j) & 1) << (bits - j - 1);
+		p->rev[i] = r;
+	}
+
+	// twiddles for the half-size complex transform
+	p->tw_re = malloc((m/2 + 1) * sizeof(float));
+	p->tw_im = malloc((m/2 + 1) * sizeof(float));
+	for (i = 0; i <= m/2; i++) {
+		p->tw_re[i] = (float)cos(2.0 * M_PI * i / m);
+		p->tw_im[i] = (float)-sin(2.0 * M_PI * i / m);
+	}
+
+	// twiddles for splitting the packed real transform
+	p->rtw_re = malloc((m + 1) * sizeof(float));
+	p->rtw_im = malloc((m + 1) * sizeof(float));
+	for (i = 0; i <= m; i++) {
+		p->rtw_re[i] = (float)cos(2.0 * M_PI * i / n);
+		p->rtw_im[i] = (float)-sin(2.0 * M_PI * i / n);
+	}
+
+	p->re = malloc(m * sizeof(float));
+	p->im = malloc(m * sizeof(float));
+	return 0;
+}
+
+void fft_close(fft_t *p) {
+	if (!p) return;
+	free(p->rev);
+	free(p->tw_re);
+	free(p->tw_im);
+	free(p->rtw_re);
+	free(p->rtw_im);
+	free(p->re);
+	free(p->im);
+	memset(p, 0, sizeof(fft_t));
+}
+
+// In-place radix-2 transform of an n/2 point complex sequence
+static void fft_complex(fft_t *p, float *re, float *im) {
+	int i, j, k, m = p->n / 2;
+
+	for (i = 0; i < m; i++) {
+		j = p->rev[i];
+		if (j > i) {
+			float t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+
+	int len;
+	for (len = 2; len <= m; len <<= 1) {
+		int half = len / 2, step = m / len;
+		for (i = 0; i < m; i += len) {
+			for (j = 0, k = 0; j < half; j++, k += step) {
+				float wr = p->tw_re[k], wi = p->tw_im[k];
+				float *ar = re + i + j, *ai = im + i + j;
+				float br = ar[half] * wr - ai[half] * wi;
+				float bi = ar[half] * wi + ai[half] * wr;
+				ar[half] = *ar - br;
+				ai[half] = *ai - bi;
+				*ar += br;
+				*ai += bi;
+			}
+		}
+	}
+}
+
+void fft_forward(fft_t *p, float *in, float *out_re, float *out_im) {
+	if (!p || !in || !out_re || !out_im) return;
+
+	int k, m = p->n / 2;
+	float *re = p->re, *im = p->im;
+	for (k = 0; k < m; k++) {
+		re[k] = in[2*k];
+		im[k] = in[2*k+1];
+	}
+	fft_complex(p, re, im);
+
+	for (k = 0; k <= m; k++) {
+		int a = k % m, b = (m - k) % m;
+		float ar = re[a], ai = im[a], br = re[b], bi = -im[b];
+
+		float er = 0.5f * (ar + br), ei = 0.5f * (ai + bi);
+		float odr = 0.5f * (ai - bi), odi = -0.5f * (ar - br);
+		float wr = p->rtw_re[k], wi = p->rtw_im[k];
+
+		out_re[k] = er + wr * odr - wi * odi;
+		out_im[k] = ei + wr * odi + wi * odr;
+	}
+}
+
+void fft_inverse(fft_t *p, float *in_re, float *in_im, float *out) {
+	if (!p || !in_re || !in_im || !out) return;
+
+	int k, m = p->n / 2;
+	float *re = p->re, *im = p->im;
+	for (k = 0; k < m; k++) {
+		float ar = in_re[k], ai = in_im[k], br = in_re[m-k], bi = -in_im[m-k];
+
+		float er = ar + br, ei = ai + bi;
+		float dr = ar - br, di = ai - bi;
+		float wr = p->rtw_re[k], wi = -p->rtw_im[k];
+		float odr = dr * wr - di * wi, odi = dr * wi + di * wr;
+
+		// Z = E + iO, stored with re/im swapped so the forward transform runs backwards
+		re[k] = ei + odr;
+		im[k] = er - odi;
+	}
+	fft_complex(p, re, im);
+
+	for (k = 0; k < m; k++) {
+		out[2*k] = im[k];
+		out[2*k+1] = re[k];
+	}
+}
@@ -0,0 +1,211 @@
+#include <math.h>
+#include "audio.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define TILE 64 // frames per tile when transposing channels into lanes
+
+// Coefficients from the RBJ Audio EQ Cookbook, normalised so a0 = 1
+int design_biquad(biquad_t *q, int type, float freq, float res, float gain, int rate) {
+	if (!q) return -1;
+	if (rate < 1 || freq <= 0.0 || freq >= rate / 2.0) return -2;
+	if (res <= 0.0) res = M_SQRT1_2;
+
+	double w = 2.0 * M_PI * freq / rate, cw = cos(w), sw = sin(w);
+	double alpha = sw / (2.0 * res), a = pow(10.0, gain / 40.0);
+	double b0, b1, b2, a0, a1, a2;
+
+	switch (type) {
+		case FILTER_LOWPASS:
+			b0 = (1.0 - cw) / 2.0; b1 = 1.0 - cw; b2 = b0;
+			a0 = 1.0 + alpha; a1 = -2.0 * cw; a2 = 1.0 - alpha;
+			break;
+		case FILTER_HIGHPASS:
+			b0 = (1.0 + cw) / 2.0; b1 = -(1.0 + cw); b2 = b0;
+			a0 = 1.0 + alpha; a1 = -2.0 * cw; a2 = 1.0 - alpha;
+			break;
+		case FILTER_BANDPASS:
+			b0 = alpha; b1 = 0.0; b2 = -alpha;
+			a0 = 1.0 + alpha; a1 = -2.0 * cw; a2 = 1.0 - alpha;
+			break;
+		case FILTER_NOTCH:
+			b0 = 1.0; b1 = -2.0 * cw; b2 = 1.0;
+			a0 = 1.0 + alpha; a1 = -2.0 * cw; a2 = 1.0 - alpha;
+			break;
+		case FILTER_PEAK:
+			b0 = 1.0 + alpha * a; b1 = -2.0 * cw; b2 = 1.0 - alpha * a;
+			a0 = 1.0 + alpha / a; a1 = -2.0 * cw; a2 = 1.0 - alpha / a;
+			break;
+		case FILTER_LOWSHELF: {
+			double s = 2.0 * sqrt(a) * alpha;
+			b0 = a * ((a+1.0) - (a-1.0) * cw + s);
+			b1 = 2.0 * a * ((a-1.0) - (a+1.0) * cw);
+			b2 = a * ((a+1.0) - (a-1.0) * cw - s);
+			a0 = (a+1.0) + (a-1.0) * cw + s;
+			a1 = -2.0 * ((a-1.0) + (a+1.0) * cw);
+			a2 = (a+1.0) + (a-1.0) * cw - s;
+			break;
+		}
+		case FILTER_HIGHSHELF: {
+			double s = 2.0 * sqrt(a) * alpha;
+			b0 = a * ((a+1.0) + (a-1.0) * cw + s);
+			b1 = -2.0 * a * ((a-1.0) + (a+1.0) * cw);
+			b2 = a * ((a+1.0) + (a-1.0) * cw - s);
+			a0 = (a+1.0) - (a-1.0) * cw + s;
+			a1 = 2.0 * ((a-1.0) - (a+1.0) * cw);
+			a2 = (a+1.0) - (a-1.0) * cw - s;
+			break;
+		}
+		default:
+			return -3;
+	}
+
+	q->b0 = b0 / a0;
+	q->b1 = b1 / a0;
+	q->b2 = b2 / a0;
+	q->a1 = a1 / a0;
+	q->a2 = a2 / a0;
+	return 0;
+}
+
+int create_filter(filter_t *f, int n_ch) {
+	if (!f) return -1;
+	if (n_ch < 1) return -2;
+
+	memset(f, 0, sizeof(filter_t));
+	f->n_ch = n_ch;
+	f->n_grp = (n_ch + FILTER_LANES - 1) / FILTER_LANES;
+	return 0;
+}
+
+int add_biquad(filter_t *f, int type, float freq, float res, float gain, int rate) {
+	if (!f || f->n_ch < 1) return -1;
+
+	biquad_t q;
+	int r = design_biquad(&q, type, freq, res, gain, rate);
+	if (r < 0) return r;
+
+	return add_section(f, &q);
+}
+
+int add_section(filter_t *f, biquad_t *q) {
+	if (!f || !q || f->n_ch < 1) return -1;
+
+	f->sec = realloc(f->sec, (f->n_sec + 1) * sizeof(biquad_t));
+	f->sec[f->n_sec++] = *q;
+
+	// State is laid out [group][section][z1 lanes, z2 lanes]
+	int i, per = 2 * FILTER_LANES, old = f->n_sec - 1;
+	float *z = calloc(f->n_grp * f->n_sec * per, sizeof(float));
+	if (f->z) {
+		for (i = 0; i < f->n_grp; i++) memcpy(z + i * f->n_sec * per, f->z + i * old * per, old * per * sizeof(float));
+		free(f->z);
+	}
+	f->z = z;
+	return 0;
+}
+
+// Runs every section over a tile of frames for one group of channels, one channel per lane
+static void run_tile(biquad_t *sec, int n_sec, float *z, float (*x)[FILTER_LANES], int n) {
+	int s, t, l;
+	for (s = 0; s < n_sec; s++, z += 2 * FILTER_LANES) {
+		float b0 = sec[s].b0, b1 = sec[s].b1, b2 = sec[s].b2, a1 = sec[s].a1, a2 = sec[s].a2;
+		float z1[FILTER_LANES], z2[FILTER_LANES];
+		memcpy(z1, z, sizeof(z1));
+		memcpy(z2, z + FILTER_LANES, sizeof(z2));
+
+		// Transposed direct form II
+		for (t = 0; t < n; t++) {
+			float *v = x[t];
+			for (l = 0; l < FILTER_LANES; l++) {
+				float in = v[l], out = b0 * in + z1[l];
+				z1[l] = b1 * in - a1 * out + z2[l];
+				z2[l] = b2 * in - a2 * out;
+				v[l] = out;
+			}
+		}
+
+		memcpy(z, z1, sizeof(z1));
+		memcpy(z + FILTER_LANES, z2, sizeof(z2));
+	}
+}
+
+void run_filter(filter_t *f, float **buf, int n) {
+	if (!f || !f->sec || !buf || n < 1) return;
+
+	float x[TILE][FILTER_LANES];
+	int g, i, t, l;
+	for (g = 0; g < f->n_grp; g++) {
+		int ch = g * FILTER_LANES, lanes = f->n_ch - ch < FILTER_LANES ? f->n_ch - ch : FILTER_LANES;
+		float *z = f->z + g * f->n_sec * 2 * FILTER_LANES;
+
+		for (i = 0; i < n; i += TILE) {
+			int len = n - i < TILE ? n - i : TILE;
+
+			memset(x, 0, sizeof(x));
+			for (l = 0; l < lanes; l++) {
+				float *p = buf[ch+l] + i;
+				for (t = 0; t < len; t++) x[t][l] = p[t];
+			}
+
+			run_tile(f->sec, f->n_sec, z, x, len);
+
+			for (l = 0; l < lanes; l++) {
+				float *p = buf[ch+l] + i;
+				for (t = 0; t < len; t++) p[t] = x[t][l];
+			}
+		}
+	}
+}
+
+void reset_filter(filter_t *f) {
+	if (!f || !f->z) return;
+	memset(f->z, 0, f->n_grp * f->n_sec * 2 * FILTER_LANES * sizeof(float));
+}
+
+void close_filter(filter_t *f) {
+	if (!f) return;
+	free(f->sec);
+	free(f->z);
+	memset(f, 0, sizeof(filter_t));
+}
+
+void filter_audio(audio_t *track, filter_t *f) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	expand_audio(track);
+	if (!is_valid(track) || !f || f->n_ch != track->n_ch) return;
+
+	// In slices, so progress can be reported. A cancelled call leaves the track partly filtered
+	float **at = calloc(track->n_ch, sizeof(void*));
+	int i, p, n;
+	for (p = 0; p < track->sz; p += n) {
+		if (report_progress(p, track->sz)) break;
+		n = track->sz - p < 65536 ? track->sz - p : 65536;
+		for (i = 0; i < track->n_ch; i++) at[i] = track->buf[i] + p;
+		run_filter(f, at, n);
+	}
+	free(at);
+	touch_audio(track);
+}
+
+int antialias_audio(audio_t *track, int rate) {
+	TRACE();
+	expand_audio(track);
+	if (!is_valid(track) || rate < 1) return -1;
+	if (rate >= track->rate) return 0;
+
+	// 8th order Butterworth low-pass just below the new Nyquist frequency
+	const float q[] = {0.50979558, 0.60134489, 0.89997622, 2.56291545};
+	filter_t f = {0};
+	create_filter(&f, track->n_ch);
+
+	int i, r = 0;
+	for (i = 0; i < 4 && r == 0; i++) r = add_biquad(&f, FILTER_LOWPASS, 0.45f * rate, q[i], 0.0, track->rate);
+	if (r == 0) filter_audio(track, &f);
+
+	close_filter(&f);
+	return r;
+}
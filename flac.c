@@ -0,0 +1,995 @@
+#include <math.h>
+#include <strings.h>
+#include <time.h>
+#include "audio.h"
+
+#define FLAC_BLOCK 4096    // samples per channel in each frame
+#define FLAC_MAX_ORDER 8   // highest LPC order tried
+#define FLAC_SEEK_FRAMES 16 // frames between seek points, which are also the units of parallel decoding
+#define FLAC_MAX_PORDER 8  // highest Rice partition order tried
+
+typedef unsigned char u8;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int is_flac(char *fname) {
+	if (!fname) return 0;
+	int len = strlen(fname);
+	return len >= 5 && !strcasecmp(fname + len - 5, ".flac");
+}
+
+// CRC-8 (x^8 + x^2 + x + 1) over frame headers and CRC-16 (x^16 + x^15 + x^2 + 1) over whole frames
+static u8 crc8(const u8 *p, long n) {
+	u32 c = 0;
+	long i;
+	int b;
+	for (i = 0; i < n; i++) {
+		c ^= p[i];
+		for (b = 0; b < 8; b++) c = (c & 0x80) ? ((c << 1) ^ 0x07) & 0xff : (c << 1) & 0xff;
+	}
+	return c;
+}
+
+static unsigned short crc16_table[256];
+
+static void init_crc16() {
+	if (crc16_table[1]) return;
+	int i, b;
+	for (i = 0; i < 256; i++) {
+		u32 c = i << 8;
+		for (b = 0; b < 8; b++) c = (c & 0x8000) ? (c << 1) ^ 0x8005 : c << 1;
+		crc16_table[i] = c & 0xffff;
+	}
+}
+
+static u32 crc16(const u8 *p, long n) {
+	u32 c = 0;
+	long i;
+	for (i = 0; i < n; i++) c = ((c << 8) ^ crc16_table[(c >> 8) ^ p[i]]) & 0xffff;
+	return c;
+}
+
+// Bit writer, most significant bit first
+typedef struct {
+	u8 *buf;
+	long len, cap;
+	u64 acc;
+	int n; // bits waiting in acc, always < 8 between calls
+} bitw_t;
+
+static void put_bits(bitw_t *w, u32 v, int bits) {
+	if (bits < 1) return;
+	if (w->len + 8 > w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 4096;
+		w->buf = realloc(w->buf, w->cap);
+	}
+	w->acc = (w->acc << bits) | ((u64)v & (0xffffffffull >> (32 - bits)));
+	w->n += bits;
+	while (w->n >= 8) {
+		w->n -= 8;
+		w->buf[w->len++] = (u8)(w->acc >> w->n);
+	}
+}
+
+static void put_wide(bitw_t *w, u64 v, int bits) {
+	if (bits > 32) put_bits(w, (u32)(v >> 32), bits - 32);
+	put_bits(w, (u32)v, bits > 32 ? 32 : bits);
+}
+
+static void align_bits(bitw_t *w) {
+	if (w->n) put_bits(w, 0, 8 - w->n);
+}
+
+static void put_utf8(bitw_t *w, u64 v) {
+	if (v < 0x80) {
+		put_bits(w, v, 8);
+		return;
+	}
+	int n = 2, i;
+	while (v >= (1ull << (5*n + 1))) n++;
+	put_bits(w, ((0xff00 >> n) & 0xff) | (u32)(v >> (6 * (n-1))), 8);
+	for (i = n-2; i >= 0; i--) put_bits(w, 0x80 | ((v >> (6*i)) & 0x3f), 8);
+}
+
+// Bit reader. The cache holds the next bits aligned to its top; past the end it reads zeros and sets err
+typedef struct {
+	const u8 *buf;
+	long len, byte;
+	u64 cache;
+	int n;
+	int err;
+} bitr_t;
+
+static void init_reader(bitr_t *r, const u8 *buf, long len) {
+	memset(r, 0, sizeof(bitr_t));
+	r->buf = buf;
+	r->len = len;
+}
+
+static void refill(bitr_t *r) {
+	while (r->n <= 56) {
+		u64 b = r->byte < r->len ? r->buf[r->byte] : 0;
+		r->byte++;
+		r->cache |= b << (56 - r->n);
+		r->n += 8;
+	}
+}
+
+static long read_pos(bitr_t *r) {
+	return r->byte * 8 - r->n; // in bits
+}
+
+static u32 get_bits(bitr_t *r, int bits) {
+	if (bits < 1) return 0;
+	if (r->n < bits) refill(r);
+	u32 v = r->cache >> (64 - bits);
+	r->cache <<= bits;
+	r->n -= bits;
+	if (read_pos(r) > r->len * 8) r->err = 1;
+	return v;
+}
+
+static int get_signed(bitr_t *r, int bits) {
+	if (bits < 1) return 0;
+	u32 v = get_bits(r, bits);
+	return (int)(v << (32 - bits)) >> (32 - bits);
+}
+
+static u32 get_unary(bitr_t *r) {
+	u32 q = 0;
+	while (1) {
+		refill(r);
+		if (r->cache == 0) {
+			q += r->n;
+			r->n = 0;
+			if (read_pos(r) > r->len * 8) {
+				r->err = 1;
+				return q;
+			}
+			continue;
+		}
+		int z = __builtin_clzll(r->cache);
+		q += z;
+		r->cache = z + 1 < 64 ? r->cache << (z + 1) : 0;
+		r->n -= z + 1;
+		if (read_pos(r) > r->len * 8) r->err = 1;
+		return q;
+	}
+}
+
+static void align_reader(bitr_t *r) {
+	get_bits(r, r->n & 7);
+}
+
+// Encoder
+
+// Everything needed to write one subframe, so candidates can be compared before any bits are written
+typedef struct {
+	int type;     // 0 = constant, 1 = verbatim, 2 = fixed, 3 = LPC
+	int order;
+	int bps;      // bits per sample, including the extra bit of a side channel, minus wasted bits
+	int wasted;
+	int prec;     // LPC coefficient precision
+	int shift;    // LPC quantization shift
+	int coef[FLAC_MAX_ORDER];
+	int porder;   // Rice partition order
+	int method;   // 0 = 4-bit Rice parameters, 1 = 5-bit
+	int param[1 << FLAC_MAX_PORDER];
+	int *x;       // samples after removing wasted bits
+	int *res;     // residual, indexed by sample position
+	long bits;
+} plan_t;
+
+// Rice parameter for a partition from the sum of its folded residuals. The cost is estimated as
+// n * (k + 1) + sum / 2^k, which only ignores the rounding of each quotient
+static long best_param(u64 sum, int n, int *k) {
+	int g = 0;
+	if (n > 0) {
+		u64 mean = sum / n;
+		while (g < 30 && (1ull << (g + 1)) <= mean) g++;
+	}
+
+	long best = -1;
+	int c;
+	for (c = g > 0 ? g - 1 : 0; c <= g + 1 && c <= 30; c++) {
+		long bits = (long)n * (c + 1) + (long)(sum >> c);
+		if (best < 0 || bits < best) {
+			best = bits;
+			*k = c;
+		}
+	}
+	return best;
+}
+
+// Chooses the partition order and parameters for p->res and returns the residual size in bits.
+// Sums are taken once for the finest partitions and merged pairwise for each coarser order
+static long plan_residual(plan_t *p, int n) {
+	int i, o, max_o = 0;
+	while (max_o < FLAC_MAX_PORDER && n % (1 << (max_o + 1)) == 0 && (n >> (max_o + 1)) > p->order) max_o++;
+
+	u64 sums[1 << FLAC_MAX_PORDER] = {0};
+	int parts = 1 << max_o, ps = n >> max_o;
+	for (i = 0; i < parts; i++) {
+		int j, start = i ? i * ps : p->order;
+		u64 s = 0;
+		for (j = start; j < (i + 1) * ps; j++) s += ((u32)p->res[j] << 1) ^ (u32)(p->res[j] >> 31);
+		sums[i] = s;
+	}
+
+	long best = -1;
+	int params[1 << FLAC_MAX_PORDER];
+	for (o = max_o; o >= 0; o--) {
+		int wide = 0;
+		parts = 1 << o;
+		ps = n >> o;
+		if (o < max_o) for (i = 0; i < parts; i++) sums[i] = sums[2*i] + sums[2*i+1];
+
+		long bits = 6;
+		for (i = 0; i < parts; i++) {
+			bits += best_param(sums[i], ps - (i ? 0 : p->order), &params[i]);
+			if (params[i] > 14) wide = 1;
+		}
+		bits += (long)parts * (wide ? 5 : 4);
+		if (best < 0 || bits < best) {
+			best = bits;
+			p->porder = o;
+			p->method = wide;
+			memcpy(p->param, params, parts * sizeof(int));
+		}
+	}
+	return best;
+}
+
+static void fixed_residual(const int *x, int *res, int n, int order) {
+	int i;
+	for (i = order; i < n; i++) {
+		switch (order) {
+			case 0: res[i] = x[i]; break;
+			case 1: res[i] = x[i] - x[i-1]; break;
+			case 2: res[i] = x[i] - 2*x[i-1] + x[i-2]; break;
+			case 3: res[i] = x[i] - 3*x[i-1] + 3*x[i-2] - x[i-3]; break;
+			case 4: res[i] = x[i] - 4*x[i-1] + 6*x[i-2] - 4*x[i-3] + x[i-4]; break;
+		}
+	}
+}
+
+// Returns 0 if the residual stayed in a range every decoder can hold
+static int lpc_residual(const int *x, int *res, int n, const int *coef, int order, int shift) {
+	int i, j;
+	for (i = order; i < n; i++) {
+		long long sum = 0;
+		for (j = 0; j < order; j++) sum += (long long)coef[j] * x[i-1-j];
+		long long r = x[i] - (sum >> shift);
+		if (r > 0x3fffffff || r < -0x3fffffff) return -1;
+		res[i] = (int)r;
+	}
+	return 0;
+}
+
+// Levinson-Durbin on the autocorrelation of the Welch windowed block. lpc[o-1] holds the predictor of order o
+static int compute_lpc(const int *x, int n, int max_order, double lpc[][FLAC_MAX_ORDER], double *err) {
+	double r[FLAC_MAX_ORDER + 1] = {0}, *w = malloc(n * sizeof(double));
+	int i, j;
+	double mid = (n - 1) / 2.0, half = (n + 1) / 2.0;
+	for (i = 0; i < n; i++) {
+		double d = (i - mid) / half;
+		w[i] = x[i] * (1.0 - d * d);
+	}
+	for (j = 0; j <= max_order; j++) {
+		double s = 0.0;
+		for (i = j; i < n; i++) s += w[i] * w[i-j];
+		r[j] = s;
+	}
+	free(w);
+	if (r[0] <= 0.0) return 0;
+
+	double a[FLAC_MAX_ORDER + 1] = {0}, tmp[FLAC_MAX_ORDER + 1], e = r[0];
+	int o;
+	for (o = 1; o <= max_order; o++) {
+		double k = r[o];
+		for (j = 1; j < o; j++) k -= a[j] * r[o-j];
+		k /= e;
+		for (j = 1; j < o; j++) tmp[j] = a[j] - k * a[o-j];
+		for (j = 1; j < o; j++) a[j] = tmp[j];
+		a[o] = k;
+		e *= 1.0 - k * k;
+		for (j = 0; j < o; j++) lpc[o-1][j] = a[j+1];
+		err[o-1] = e;
+		if (e <= 0.0) return o;
+	}
+	return max_order;
+}
+
+static int quantize_lpc(const double *lpc, int order, int prec, int *coef, int *shift) {
+	double cmax = 0.0;
+	int i;
+	for (i = 0; i < order; i++) if (fabs(lpc[i]) > cmax) cmax = fabs(lpc[i]);
+	if (cmax <= 0.0) return -1;
+
+	int e;
+	frexp(cmax, &e);
+	int s = (prec - 1) - e;
+	if (s > 15) s = 15;
+	if (s < 0) return -1;
+
+	int qmax = (1 << (prec - 1)) - 1;
+	double carry = 0.0;
+	for (i = 0; i < order; i++) {
+		carry += lpc[i] * (1 << s);
+		long q = lround(carry);
+		if (q > qmax) q = qmax;
+		if (q < -qmax - 1) q = -qmax - 1;
+		carry -= q;
+		coef[i] = q;
+	}
+	*shift = s;
+	return 0;
+}
+
+// Picks the cheapest subframe type for one channel of a block. x, res and tmp hold n ints
+static void plan_subframe(plan_t *p, int *x, int n, int bps, int *res, int *tmp) {
+	memset(p, 0, sizeof(plan_t));
+	p->x = x;
+	p->res = res;
+
+	int i, all = 0;
+	for (i = 0; i < n; i++) all |= x[i];
+	for (i = 1; i < n && x[i] == x[0]; i++);
+	if (i == n) {
+		p->type = 0;
+		p->bps = bps;
+		p->bits = 8 + bps;
+		return;
+	}
+
+	// Low bits that are zero in every sample are sent once in the header
+	while (p->wasted < bps - 1 && !(all & (1 << p->wasted))) p->wasted++;
+	if (p->wasted) for (i = 0; i < n; i++) x[i] >>= p->wasted;
+	bps -= p->wasted;
+	p->bps = bps;
+
+	long head = 8 + p->wasted;
+	p->type = 1;
+	p->bits = head + (long)n * bps;
+
+	int o;
+	for (o = 0; o <= 4 && o < n; o++) {
+		plan_t c = *p;
+		c.order = o;
+		c.res = tmp;
+		fixed_residual(x, tmp, n, o);
+		long bits = head + (long)o * bps + plan_residual(&c, n);
+		if (bits < p->bits) {
+			int *keep = p->res;
+			*p = c;
+			p->type = 2;
+			p->bits = bits;
+			p->res = keep;
+			memcpy(keep + o, tmp + o, (n - o) * sizeof(int));
+		}
+	}
+
+	int max_order = n > 4 * FLAC_MAX_ORDER ? FLAC_MAX_ORDER : 0;
+	if (max_order) {
+		double lpc[FLAC_MAX_ORDER][FLAC_MAX_ORDER], err[FLAC_MAX_ORDER];
+		int got = compute_lpc(x, n, max_order, lpc, err);
+
+		// Estimate the cost of each order from its prediction error and encode only the best
+		int prec = bps <= 16 ? 14 : 12, choice = 0;
+		double best_est = 0.0;
+		for (o = 1; o <= got; o++) {
+			double bpr = err[o-1] > 0.0 ? 0.5 * log2(err[o-1] * M_LN2 * M_LN2 / (2.0 * n)) : 0.0;
+			if (bpr < 0.0) bpr = 0.0;
+			double est = bpr * (n - o) + (double)o * (bps + prec);
+			if (!choice || est < best_est) {
+				best_est = est;
+				choice = o;
+			}
+		}
+
+		plan_t c = *p;
+		if (choice && quantize_lpc(lpc[choice-1], choice, prec, c.coef, &c.shift) == 0 &&
+		    lpc_residual(x, tmp, n, c.coef, choice, c.shift) == 0) {
+			c.order = choice;
+			c.prec = prec;
+			c.res = tmp;
+			long bits = head + (long)choice * bps + 9 + (long)choice * prec + plan_residual(&c, n);
+			if (bits < p->bits) {
+				int *keep = p->res;
+				*p = c;
+				p->type = 3;
+				p->bits = bits;
+				p->res = keep;
+				memcpy(keep + choice, tmp + choice, (n - choice) * sizeof(int));
+			}
+		}
+	}
+}
+
+static void write_subframe(bitw_t *w, plan_t *p, int n) {
+	int i;
+	put_bits(w, 0, 1);
+	switch (p->type) {
+		case 0: put_bits(w, 0x00, 6); break;
+		case 1: put_bits(w, 0x01, 6); break;
+		case 2: put_bits(w, 0x08 | p->order, 6); break;
+		case 3: put_bits(w, 0x20 | (p->order - 1), 6); break;
+	}
+	put_bits(w, p->wasted ? 1 : 0, 1);
+	if (p->wasted) put_bits(w, 1, p->wasted); // wasted - 1 zeros, then a one
+
+	if (p->type == 0) {
+		put_bits(w, p->x[0], p->bps);
+		return;
+	}
+	if (p->type == 1) {
+		for (i = 0; i < n; i++) put_bits(w, p->x[i], p->bps);
+		return;
+	}
+
+	for (i = 0; i < p->order; i++) put_bits(w, p->x[i], p->bps);
+	if (p->type == 3) {
+		put_bits(w, p->prec - 1, 4);
+		put_bits(w, p->shift, 5);
+		for (i = 0; i < p->order; i++) put_bits(w, p->coef[i], p->prec);
+	}
+
+	put_bits(w, p->method, 2);
+	put_bits(w, p->porder, 4);
+	int parts = 1 << p->porder, ps = n >> p->porder, j;
+	for (i = 0; i < parts; i++) {
+		int k = p->param[i], start = i ? i * ps : p->order;
+		put_bits(w, k, p->method ? 5 : 4);
+		for (j = start; j < (i + 1) * ps; j++) {
+			u32 v = ((u32)p->res[j] << 1) ^ (u32)(p->res[j] >> 31), q = v >> k;
+			while (q >= 32) {
+				put_bits(w, 0, 32);
+				q -= 32;
+			}
+			if (q + 1 + k <= 32) put_bits(w, (1u << k) | (v & ((1u << k) - 1)), q + 1 + k);
+			else {
+				put_bits(w, 1, q + 1);
+				put_bits(w, v, k);
+			}
+		}
+	}
+}
+
+static int rate_code(int rate) {
+	const int rates[] = {0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000};
+	int i;
+	for (i = 1; i < 12; i++) if (rates[i] == rate) return i;
+	if (rate % 1000 == 0 && rate / 1000 < 256) return 12;
+	if (rate < 65536) return 13;
+	if (rate % 10 == 0 && rate / 10 < 65536) return 14;
+	return 0;
+}
+
+typedef struct {
+	audio_t *track;
+	int n_frames;
+	int bits;     // bits per sample
+	u8 **frames;  // encoded frames
+	long *size;
+} encoder_t;
+
+static void encode_frame(void *ctx, int task, int thread) {
+	(void)thread;
+	encoder_t *e = ctx;
+	audio_t *t = e->track;
+	int i, c, n_ch = t->n_ch, bps = t->bps, start = task * FLAC_BLOCK;
+	int n = t->sz - start < FLAC_BLOCK ? t->sz - start : FLAC_BLOCK;
+
+	// Quantize through the same path as WAV output, so dither and compacted tracks behave alike.
+	// Every frame gets its own dither sequence
+	u8 *pcm = malloc((size_t)n * n_ch * bps);
+	quantizer_t q;
+	init_quantizer(&q, t);
+	for (i = 0; i < 8; i++) q.seed[i] ^= 0x85ebca6bu * (task + 1);
+	quantize_samples(&q, t, pcm, start, n);
+	close_quantizer(&q);
+
+	int chans = n_ch == 2 ? 4 : n_ch; // stereo also gets mid and side candidates
+	int *x = malloc((size_t)chans * n * sizeof(int)), *res = malloc((size_t)chans * n * sizeof(int));
+	int *tmp = malloc(n * sizeof(int));
+	for (c = 0; c < n_ch; c++) {
+		int *d = x + c * n;
+		const u8 *s = pcm + c * bps;
+		for (i = 0; i < n; i++, s += n_ch * bps) {
+			if (bps == 1) d[i] = (int)s[0] - 128;
+			else if (bps == 2) d[i] = (short)(s[0] | s[1] << 8);
+			else d[i] = (int)((u32)s[0] << 8 | (u32)s[1] << 16 | (u32)s[2] << 24) >> 8;
+		}
+	}
+	free(pcm);
+	if (n_ch == 2) {
+		int *l = x, *r = x + n, *m = x + 2*n, *sd = x + 3*n;
+		for (i = 0; i < n; i++) {
+			m[i] = (l[i] + r[i]) >> 1;
+			sd[i] = l[i] - r[i];
+		}
+	}
+
+	plan_t *p = malloc(chans * sizeof(plan_t));
+	// Only the stereo side channel needs the extra bit, channel 3 of a wider track is an ordinary one
+	for (c = 0; c < chans; c++) plan_subframe(&p[c], x + c * n, n, e->bits + (n_ch == 2 && c == 3), res + c * n, tmp);
+
+	// Channel assignment: independent, left/side, side/right or mid/side
+	int assign = n_ch - 1, sub[2] = {0, 1};
+	if (n_ch == 2) {
+		long cost[4] = {p[0].bits + p[1].bits, p[0].bits + p[3].bits, p[3].bits + p[1].bits, p[2].bits + p[3].bits};
+		int best = 0;
+		for (i = 1; i < 4; i++) if (cost[i] < cost[best]) best = i;
+		const int pairs[4][2] = {{0, 1}, {0, 3}, {3, 1}, {2, 3}};
+		sub[0] = pairs[best][0];
+		sub[1] = pairs[best][1];
+		if (best) assign = 7 + best;
+	}
+
+	bitw_t w = {0};
+	put_bits(&w, 0xfff8, 16);
+	int bs_code = n == FLAC_BLOCK ? 12 : (n <= 256 ? 6 : 7), sr_code = rate_code(t->rate);
+	const int ss_codes[] = {0, 1, 4, 6};
+	put_bits(&w, bs_code, 4);
+	put_bits(&w, sr_code, 4);
+	put_bits(&w, assign, 4);
+	put_bits(&w, ss_codes[bps], 3);
+	put_bits(&w, 0, 1);
+	put_utf8(&w, task);
+	if (bs_code == 6) put_bits(&w, n - 1, 8);
+	if (bs_code == 7) put_bits(&w, n - 1, 16);
+	if (sr_code == 12) put_bits(&w, t->rate / 1000, 8);
+	if (sr_code == 13) put_bits(&w, t->rate, 16);
+	if (sr_code == 14) put_bits(&w, t->rate / 10, 16);
+	put_bits(&w, crc8(w.buf, w.len), 8);
+
+	for (c = 0; c < n_ch; c++) write_subframe(&w, &p[n_ch == 2 ? sub[c] : c], n);
+	align_bits(&w);
+	put_bits(&w, crc16(w.buf, w.len), 16);
+
+	e->frames[task] = w.buf;
+	e->size[task] = w.len;
+
+	free(p);
+	free(x);
+	free(res);
+	free(tmp);
+}
+
+int write_flac(audio_t *track, char *fname, io_stats_t *st) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	if (!track || !fname) return -1;
+	use_audio(track);
+	if ((!track->buf && !track->packed && !track->frames) || track->sz < 1 || track->n_ch < 1) {
+		log_message("Error: invalid audio track\n");
+		return -1;
+	}
+	if (track->fmt != 1 || track->bps > 3) {
+		log_message("Error: FLAC stores integer PCM of up to 24 bits\n");
+		return -3;
+	}
+	if (track->n_ch > 8 || track->rate < 1 || track->rate >= (1 << 20)) {
+		log_message("Error: FLAC supports up to 8 channels and rates below 1048576 Hz\n");
+		return -4;
+	}
+
+	double start = now();
+	init_crc16();
+
+	encoder_t e = {0};
+	e.track = track;
+	e.bits = track->bps * 8;
+	e.n_frames = (track->sz + FLAC_BLOCK - 1) / FLAC_BLOCK;
+	e.frames = calloc(e.n_frames, sizeof(u8*));
+	e.size = calloc(e.n_frames, sizeof(long));
+
+	// Frames are independent, so they are encoded on every core and written in order afterwards
+	run_parallel(e.n_frames, 0, encode_frame, &e);
+	double cpu = now() - start;
+
+	long min_sz = 0, max_sz = 0, total = 0;
+	int i;
+	for (i = 0; i < e.n_frames; i++) {
+		if (!min_sz || e.size[i] < min_sz) min_sz = e.size[i];
+		if (e.size[i] > max_sz) max_sz = e.size[i];
+	}
+
+	bitw_t h = {0};
+	put_bits(&h, 'f' << 24 | 'L' << 16 | 'a' << 8 | 'C', 32);
+
+	// STREAMINFO. The MD5 signature is left zero, meaning it was not computed
+	put_bits(&h, 0, 1);
+	put_bits(&h, 0, 7);
+	put_bits(&h, 34, 24);
+	put_bits(&h, FLAC_BLOCK, 16);
+	put_bits(&h, FLAC_BLOCK, 16);
+	put_bits(&h, min_sz, 24);
+	put_bits(&h, max_sz, 24);
+	put_bits(&h, track->rate, 20);
+	put_bits(&h, track->n_ch - 1, 3);
+	put_bits(&h, e.bits - 1, 5);
+	put_wide(&h, track->sz, 36);
+	for (i = 0; i < 4; i++) put_bits(&h, 0, 32);
+
+	// SEEKTABLE, one point every FLAC_SEEK_FRAMES frames
+	int n_points = (e.n_frames + FLAC_SEEK_FRAMES - 1) / FLAC_SEEK_FRAMES;
+	put_bits(&h, 1, 1);
+	put_bits(&h, 3, 7);
+	put_bits(&h, n_points * 18, 24);
+	long off = 0;
+	for (i = 0; i < e.n_frames; i++) {
+		if (i % FLAC_SEEK_FRAMES == 0) {
+			long s = (long)i * FLAC_BLOCK;
+			put_wide(&h, s, 64);
+			put_wide(&h, off, 64);
+			put_bits(&h, track->sz - s < FLAC_BLOCK ? track->sz - s : FLAC_BLOCK, 16);
+		}
+		off += e.size[i];
+	}
+
+	FILE *f = fopen(fname, "wb");
+	if (!f) {
+		log_message("Error: could not create \"%s\"\n", fname);
+		for (i = 0; i < e.n_frames; i++) free(e.frames[i]);
+		free(e.frames);
+		free(e.size);
+		free(h.buf);
+		return -2;
+	}
+
+	double t = now();
+	fwrite(h.buf, 1, h.len, f);
+	total = h.len;
+	for (i = 0; i < e.n_frames; i++) {
+		fwrite(e.frames[i], 1, e.size[i], f);
+		total += e.size[i];
+		free(e.frames[i]);
+	}
+	fclose(f);
+	double io = now() - t;
+
+	free(e.frames);
+	free(e.size);
+	free(h.buf);
+
+	if (st) {
+		st->wall = now() - start;
+		st->io = io;
+		st->cpu = cpu;
+		st->bytes = total;
+	}
+	return 0;
+}
+
+// Decoder
+
+typedef struct {
+	const u8 *data;  // file contents from the first frame on
+	long len;
+	int n_ch, bits, max_block;
+	int fixed_block; // nominal block size of a fixed blocksize stream
+	long total;
+	long *seg_off;   // parallel decoding segments, from the seek table
+	long *seg_end;
+	int n_seg;
+	audio_t *track;
+	int err;         // first error of any segment, read and set atomically by the workers
+} decoder_t;
+
+static int decode_residual(bitr_t *r, int *x, int n, int order) {
+	int method = get_bits(r, 2);
+	if (method > 1) return -1;
+
+	int po = get_bits(r, 4), parts = 1 << po, ps = n >> po, i, j;
+	if (n % parts || ps < order) return -1;
+
+	int esc = method ? 31 : 15;
+	for (i = 0; i < parts; i++) {
+		int k = get_bits(r, method ? 5 : 4), start = i ? i * ps : order;
+		if (k == esc) {
+			int raw = get_bits(r, 5);
+			for (j = start; j < (i + 1) * ps; j++) x[j] = get_signed(r, raw);
+		}
+		else {
+			for (j = start; j < (i + 1) * ps; j++) {
+				u32 v = get_unary(r) << k;
+				v |= get_bits(r, k);
+				x[j] = (int)(v >> 1) ^ -(int)(v & 1);
+			}
+		}
+		if (r->err) return -1;
+	}
+	return 0;
+}
+
+static int decode_subframe(bitr_t *r, int *x, int n, int bps) {
+	if (get_bits(r, 1)) return -1;
+	int type = get_bits(r, 6), wasted = 0, i, j;
+	if (get_bits(r, 1)) wasted = get_unary(r) + 1;
+	bps -= wasted;
+	if (bps < 1 || bps > 32) return -1;
+
+	if (type == 0) {
+		int v = get_signed(r, bps);
+		for (i = 0; i < n; i++) x[i] = v;
+	}
+	else if (type == 1) {
+		for (i = 0; i < n; i++) x[i] = get_signed(r, bps);
+	}
+	else if (type >= 8 && type <= 12) {
+		int order = type & 7;
+		if (order > n) return -1;
+		for (i = 0; i < order; i++) x[i] = get_signed(r, bps);
+		if (decode_residual(r, x, n, order) < 0) return -1;
+		for (i = order; i < n; i++) {
+			switch (order) {
+				case 1: x[i] += x[i-1]; break;
+				case 2: x[i] += 2*x[i-1] - x[i-2]; break;
+				case 3: x[i] += 3*x[i-1] - 3*x[i-2] + x[i-3]; break;
+				case 4: x[i] += 4*x[i-1] - 6*x[i-2] + 4*x[i-3] - x[i-4]; break;
+			}
+		}
+	}
+	else if (type >= 32) {
+		int order = (type & 31) + 1, coef[32];
+		if (order > n) return -1;
+		for (i = 0; i < order; i++) x[i] = get_signed(r, bps);
+		int prec = get_bits(r, 4) + 1, shift = get_signed(r, 5);
+		if (prec == 16 || shift < 0) return -1;
+		for (i = 0; i < order; i++) coef[i] = get_signed(r, prec);
+		if (decode_residual(r, x, n, order) < 0) return -1;
+		for (i = order; i < n; i++) {
+			long long sum = 0;
+			for (j = 0; j < order; j++) sum += (long long)coef[j] * x[i-1-j];
+			x[i] += (int)(sum >> shift);
+		}
+	}
+	else return -1;
+
+	if (wasted) for (i = 0; i < n; i++) x[i] = (int)((u32)x[i] << wasted);
+	return r->err ? -1 : 0;
+}
+
+// Decodes the frame at p into the track. Returns its size in bytes, or a negative error
+static long decode_frame(decoder_t *d, const u8 *p, long avail, int *x) {
+	bitr_t r;
+	init_reader(&r, p, avail);
+
+	if (get_bits(&r, 15) != 0x7ffc) return -1;
+	int variable = get_bits(&r, 1);
+	int bs_code = get_bits(&r, 4), sr_code = get_bits(&r, 4), assign = get_bits(&r, 4), ss_code = get_bits(&r, 3);
+	get_bits(&r, 1);
+
+	u32 b = get_bits(&r, 8);
+	u64 num = b;
+	if (b & 0x80) {
+		int len = 0, i;
+		while (len < 8 && (b & (0x80 >> len))) len++;
+		if (len < 2 || len > 7) return -1;
+		num = b & (0x7f >> len);
+		for (i = 1; i < len; i++) {
+			b = get_bits(&r, 8);
+			if ((b & 0xc0) != 0x80) return -1;
+			num = num << 6 | (b & 0x3f);
+		}
+	}
+
+	int n;
+	if (bs_code == 1) n = 192;
+	else if (bs_code >= 2 && bs_code <= 5) n = 576 << (bs_code - 2);
+	else if (bs_code == 6) n = get_bits(&r, 8) + 1;
+	else if (bs_code == 7) n = get_bits(&r, 16) + 1;
+	else if (bs_code >= 8) n = 256 << (bs_code - 8);
+	else return -1;
+
+	if (sr_code == 12) get_bits(&r, 8);
+	else if (sr_code == 13 || sr_code == 14) get_bits(&r, 16);
+	else if (sr_code == 15) return -1;
+
+	const int sizes[] = {0, 8, 12, 0, 16, 20, 24, 32};
+	int bits = ss_code ? sizes[ss_code] : d->bits;
+	if (!bits) return -1;
+
+	long hdr = read_pos(&r) / 8;
+	if (r.err || get_bits(&r, 8) != crc8(p, hdr)) return -2;
+
+	int n_ch = assign < 8 ? assign + 1 : 2;
+	if (assign > 10 || n_ch != d->n_ch || n > d->max_block) return -1;
+
+	long sample = variable ? (long)num : (long)num * d->fixed_block;
+	if (sample + n > d->total) return -1;
+
+	int c, i;
+	for (c = 0; c < n_ch; c++) {
+		int side = (assign == 8 && c == 1) || (assign == 9 && c == 0) || (assign == 10 && c == 1);
+		if (decode_subframe(&r, x + c * n, n, bits + side) < 0) return -1;
+	}
+	align_reader(&r);
+	long len = read_pos(&r) / 8;
+	if (r.err || len + 2 > avail || get_bits(&r, 16) != crc16(p, len)) return -2;
+
+	int *a = x, *s = x + n;
+	if (assign == 8) for (i = 0; i < n; i++) s[i] = a[i] - s[i];
+	if (assign == 9) for (i = 0; i < n; i++) a[i] += s[i];
+	if (assign == 10) {
+		for (i = 0; i < n; i++) {
+			int mid = (int)((u32)a[i] << 1) | (s[i] & 1), side = s[i];
+			a[i] = (mid + side) >> 1;
+			s[i] = (mid - side) >> 1;
+		}
+	}
+
+	float scale = 1.0f / (float)(1u << (d->bits - 1));
+	for (c = 0; c < n_ch; c++) {
+		float *dst = d->track->buf[c] + sample;
+		int *src = x + c * n;
+		for (i = 0; i < n; i++) dst[i] = src[i] * scale;
+	}
+	return len + 2;
+}
+
+static void decode_segment(void *ctx, int task, int thread) {
+	(void)thread;
+	decoder_t *d = ctx;
+	int *x = malloc((size_t)d->n_ch * d->max_block * sizeof(int));
+
+	long off = d->seg_off[task];
+	while (off < d->seg_end[task] && !__atomic_load_n(&d->err, __ATOMIC_RELAXED)) {
+		long r = decode_frame(d, d->data + off, d->len - off, x);
+		if (r < 0) {
+			// The first error is the one reported
+			int none = 0;
+			__atomic_compare_exchange_n(&d->err, &none, (int)r, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			break;
+		}
+		off += r;
+	}
+	free(x);
+}
+
+int load_flac(audio_t *track, char *fname, char *name, io_stats_t *st) {
+	TRACE();
+	if (!track || !fname) return -1;
+
+	double start = now();
+	FILE *f = fopen(fname, "rb");
+	if (!f) {
+		log_message("Error: could not open \"%s\"\n", fname);
+		return -2;
+	}
+	fseek(f, 0, SEEK_END);
+	long sz = ftell(f);
+	rewind(f);
+
+	u8 *file = malloc(sz + 1);
+	long got = fread(file, 1, sz, f);
+	fclose(f);
+	double io = now() - start;
+
+	// An ID3v2 tag may come before the stream marker
+	long p = 0;
+	if (got >= 10 && !memcmp(file, "ID3", 3)) p = 10 + ((file[6] & 0x7f) << 21 | (file[7] & 0x7f) << 14 | (file[8] & 0x7f) << 7 | (file[9] & 0x7f));
+	if (p + 4 > got || memcmp(file + p, "fLaC", 4)) {
+		log_message("Error: \"%s\" is not a FLAC file\n", fname);
+		free(file);
+		return -4;
+	}
+	p += 4;
+
+	decoder_t d = {0};
+	u64 *points = NULL;
+	int n_points = 0, last = 0, have_info = 0;
+	while (!last && p + 4 <= got) {
+		last = file[p] >> 7;
+		int type = file[p] & 0x7f;
+		long len = file[p+1] << 16 | file[p+2] << 8 | file[p+3];
+		p += 4;
+		if (p + len > got) break;
+
+		bitr_t r;
+		init_reader(&r, file + p, len);
+		if (type == 0 && len >= 34) {
+			get_bits(&r, 16);
+			d.max_block = get_bits(&r, 16);
+			get_bits(&r, 24);
+			get_bits(&r, 24);
+			int rate = get_bits(&r, 20);
+			d.n_ch = get_bits(&r, 3) + 1;
+			d.bits = get_bits(&r, 5) + 1;
+			d.total = (long)get_bits(&r, 4) << 32;
+			d.total |= get_bits(&r, 32);
+			d.fixed_block = d.max_block; // the last frame of a fixed blocksize stream may be shorter
+			track->rate = rate;
+			have_info = 1;
+		}
+		if (type == 3) {
+			points = malloc((len / 18 + 1) * 2 * sizeof(u64));
+			int i;
+			for (i = 0; i < len / 18; i++) {
+				u64 s = (u64)get_bits(&r, 32) << 32;
+				s |= get_bits(&r, 32);
+				u64 o = (u64)get_bits(&r, 32) << 32;
+				o |= get_bits(&r, 32);
+				get_bits(&r, 16);
+				if (s == ~0ull) continue; // placeholder
+				points[2*n_points] = s;
+				points[2*n_points+1] = o;
+				n_points++;
+			}
+		}
+		p += len;
+	}
+
+	int r = 0;
+	if (!have_info) r = -5;
+	else if (d.bits > 24 || d.bits < 4) r = -8;
+	else if (d.total < 1) r = -9;
+	if (r == -5) log_message("Error: \"%s\" has no STREAMINFO block\n", fname);
+	if (r == -8) log_message("Error: %d-bit FLAC is not supported\n", d.bits);
+	if (r == -9) log_message("Error: \"%s\" does not give its length\n", fname);
+	if (r < 0) {
+		free(points);
+		free(file);
+		return r;
+	}
+
+	free_audio_data(track);
+	track->n_ch = d.n_ch;
+	track->bps = (d.bits + 7) / 8;
+	track->fmt = 1;
+	track->sz = d.total;
+	track->buf = calloc(d.n_ch, sizeof(void*));
+	int i;
+	for (i = 0; i < d.n_ch; i++) track->buf[i] = calloc(d.total, sizeof(float));
+
+	// Each seek point starts a run of frames that can be decoded independently of the others
+	d.data = file + p;
+	d.len = got - p;
+	d.track = track;
+	d.seg_off = malloc((n_points + 1) * sizeof(long));
+	d.seg_end = malloc((n_points + 1) * sizeof(long));
+	for (i = 0; i < n_points; i++) {
+		if ((long)points[2*i+1] >= d.len || (d.n_seg && (long)points[2*i+1] <= d.seg_off[d.n_seg-1])) continue;
+		d.seg_off[d.n_seg++] = points[2*i+1];
+	}
+	if (!d.n_seg || d.seg_off[0] != 0) {
+		memmove(d.seg_off + 1, d.seg_off, d.n_seg * sizeof(long));
+		d.seg_off[0] = 0;
+		d.n_seg++;
+	}
+	for (i = 0; i < d.n_seg; i++) d.seg_end[i] = i + 1 < d.n_seg ? d.seg_off[i+1] : d.len;
+
+	init_crc16();
+	double t = now();
+	run_parallel(d.n_seg, 0, decode_segment, &d);
+	double cpu = now() - t;
+
+	free(d.seg_off);
+	free(d.seg_end);
+	free(points);
+	free(file);
+
+	if (d.err) {
+		log_message("Error: \"%s\" is corrupt (%s)\n", fname, d.err == -2 ? "CRC mismatch" : "invalid frame");
+		free_audio_data(track);
+		return -10;
+	}
+	if (name) track->name = strdup(name);
+	TRACE_SAMPLES((long)track->sz * track->n_ch);
+	touch_audio(track);
+
+	if (st) {
+		st->wall = now() - start;
+		st->io = io;
+		st->cpu = cpu;
+		st->bytes = sz;
+	}
+	return 0;
+}
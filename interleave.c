@@ -0,0 +1,145 @@
+#include "audio.h"
+
+#define TILE 64 // frames transposed at a time, so both sides of the copy stay in cache
+
+typedef unsigned char u8;
+
+int interleave_audio(audio_t *track) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	if (!track) return -1;
+	track->layout = LAYOUT_INTERLEAVED;
+	use_audio(track);
+	if (track->frames) return 0;
+	expand_audio(track); // packed samples become planar floats first
+	track->store = STORE_FLOAT;
+	if (!track->buf || track->n_ch < 1) return -2;
+
+	int n_ch = track->n_ch, c;
+	long j, k, p, next;
+	float *f = malloc((size_t)track->sz * n_ch * sizeof(float) + 1);
+	for (p = 0; p < track->sz; p = next) {
+		if (silent_run(track, p, track->sz, &next)) {
+			zero_samples(f + p * n_ch, (next - p) * n_ch * sizeof(float));
+			continue;
+		}
+		for (j = p; j < next; j += TILE) {
+			long end = next - j < TILE ? next : j + TILE;
+			for (c = 0; c < n_ch; c++) {
+				const float *restrict x = track->buf[c];
+				for (k = j; k < end; k++) f[k * n_ch + c] = x[k];
+			}
+		}
+	}
+
+	for (c = 0; c < n_ch; c++) free(track->buf[c]);
+	free(track->buf);
+	track->buf = NULL;
+	track->frames = f;
+	return 0;
+}
+
+void deinterleave_audio(audio_t *track) {
+	use_audio(track);
+	if (!track || !track->frames) return;
+
+	TRACE();
+	TRACE_SAMPLES((long)track->sz * track->n_ch);
+	int n_ch = track->n_ch, c;
+	long j, k, p, next;
+	const float *f = track->frames;
+	track->buf = calloc(n_ch, sizeof(void*));
+	for (c = 0; c < n_ch; c++) track->buf[c] = malloc((size_t)track->sz * sizeof(float) + 1);
+
+	for (p = 0; p < track->sz; p = next) {
+		if (silent_run(track, p, track->sz, &next)) {
+			for (c = 0; c < n_ch; c++) zero_samples(track->buf[c] + p, (next - p) * sizeof(float));
+			continue;
+		}
+		for (j = p; j < next; j += TILE) {
+			long end = next - j < TILE ? next : j + TILE;
+			for (c = 0; c < n_ch; c++) {
+				float *restrict x = track->buf[c];
+				for (k = j; k < end; k++) x[k] = f[k * n_ch + c];
+			}
+		}
+	}
+	free(track->frames);
+	track->frames = NULL;
+}
+
+// One output frame is a matrix-vector product over one contiguous input frame. Each row only
+// visits its non-zero weights: nz[o*n_in...] lists their inputs, n_nz[o] how many there are
+static void matrix_frames(const float *restrict in, float *restrict out, const float *restrict m, const int *nz, const int *n_nz, long n, int n_in, int n_out) {
+	long j;
+	int k, o;
+	for (j = 0; j < n; j++) {
+		const float *x = in + j * n_in;
+		for (o = 0; o < n_out; o++) {
+			const float *w = m + o * n_in;
+			const int *r = nz + o * n_in;
+			float s = 0.0f;
+			for (k = 0; k < n_nz[o]; k++) s += w[r[k]] * x[r[k]];
+			out[j * n_out + o] = s;
+		}
+	}
+}
+
+int matrix_audio(audio_t *track, float *m, int n_out) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	if (!track || !m || n_out < 1) return -1;
+	use_audio(track);
+	if (track->packed) expand_audio(track);
+	if ((!track->buf && !track->frames) || track->n_ch < 1) return -2;
+
+	int n_in = track->n_ch, i, o;
+	long j, p, next;
+	if (track->frames) {
+		int *nz = malloc((size_t)n_out * n_in * sizeof(int)), *n_nz = calloc(n_out, sizeof(int));
+		for (o = 0; o < n_out; o++) {
+			for (i = 0; i < n_in; i++) {
+				if (m[o * n_in + i] != 0.0f) nz[o * n_in + n_nz[o]++] = i;
+			}
+		}
+
+		float *out = malloc((size_t)track->sz * n_out * sizeof(float) + 1);
+		for (p = 0; p < track->sz; p = next) {
+			if (silent_run(track, p, track->sz, &next)) zero_samples(out + p * n_out, (next - p) * n_out * sizeof(float));
+			else matrix_frames(track->frames + p * n_in, out + p * n_out, m, nz, n_nz, next - p, n_in, n_out);
+		}
+		free(nz);
+		free(n_nz);
+		free(track->frames);
+		track->frames = out;
+	}
+	else {
+		// Planar: every output channel accumulates the input channels that feed it
+		float **out = calloc(n_out, sizeof(void*));
+		for (o = 0; o < n_out; o++) {
+			out[o] = calloc(track->sz, sizeof(float));
+			for (i = 0; i < n_in; i++) {
+				float w = m[o * n_in + i], *restrict y = out[o];
+				const float *restrict x = track->buf[i];
+				if (w == 0.0f) continue;
+				for (p = 0; p < track->sz; p = next) {
+					if (silent_run(track, p, track->sz, &next)) continue;
+					for (j = p; j < next; j++) y[j] += w * x[j];
+				}
+			}
+		}
+		for (i = 0; i < n_in; i++) free(track->buf[i]);
+		free(track->buf);
+		track->buf = out;
+	}
+
+	// Silence maps to silence, so the silent blocks are carried over
+	unsigned char *silent = track->silent;
+	long n_silent = track->n_silent;
+	track->silent = NULL;
+	track->n_ch = n_out;
+	touch_audio(track);
+	track->silent = silent;
+	track->n_silent = n_silent;
+	return 0;
+}
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "audio.h"
+
+#define JOURNAL_CHUNK (1<<20) // bytes encoded per pass while writing the journal
+
+typedef unsigned char u8;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+// An in-place save first writes every byte range it is about to overwrite, with the new contents,
+// to <file>.journal and syncs it. Only then is the WAV itself patched. A journal that is complete
+// (its checksum matches) is replayed the next time the file is opened or saved, and an incomplete
+// one is discarded because the WAV was not touched yet:
+//   "WTJ1", u32 entry count, { u64 file offset, u64 length, bytes }..., u32 FNV-1a of everything before
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static u32 fnv(u32 h, const void *p, long n) {
+	const u8 *b = p;
+	long i;
+	for (i = 0; i < n; i++) h = (h ^ b[i]) * 16777619u;
+	return h;
+}
+
+static void journal_path(char *dst, int sz, char *fname) {
+	snprintf(dst, sz, "%s.journal", fname);
+}
+
+// Makes the creation or removal of the journal itself durable
+static void sync_dir(char *fname) {
+	char buf[1024];
+	snprintf(buf, sizeof(buf), "%s", fname);
+	int fd = open(dirname(buf), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) return;
+	fsync(fd);
+	close(fd);
+}
+
+static int put(int fd, const void *p, long n, u32 *h) {
+	*h = fnv(*h, p, n);
+	return write(fd, p, n) == n ? 0 : -1;
+}
+
+static int copy_range(int in, long in_off, int out, long out_off, long len) {
+	loff_t a = in_off, b = out_off;
+	while (len > 0) {
+		ssize_t n = copy_file_range(in, &a, out, &b, len, 0);
+		if (n <= 0) break;
+		len -= n;
+	}
+	if (len > 0) {
+		u8 *buf = malloc(JOURNAL_CHUNK);
+		while (len > 0) {
+			ssize_t n = pread(in, buf, len < JOURNAL_CHUNK ? len : JOURNAL_CHUNK, a);
+			if (n <= 0 || pwrite(out, buf, n, b) != n) break;
+			a += n;
+			b += n;
+			len -= n;
+		}
+		free(buf);
+	}
+	return len > 0 ? -1 : 0;
+}
+
+// Checks the journal and copies its entries into the file. Returns 1 if it was applied, 0 if it
+// was incomplete or corrupt, or a negative error. It is read in JOURNAL_CHUNK pieces, never whole
+static int apply_journal(int jfd, int fd) {
+	struct stat st;
+	if (fstat(jfd, &st) < 0 || st.st_size < 12) return 0;
+
+	u8 head[16], *buf = malloc(JOURNAL_CHUNK);
+	u32 sum, h = 2166136261u, count;
+	long end = st.st_size - 4, p, i;
+	for (p = 0; p < end; p += JOURNAL_CHUNK) {
+		long n = end - p < JOURNAL_CHUNK ? end - p : JOURNAL_CHUNK;
+		if (pread(jfd, buf, n, p) != n) break;
+		h = fnv(h, buf, n);
+	}
+	free(buf);
+	if (p < end || pread(jfd, &sum, 4, end) != 4 || pread(jfd, head, 8, 0) != 8) return 0;
+	if (memcmp(head, "WTJ1", 4) || h != sum) return 0;
+	memcpy(&count, head + 4, 4);
+
+	// Every entry must fit before anything is copied, so a bad journal never half-patches the file
+	for (i = 0, p = 8; i < count; i++) {
+		u64 len;
+		if (p + 16 > end || pread(jfd, head, 16, p) != 16) return 0;
+		memcpy(&len, head + 8, 8);
+		if (len > (u64)(end - p - 16)) return 0;
+		p += 16 + len;
+	}
+
+	int r = 1;
+	for (i = 0, p = 8; i < count && r > 0; i++) {
+		u64 off, len;
+		if (pread(jfd, head, 16, p) != 16) r = -1;
+		memcpy(&off, head, 8);
+		memcpy(&len, head + 8, 8);
+		p += 16;
+		if (r > 0 && copy_range(jfd, p, fd, off, len) < 0) r = -1;
+		p += len;
+	}
+	if (r > 0 && fsync(fd) < 0) r = -1;
+	return r;
+}
+
+// A journal is only removed once it was applied, or when it is incomplete. One that could not be
+// applied stays for the next attempt, and the file must not be read or written until then
+int replay_journal(char *fname) {
+	if (!fname) return -1;
+
+	char jpath[1024];
+	journal_path(jpath, sizeof(jpath), fname);
+	int jfd = open(jpath, O_RDONLY);
+	if (jfd < 0) return 0;
+
+	int fd = open(fname, O_WRONLY), r = -2;
+	if (fd >= 0) {
+		r = apply_journal(jfd, fd);
+		close(fd);
+	}
+	close(jfd);
+
+	if (r < 0) {
+		log_message("Error: could not finish the interrupted save of \"%s\", \"%s\" is kept\n", fname, jpath);
+		return r;
+	}
+	if (r > 0) log_message("Recovered an interrupted save of \"%s\"\n", fname);
+	unlink(jpath);
+	sync_dir(fname);
+	return r;
+}
+
+int can_save_in_place(audio_t *track, char *fname) {
+	if (!source_usable(track) || !fname) return 0;
+	source_t *s = track->source;
+
+	struct stat st;
+	if (stat(fname, &st) < 0 || st.st_dev != s->dev || st.st_ino != s->ino) return 0;
+	if (track->sz != s->frames) return 0;
+
+	// Every clean span has to be where it was in the file, and at most half the track may be dirty,
+	// past which rewriting the file is cheaper than writing the changes twice
+	int i;
+	for (i = 0; i < s->n_span; i++) {
+		if (s->span[i].start != s->span[i].src) return 0;
+	}
+	return clean_frames(track) * 2 >= track->sz;
+}
+
+int save_in_place(audio_t *track, char *fname, io_stats_t *st) {
+	TRACE();
+	if (!can_save_in_place(track, fname)) return -1;
+
+	double start = now(), cpu = 0.0, t;
+	source_t *s = track->source;
+	int frame = track->n_ch * track->bps, i;
+
+	// Dirty ranges are the gaps between the spans
+	long *gap = malloc(2 * (s->n_span + 1) * sizeof(long));
+	int n_gap = 0;
+	long pos = 0;
+	for (i = 0; i <= s->n_span; i++) {
+		long end = i < s->n_span ? s->span[i].start : track->sz;
+		if (end > pos) {
+			gap[2*n_gap] = pos;
+			gap[2*n_gap+1] = end - pos;
+			n_gap++;
+		}
+		if (i < s->n_span) pos = s->span[i].start + s->span[i].len;
+	}
+
+	// Size fields that disagree with the file (one that was truncated) are fixed as well
+	u32 want[2], have[2];
+	u64 field[2] = {4, s->data_off - 4};
+	want[0] = s->size - 8;
+	want[1] = (u32)track->sz * frame;
+	int patch = 0;
+	FILE *f = fopen(fname, "rb");
+	for (i = 0; f && i < 2; i++) {
+		fseek(f, field[i], SEEK_SET);
+		if (fread(&have[i], 4, 1, f) == 1 && have[i] != want[i]) patch |= 1 << i;
+	}
+	if (f) fclose(f);
+
+	char jpath[1024];
+	journal_path(jpath, sizeof(jpath), fname);
+	int jfd = open(jpath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (jfd < 0) {
+		free(gap);
+		return -2;
+	}
+
+	quantizer_t q;
+	init_quantizer(&q, track);
+	int per = JOURNAL_CHUNK / frame > 0 ? JOURNAL_CHUNK / frame : 1;
+	u8 *buf = malloc((long)per * frame);
+
+	u32 sum = 2166136261u, count = n_gap + (patch & 1) + (patch >> 1);
+	int r = put(jfd, "WTJ1", 4, &sum) | put(jfd, &count, 4, &sum);
+	for (i = 0; i < n_gap && r == 0; i++) {
+		u64 off = s->data_off + (u64)gap[2*i] * frame, len = (u64)gap[2*i+1] * frame;
+		r = put(jfd, &off, 8, &sum) | put(jfd, &len, 8, &sum);
+
+		long p, end = gap[2*i] + gap[2*i+1];
+		for (p = gap[2*i]; p < end && r == 0; p += per) {
+			int n = end - p < per ? end - p : per;
+			t = now();
+			quantize_samples(&q, track, buf, p, n);
+			cpu += now() - t;
+			r = put(jfd, buf, (long)n * frame, &sum);
+		}
+	}
+	for (i = 0; i < 2 && r == 0; i++) {
+		if (!(patch & 1 << i)) continue;
+		u64 len = 4;
+		r = put(jfd, &field[i], 8, &sum) | put(jfd, &len, 8, &sum) | put(jfd, &want[i], 4, &sum);
+	}
+	if (r == 0) r = write(jfd, &sum, 4) == 4 ? 0 : -1;
+	if (r == 0) r = fsync(jfd);
+	close_quantizer(&q);
+	free(buf);
+	free(gap);
+
+	// Once the journal is durable the file itself can be patched
+	if (r == 0) {
+		sync_dir(fname);
+		int fd = open(fname, O_WRONLY);
+		r = fd < 0 ? -1 : (apply_journal(jfd, fd) > 0 ? 0 : -1);
+		if (fd >= 0) close(fd);
+	}
+	close(jfd);
+	if (r < 0) {
+		log_message("Error: could not update \"%s\" in place\n", fname);
+		return -3;
+	}
+	unlink(jpath);
+	sync_dir(fname);
+
+	// The clean spans are still exact, the file just has a new size field and modification time
+	struct stat fs;
+	if (stat(fname, &fs) == 0) {
+		s->size = fs.st_size;
+		s->mtime = fs.st_mtime;
+	}
+
+	if (st) {
+		st->wall = now() - start;
+		st->io = st->wall - cpu;
+		st->cpu = cpu;
+		st->bytes = (long)(track->sz - clean_frames(track)) * frame;
+	}
+	return 0;
+}
@@ -0,0 +1,336 @@
+#include "audio.h"
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+
+int store_size(int store) {
+	switch (store) {
+		case STORE_FLOAT: return 4;
+		case STORE_INT8:  return 1;
+		case STORE_INT16: return 2;
+		case STORE_INT24: return 3;
+		case STORE_INT32: return 4;
+		case STORE_HALF:  return 2;
+	}
+	return 0;
+}
+
+int native_store(audio_t *track) {
+	if (!track || track->fmt == 3) return STORE_FLOAT;
+	switch (track->bps) {
+		case 1: return STORE_INT8;
+		case 2: return STORE_INT16;
+		case 3: return STORE_INT24;
+	}
+	return STORE_INT32;
+}
+
+static u16 float_to_half(float f) {
+	u32 x;
+	memcpy(&x, &f, 4);
+
+	u32 sign = (x >> 16) & 0x8000, mant = x & 0x7fffff;
+	int exp = (int)((x >> 23) & 0xff) - 127 + 15;
+
+	if (exp >= 31) return sign | (((x & 0x7fffffff) > 0x7f800000) ? 0x7e00 : 0x7c00); // overflow, inf, NaN
+	if (exp <= 0) {
+		if (exp < -10) return sign;
+		mant |= 0x800000;
+		int shift = 14 - exp;
+		u32 h = mant >> shift, rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+		if (rem > half || (rem == half && (h & 1))) h++;
+		return sign | h;
+	}
+
+	u32 h = sign | (exp << 10) | (mant >> 13), rem = mant & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++; // round to nearest even, may carry into the exponent
+	return h;
+}
+
+static float half_to_float(u16 h) {
+	u32 sign = (u32)(h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff, x;
+
+	if (exp == 0) {
+		if (!mant) x = sign;
+		else {
+			exp = 127 - 15 + 1;
+			while (!(mant & 0x400)) {
+				mant <<= 1;
+				exp--;
+			}
+			x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+		}
+	}
+	else if (exp == 31) x = sign | 0x7f800000 | (mant << 13);
+	else x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+
+	float f;
+	memcpy(&f, &x, 4);
+	return f;
+}
+
+static int round_sat(float v, float scale) {
+	v *= scale;
+	if (v < -scale) v = -scale;
+	if (v > scale - 1.0f) v = scale - 1.0f;
+	return (int)(v + (v >= 0.0f ? 0.5f : -0.5f));
+}
+
+void pack_block(void *dst, float *src, int n, int store) {
+	if (!dst || !src || n < 1) return;
+
+	int i;
+	switch (store) {
+		case STORE_FLOAT:
+			memcpy(dst, src, n * sizeof(float));
+			break;
+		case STORE_INT8: {
+			signed char *restrict d = dst;
+			for (i = 0; i < n; i++) d[i] = round_sat(src[i], 128.0f);
+			break;
+		}
+		case STORE_INT16: {
+			short *restrict d = dst;
+			for (i = 0; i < n; i++) d[i] = round_sat(src[i], 32768.0f);
+			break;
+		}
+		case STORE_INT24: {
+			u8 *restrict d = dst;
+			for (i = 0; i < n; i++) {
+				int v = round_sat(src[i], 8388608.0f);
+				d[3*i] = v;
+				d[3*i+1] = v >> 8;
+				d[3*i+2] = v >> 16;
+			}
+			break;
+		}
+		case STORE_INT32: {
+			int *restrict d = dst;
+			for (i = 0; i < n; i++) {
+				float v = src[i] * 2147483648.0f;
+				v = v < -2147483648.0f ? -2147483648.0f : (v > 2147483520.0f ? 2147483520.0f : v);
+				d[i] = (int)(v + (v >= 0.0f ? 0.5f : -0.5f));
+			}
+			break;
+		}
+		case STORE_HALF: {
+			u16 *d = dst;
+			for (i = 0; i < n; i++) d[i] = float_to_half(src[i]);
+			break;
+		}
+	}
+}
+
+void unpack_block(float *dst, void *src, int n, int store) {
+	if (!dst || !src || n < 1) return;
+
+	int i;
+	switch (store) {
+		case STORE_FLOAT:
+			memcpy(dst, src, n * sizeof(float));
+			break;
+		case STORE_INT8: {
+			const signed char *restrict s = src;
+			for (i = 0; i < n; i++) dst[i] = s[i] * (1.0f / 128.0f);
+			break;
+		}
+		case STORE_INT16: {
+			const short *restrict s = src;
+			for (i = 0; i < n; i++) dst[i] = s[i] * (1.0f / 32768.0f);
+			break;
+		}
+		case STORE_INT24: {
+			const u8 *restrict s = src;
+			for (i = 0; i < n; i++) {
+				int v = (int)((u32)s[3*i] << 8 | (u32)s[3*i+1] << 16 | (u32)s[3*i+2] << 24) >> 8;
+				dst[i] = v * (1.0f / 8388608.0f);
+			}
+			break;
+		}
+		case STORE_INT32: {
+			const int *restrict s = src;
+			for (i = 0; i < n; i++) dst[i] = s[i] * (1.0f / 2147483648.0f);
+			break;
+		}
+		case STORE_HALF: {
+			const u16 *s = src;
+			for (i = 0; i < n; i++) dst[i] = half_to_float(s[i]);
+			break;
+		}
+	}
+}
+
+int compact_audio(audio_t *track, int store) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	if (!track || store_size(store) < 1) return -1;
+	use_audio(track);
+	if (track->packed && track->store == store) return 0;
+	if (track->frames && store == STORE_FLOAT) return 0;
+
+	// Interleaved frames are float only, so another precision makes the track planar
+	if (track->packed || track->frames) expand_audio(track);
+	track->store = store;
+	if (store != STORE_FLOAT) track->layout = LAYOUT_PLANAR;
+	if (store == STORE_FLOAT || !track->buf) return 0;
+
+	// Rounding to a coarser precision changes the samples, so none of them match the source file or
+	// the cached statistics any more. The silent map still holds, so touch_audio() is not used
+	if (store == STORE_HALF || (track->fmt == 3 && store != STORE_FLOAT) || (track->fmt == 1 && store_size(store) < track->bps)) {
+		free_source(track);
+		free(track->stats);
+		track->stats = NULL;
+		track->version++;
+	}
+
+	// Zero is all zero bytes in every precision, so silent blocks stay unallocated pages
+	int i, es = store_size(store);
+	long p, next;
+	track->packed = calloc(track->n_ch, sizeof(void*));
+	for (i = 0; i < track->n_ch; i++) {
+		u8 *dst = malloc((size_t)track->sz * es + 1);
+		for (p = 0; p < track->sz; p = next) {
+			if (silent_run(track, p, track->sz, &next)) zero_samples(dst + p * es, (next - p) * es);
+			else pack_block(dst + p * es, track->buf[i] + p, next - p, store);
+		}
+		track->packed[i] = dst;
+		free(track->buf[i]);
+	}
+	free(track->buf);
+	track->buf = NULL;
+	return 0;
+}
+
+void expand_audio(audio_t *track) {
+	use_audio(track);
+	if (track && track->frames) deinterleave_audio(track);
+	if (!track || !track->packed) return;
+
+	TRACE();
+	TRACE_SAMPLES((long)track->sz * track->n_ch);
+	int i, es = store_size(track->store);
+	long p, next;
+	track->buf = calloc(track->n_ch, sizeof(void*));
+	for (i = 0; i < track->n_ch; i++) {
+		track->buf[i] = malloc((size_t)track->sz * sizeof(float) + 1);
+		for (p = 0; p < track->sz; p = next) {
+			if (silent_run(track, p, track->sz, &next)) zero_samples(track->buf[i] + p, (next - p) * sizeof(float));
+			else unpack_block(track->buf[i] + p, (u8*)track->packed[i] + p * es, next - p, track->store);
+		}
+		free(track->packed[i]);
+	}
+	free(track->packed);
+	track->packed = NULL;
+}
+
+void free_packed(audio_t *track) {
+	if (!track || !track->packed) return;
+
+	int i;
+	for (i = 0; i < track->n_ch; i++) free(track->packed[i]);
+	free(track->packed);
+	track->packed = NULL;
+}
+
+long audio_memory(audio_t *track) {
+	if (!track) return 0;
+	int es = track->packed ? store_size(track->store) : (track->buf || track->frames ? sizeof(float) : 0);
+	return (long)track->n_ch * (track->sz - silent_frames(track)) * es + conversion_memory(track);
+}
+
+// Lossless operations on compacted tracks. Each returns 0 if it handled the track
+
+int copy_packed(audio_t *dst, audio_t *src) {
+	TRACE();
+	use_audio(src);
+	if (!dst || !src || !src->packed) return -1;
+
+	int i, es = store_size(src->store);
+	dst->packed = calloc(src->n_ch, sizeof(void*));
+	for (i = 0; i < src->n_ch; i++) {
+		dst->packed[i] = malloc((size_t)src->sz * es + 1);
+		copy_sound(src, dst->packed[i], src->packed[i], es, 1);
+	}
+	dst->buf = NULL;
+	return 0;
+}
+
+int remove_packed(audio_t *track, int offset, int size) {
+	TRACE();
+	use_audio(track);
+	if (!track || !track->packed) return -1;
+
+	int i, es = store_size(track->store), sz = track->sz - size;
+	for (i = 0; i < track->n_ch; i++) {
+		u8 *p = track->packed[i];
+		memmove(p + (size_t)offset * es, p + (size_t)(offset + size) * es, (size_t)(track->sz - offset - size) * es);
+		track->packed[i] = realloc(p, (size_t)sz * es + 1);
+	}
+	track->sz = sz;
+	return 0;
+}
+
+int reverse_packed(audio_t *track) {
+	TRACE();
+	use_audio(track);
+	if (!track || !track->packed) return -1;
+
+	int i, j, k, es = store_size(track->store), n = track->sz;
+	for (i = 0; i < track->n_ch; i++) {
+		u8 *p = track->packed[i];
+		switch (es) {
+			case 1:
+				for (j = 0; j < n/2; j++) { u8 t = p[j]; p[j] = p[n-1-j]; p[n-1-j] = t; }
+				break;
+			case 2: {
+				u16 *q = (u16*)p;
+				for (j = 0; j < n/2; j++) { u16 t = q[j]; q[j] = q[n-1-j]; q[n-1-j] = t; }
+				break;
+			}
+			case 4: {
+				u32 *q = (u32*)p;
+				for (j = 0; j < n/2; j++) { u32 t = q[j]; q[j] = q[n-1-j]; q[n-1-j] = t; }
+				break;
+			}
+			default:
+				for (j = 0; j < n/2; j++) {
+					u8 *a = p + (size_t)j * es, *b = p + (size_t)(n-1-j) * es;
+					for (k = 0; k < es; k++) { u8 t = a[k]; a[k] = b[k]; b[k] = t; }
+				}
+		}
+	}
+	return 0;
+}
+
+int insert_packed(audio_t *dst, audio_t *src, int offset) {
+	TRACE();
+	use_audio(dst);
+	use_audio(src);
+	if (!dst || !src || !dst->packed || !src->packed || dst == src || offset < 0) return -1;
+	if (dst->store != src->store || dst->n_ch != src->n_ch || dst->rate != src->rate) return -1;
+
+	int i, es = store_size(dst->store), sz = dst->sz, pad = offset > sz ? offset - sz : 0;
+	for (i = 0; i < dst->n_ch; i++) {
+		u8 *p = realloc(dst->packed[i], (size_t)(sz + pad + src->sz) * es + 1);
+		if (offset < sz) memmove(p + (size_t)(offset + src->sz) * es, p + (size_t)offset * es, (size_t)(sz - offset) * es);
+		else zero_samples(p + (size_t)sz * es, (size_t)pad * es);
+		memcpy(p + (size_t)offset * es, src->packed[i], (size_t)src->sz * es);
+		dst->packed[i] = p;
+	}
+	dst->sz = sz + pad + src->sz;
+	return 0;
+}
+
+// Reads samples [offset, offset+n) of a channel as floats without expanding the track
+void read_channel(audio_t *track, int ch, int offset, int n, float *dst) {
+	if (!track || ch < 0 || ch >= track->n_ch) return;
+	use_audio(track);
+	if (track->packed) unpack_block(dst, (u8*)track->packed[ch] + (size_t)offset * store_size(track->store), n, track->store);
+	else if (track->buf) memcpy(dst, track->buf[ch] + offset, n * sizeof(float));
+	else if (track->frames) {
+		const float *f = track->frames + (size_t)offset * track->n_ch + ch;
+		int i;
+		for (i = 0; i < n; i++) dst[i] = f[(size_t)i * track->n_ch];
+	}
+}
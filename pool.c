@@ -0,0 +1,128 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "audio.h"
+
+// Each worker owns a contiguous range of task indices. It takes tasks from the bottom of its own
+// range and, once that is empty, steals from the top of another worker's range
+typedef struct {
+	int top, bottom;
+	pthread_mutex_t lock;
+} deque_t;
+
+typedef struct {
+	int n_threads;
+	deque_t *q;
+	task_fn fn;
+	void *ctx;
+	progress_t *progress; // the caller's, so tasks report to whoever started them
+	FILE *log;            // likewise for messages
+} pool_t;
+
+typedef struct {
+	pool_t *pool;
+	int id;
+} worker_t;
+
+static __thread progress_t *progress = NULL;
+static __thread FILE *log_file = NULL;
+
+void set_progress(progress_t *p) {
+	progress = p;
+}
+
+void set_log(FILE *f) {
+	log_file = f;
+}
+
+void log_message(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(log_file ? log_file : stdout, fmt, ap);
+	va_end(ap);
+}
+
+int report_progress(long done, long total) {
+	if (!progress) return 0;
+	__atomic_store_n(&progress->total, total, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress->done, done, __ATOMIC_RELAXED);
+	return __atomic_load_n(&progress->cancel, __ATOMIC_RELAXED);
+}
+
+int advance_progress(long n) {
+	if (!progress) return 0;
+	__atomic_add_fetch(&progress->done, n, __ATOMIC_RELAXED);
+	return __atomic_load_n(&progress->cancel, __ATOMIC_RELAXED);
+}
+
+int n_cores() {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+static int pop(deque_t *q) {
+	int t = -1;
+	pthread_mutex_lock(&q->lock);
+	if (q->bottom > q->top) t = --q->bottom;
+	pthread_mutex_unlock(&q->lock);
+	return t;
+}
+
+static int steal(deque_t *q) {
+	int t = -1;
+	pthread_mutex_lock(&q->lock);
+	if (q->bottom > q->top) t = q->top++;
+	pthread_mutex_unlock(&q->lock);
+	return t;
+}
+
+static void *work(void *arg) {
+	worker_t *w = arg;
+	pool_t *p = w->pool;
+	progress = p->progress;
+	log_file = p->log;
+
+	while (1) {
+		int t = pop(&p->q[w->id]);
+
+		// Out of local work: try every other worker once, starting with the next one
+		int i;
+		for (i = 1; t < 0 && i < p->n_threads; i++) t = steal(&p->q[(w->id + i) % p->n_threads]);
+		if (t < 0) break;
+
+		p->fn(p->ctx, t, w->id);
+	}
+	return NULL;
+}
+
+int run_parallel(int n_tasks, int n_threads, task_fn fn, void *ctx) {
+	TRACE();
+	TRACE_SAMPLES(n_tasks);
+	if (n_tasks < 1 || !fn) return -1;
+	if (n_threads < 1) n_threads = n_cores();
+	if (n_threads > n_tasks) n_threads = n_tasks;
+
+	pool_t p = {n_threads, calloc(n_threads, sizeof(deque_t)), fn, ctx, progress, log_file};
+	worker_t *w = calloc(n_threads, sizeof(worker_t));
+	pthread_t *th = calloc(n_threads, sizeof(pthread_t));
+
+	int i;
+	for (i = 0; i < n_threads; i++) {
+		p.q[i].top = (long)n_tasks * i / n_threads;
+		p.q[i].bottom = (long)n_tasks * (i+1) / n_threads;
+		pthread_mutex_init(&p.q[i].lock, NULL);
+		w[i].pool = &p;
+		w[i].id = i;
+	}
+
+	// The calling thread works as worker 0
+	for (i = 1; i < n_threads; i++) pthread_create(&th[i], NULL, work, &w[i]);
+	work(&w[0]);
+	for (i = 1; i < n_threads; i++) pthread_join(th[i], NULL);
+
+	for (i = 0; i < n_threads; i++) pthread_mutex_destroy(&p.q[i].lock);
+	free(p.q);
+	free(w);
+	free(th);
+	return 0;
+}
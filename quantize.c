@@ -0,0 +1,218 @@
+#include "audio.h"
+
+#define LANES 8
+#define BLOCK 1024 // samples quantized per pass through the integer scratch buffer
+
+typedef unsigned char u8;
+typedef unsigned int u32;
+
+int init_quantizer(quantizer_t *q, audio_t *track) {
+	if (!q || !track || track->n_ch < 1) return -1;
+
+	memset(q, 0, sizeof(quantizer_t));
+	q->mode = track->dither;
+	q->n_ch = track->n_ch;
+	q->err = calloc(2 * track->n_ch, sizeof(float));
+
+	int l;
+	for (l = 0; l < LANES; l++) q->seed[l] = 0x9e3779b9u * (l + 1);
+	return 0;
+}
+
+void close_quantizer(quantizer_t *q) {
+	if (!q) return;
+	free(q->err);
+	memset(q, 0, sizeof(quantizer_t));
+}
+
+// Triangular (TPDF) dither of +/- 1 LSB: the difference of two uniform values from per-lane xorshift generators
+static void tpdf(u32 *restrict seed, float *restrict d, int n) {
+	int i, l;
+	for (i = 0; i < n; i += LANES) {
+		for (l = 0; l < LANES; l++) {
+			u32 s = seed[l], a, b;
+			s ^= s << 13; s ^= s >> 17; s ^= s << 5; a = s;
+			s ^= s << 13; s ^= s >> 17; s ^= s << 5; b = s;
+			seed[l] = s;
+			d[i+l] = ((float)(a >> 8) - (float)(b >> 8)) * (1.0f / 16777216.0f);
+		}
+	}
+}
+
+// Scale, optionally add dither, then round half away from zero and saturate
+static void round_block(const float *restrict x, const float *restrict d, int *restrict out, int n, float scale, float lo, float hi) {
+	int i;
+	for (i = 0; i < n; i++) {
+		float v = x[i] * scale + (d ? d[i] : 0.0f);
+		v = v < lo ? lo : v;
+		v = v > hi ? hi : v;
+		out[i] = (int)(v + (v >= 0.0f ? 0.5f : -0.5f));
+	}
+}
+
+// Error feedback with a second order noise transfer function (1 - z^-1)^2, moving the noise towards Nyquist
+static void shape_block(const float *x, const float *d, int *out, int n, float scale, float lo, float hi, float *e) {
+	float e1 = e[0], e2 = e[1];
+
+	int i;
+	for (i = 0; i < n; i++) {
+		float u = x[i] * scale - 2.0f * e1 + e2;
+		float v = u + d[i];
+		v = v < lo ? lo : v;
+		v = v > hi ? hi : v;
+		int r = (int)(v + (v >= 0.0f ? 0.5f : -0.5f));
+
+		// Keep clipping from feeding a huge error back into the loop
+		float err = (float)r - u;
+		err = err < -2.0f ? -2.0f : (err > 2.0f ? 2.0f : err);
+		e2 = e1;
+		e1 = err;
+		out[i] = r;
+	}
+
+	e[0] = e1;
+	e[1] = e2;
+}
+
+// Scatter one channel of quantized integers into interleaved little-endian frames
+static void scatter_block(u8 *restrict dst, const int *restrict q, int n, int bps, int stride) {
+	int i;
+	switch (bps) {
+		case 1:
+			for (i = 0; i < n; i++) dst[i * stride] = (u8)(q[i] + 128);
+			break;
+		case 2:
+			for (i = 0; i < n; i++) {
+				u8 *p = dst + i * stride;
+				p[0] = (u8)q[i];
+				p[1] = (u8)(q[i] >> 8);
+			}
+			break;
+		case 3:
+			for (i = 0; i < n; i++) {
+				u8 *p = dst + i * stride;
+				p[0] = (u8)q[i];
+				p[1] = (u8)(q[i] >> 8);
+				p[2] = (u8)(q[i] >> 16);
+			}
+			break;
+		case 4:
+			for (i = 0; i < n; i++) {
+				u8 *p = dst + i * stride;
+				p[0] = (u8)q[i];
+				p[1] = (u8)(q[i] >> 8);
+				p[2] = (u8)(q[i] >> 16);
+				p[3] = (u8)(q[i] >> 24);
+			}
+			break;
+	}
+}
+
+// A track compacted to its own WAV precision already holds the final integers, so its bytes are
+// copied out as they are. Dither would only add noise to samples that need no requantization
+static void copy_native(u8 *restrict dst, const u8 *restrict src, int n, int bps, int stride) {
+	int i, k;
+	if (bps == 1) for (i = 0; i < n; i++) dst[i * stride] = src[i] ^ 0x80;
+	else {
+		for (i = 0; i < n; i++) {
+			for (k = 0; k < bps; k++) dst[i * stride + k] = src[i * bps + k];
+		}
+	}
+}
+
+void quantize_samples(quantizer_t *q, audio_t *track, void *buf, int offset, int n) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)n * track->n_ch : 0);
+	use_audio(track);
+	if (!track || (!track->buf && !track->packed && !track->frames) || !buf || offset < 0 || n < 1 || offset + n > track->sz) return;
+
+	int c, i, j, n_ch = track->n_ch, bps = track->bps, stride = n_ch * bps;
+	u8 *out = buf;
+	float tmp[BLOCK];
+
+	if (track->packed && track->fmt == 1 && track->store == native_store(track)) {
+		for (c = 0; c < n_ch; c++) copy_native(out + c * bps, (u8*)track->packed[c] + (size_t)offset * bps, n, bps, stride);
+		return;
+	}
+
+	// Interleaved 32-bit float frames already are the file's sample order
+	if (track->frames && track->fmt == 3 && bps == 4) {
+		memcpy(out, track->frames + (size_t)offset * n_ch, (size_t)n * n_ch * sizeof(float));
+		return;
+	}
+
+	if (track->fmt == 3) {
+		for (c = 0; c < n_ch; c++) {
+			u8 *p = out + c * bps;
+			for (i = 0; i < n; i += BLOCK) {
+				int len = n - i < BLOCK ? n - i : BLOCK;
+				long next;
+				if (silent_run(track, offset + i, offset + i + len, &next) && next == offset + i + len) {
+					for (j = 0; j < len; j++) memset(p + (i + j) * stride, 0, bps);
+					continue;
+				}
+
+				float *x = tmp;
+				if (!track->buf) read_channel(track, c, offset + i, len, tmp);
+				else x = track->buf[c] + offset + i;
+
+				if (bps == 4) for (j = 0; j < len; j++) memcpy(p + (i + j) * stride, x + j, 4);
+				else {
+					for (j = 0; j < len; j++) {
+						double v = x[j];
+						memcpy(p + (i + j) * stride, &v, 8);
+					}
+				}
+			}
+		}
+		return;
+	}
+	if (track->fmt != 1 || bps < 1 || bps > 4) return;
+
+	// Full scale is 2^(bits-1). 32-bit output is scaled in float, so stay a little inside its range
+	float scale = (float)(1u << (bps * 8 - 1)), lo = -scale, hi = scale - 1.0f;
+	if (bps == 4) hi = 2147483520.0f;
+
+	int mode = q ? q->mode : DITHER_NONE;
+	int qi[BLOCK];
+	float d[BLOCK];
+
+	// Rounding alone treats every sample the same, so interleaved frames are converted as one run.
+	// Dither is drawn channel by channel, and goes through the planar order below to stay the same
+	if (track->frames && mode == DITHER_NONE && n_ch <= BLOCK) {
+		int per = BLOCK / n_ch;
+		for (i = 0; i < n; i += per) {
+			int len = (n - i < per ? n - i : per) * n_ch;
+			round_block(track->frames + (size_t)(offset + i) * n_ch, NULL, qi, len, scale, lo, hi);
+			scatter_block(out + (size_t)i * stride, qi, len, bps, bps);
+		}
+		return;
+	}
+
+	for (c = 0; c < n_ch; c++) {
+		u8 *p = out + c * bps;
+
+		for (i = 0; i < n; i += BLOCK) {
+			int len = n - i < BLOCK ? n - i : BLOCK;
+
+			// Without dither silence is encoded without reading it
+			long next;
+			if (mode == DITHER_NONE && silent_run(track, offset + i, offset + i + len, &next) && next == offset + i + len) {
+				memset(qi, 0, len * sizeof(int));
+				scatter_block(p + i * stride, qi, len, bps, stride);
+				continue;
+			}
+
+			float *x = tmp;
+			if (!track->buf) read_channel(track, c, offset + i, len, tmp);
+			else x = track->buf[c] + offset + i;
+
+			if (mode != DITHER_NONE) tpdf(q->seed, d, len);
+
+			if (mode == DITHER_SHAPED) shape_block(x, d, qi, len, scale, lo, hi, q->err + 2*c);
+			else round_block(x, mode == DITHER_TPDF ? d : NULL, qi, len, scale, lo, hi);
+
+			scatter_block(p + i * stride, qi, len, bps, stride);
+		}
+	}
+}
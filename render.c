@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "audio.h"
+
+// A producer thread runs the effect chain a block at a time into a single-producer single-consumer
+// ring of interleaved frames. The consumer thread wakes once per period on an absolute clock, like
+// a sound card interrupt, and hands one period to the sink. Everything either thread touches after
+// start up is allocated beforehand, and the two only share the ring's head and tail counters
+
+typedef struct {
+	float *buf;
+	long cap;           // frames, a power of two
+	int n_ch;
+	unsigned long head; // frames written, only stored by the producer
+	unsigned long tail; // frames read, only stored by the consumer
+	int done;           // the producer has written its last frame
+	int stop;           // the consumer has stopped
+} ring_t;
+
+typedef struct {
+	audio_t *track;
+	render_opts_t *o;
+	render_sink_t *sink;
+	ring_t ring;
+	int n_out, block, prefill;
+	long len;           // frames rendered: the track, then the convolver's tail
+	double *latency;    // seconds from each deadline until the sink had the period
+	double *headroom;   // seconds of audio waiting in the ring at each callback
+	long n_cb, max_cb, xruns, played;
+} engine_t;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void nap(double sec) {
+	struct timespec ts = {(time_t)sec, (long)((sec - (time_t)sec) * 1e9)};
+	nanosleep(&ts, NULL);
+}
+
+// Real-time waits sleep; freewheeling ones only give the other thread the core
+static void pause_for(engine_t *e, double sec) {
+	if (e->o->speed > 0.0) nap(sec);
+	else sched_yield();
+}
+
+static long ring_fill(ring_t *r) {
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+// The producer never blocks on a lock: when the ring is full it sleeps for a fraction of a period
+static void ring_push(engine_t *e, float **x, int n) {
+	ring_t *r = &e->ring;
+	double wait = 0.25 * e->o->period / e->track->rate;
+	while (r->cap - ring_fill(r) < n && !__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) pause_for(e, wait);
+
+	unsigned long h = r->head;
+	int i, c;
+	for (i = 0; i < n; i++) {
+		float *dst = r->buf + ((h + i) & (r->cap - 1)) * r->n_ch;
+		for (c = 0; c < r->n_ch; c++) dst[c] = x[c][i];
+	}
+	__atomic_store_n(&r->head, h + n, __ATOMIC_RELEASE);
+}
+
+static void *producer(void *arg) {
+	engine_t *e = arg;
+	audio_t *t = e->track;
+	render_opts_t *o = e->o;
+	int b = e->block, c, i;
+
+	// Scratch for one block of the chain: the input channels, then the convolver's outputs
+	float **in = calloc(t->n_ch, sizeof(float*)), **out = calloc(e->n_out, sizeof(float*));
+	for (c = 0; c < t->n_ch; c++) in[c] = malloc(b * sizeof(float));
+	for (c = 0; c < e->n_out; c++) out[c] = o->conv ? malloc(b * sizeof(float)) : in[c];
+
+	// Past the end of the track the chain is fed silence until the convolver's tail has rung out
+	long pos;
+	for (pos = 0; pos < e->len && !__atomic_load_n(&e->ring.stop, __ATOMIC_ACQUIRE); pos += b) {
+		long left = t->sz - pos;
+		int n = e->len - pos < b ? e->len - pos : b, m = left < 0 ? 0 : left < n ? left : n;
+		for (c = 0; c < t->n_ch; c++) {
+			memcpy(in[c], t->buf[c] + pos, m * sizeof(float));
+			memset(in[c] + m, 0, (b - m) * sizeof(float));
+			if (o->gain != 1.0f) {
+				for (i = 0; i < m; i++) in[c][i] *= o->gain;
+			}
+		}
+		if (o->filter) run_filter(o->filter, in, n);
+		if (o->conv) run_convolver(o->conv, in, out);
+		ring_push(e, out, n);
+	}
+	__atomic_store_n(&e->ring.done, 1, __ATOMIC_RELEASE);
+
+	for (c = 0; c < t->n_ch; c++) free(in[c]);
+	for (c = 0; o->conv && c < e->n_out; c++) free(out[c]);
+	free(in);
+	free(out);
+	return NULL;
+}
+
+static void *consumer(void *arg) {
+	engine_t *e = arg;
+	ring_t *r = &e->ring;
+	int p = e->o->period, n_ch = r->n_ch;
+	float *period = calloc((long)p * n_ch, sizeof(float));
+
+	// Real-time priority when the process may have it; an ordinary thread otherwise. A freewheeling
+	// consumer spins on the producer, so it must not be able to starve it
+	if (e->o->speed > 0.0) {
+		struct sched_param sp = {sched_get_priority_max(SCHED_FIFO) / 2};
+		pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+	}
+
+	// Fill the ring before the clock starts, as a device would with its first periods
+	while (ring_fill(r) < e->prefill && !__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) pause_for(e, 0.0005);
+
+	double interval = e->o->speed > 0.0 ? p / (e->track->rate * e->o->speed) : 0.0;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	double deadline = now();
+
+	while (1) {
+		if (interval > 0.0) {
+			long ns = next.tv_nsec + (long)(interval * 1e9);
+			next.tv_sec += ns / 1000000000;
+			next.tv_nsec = ns % 1000000000;
+			deadline += interval;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+		else {
+			// Freewheeling: wait for data instead of counting underruns
+			while (ring_fill(r) < p && !__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) sched_yield();
+			deadline = now();
+		}
+
+		long avail = ring_fill(r);
+		int done = __atomic_load_n(&r->done, __ATOMIC_ACQUIRE);
+		if (done && avail == 0) break;
+
+		// An underrun plays what there is and pads the period with silence
+		int n = avail < p ? avail : p;
+		if (n < p && !done) e->xruns++;
+
+		unsigned long t = r->tail;
+		int i;
+		for (i = 0; i < n; i++) memcpy(period + (long)i * n_ch, r->buf + ((t + i) & (r->cap - 1)) * n_ch, n_ch * sizeof(float));
+		memset(period + (long)n * n_ch, 0, (long)(p - n) * n_ch * sizeof(float));
+		__atomic_store_n(&r->tail, t + n, __ATOMIC_RELEASE);
+
+		// Only the frames that were played reach the sink, so a file gets no padding
+		if (n > 0) e->sink->write(e->sink, period, n);
+		e->played += n;
+		if (e->n_cb < e->max_cb) {
+			e->latency[e->n_cb] = now() - deadline;
+			e->headroom[e->n_cb] = done ? -1.0 : (double)avail / e->track->rate; // the tail has nothing left to buffer
+		}
+		e->n_cb++;
+	}
+	__atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+	free(period);
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+static double pick(double *v, long n, double q) {
+	if (n < 1) return 0.0;
+	long i = (long)(q * (n - 1) + 0.5);
+	return v[i < n ? i : n - 1];
+}
+
+int render_audio(audio_t *track, render_sink_t *sink, render_opts_t *o, render_stats_t *st) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	if (!sink || !o || o->period < 1) return -1;
+	expand_audio(track);
+	if (!is_valid(track)) return -2;
+	if (o->conv && o->conv->n_in != track->n_ch) return -3;
+	if (o->filter && o->filter->n_ch != track->n_ch) return -3;
+
+	engine_t e = {0};
+	e.track = track;
+	e.o = o;
+	e.sink = sink;
+	e.n_out = o->conv ? o->conv->n_out : track->n_ch;
+	e.block = o->conv ? o->conv->block : o->period;
+	e.len = track->sz + (o->conv && o->conv->ir_len > 1 ? o->conv->ir_len - 1 : 0);
+
+	// The ring holds at least the requested number of periods and two producer blocks
+	long want = (long)o->period * (o->periods > 1 ? o->periods : 4), cap = 1;
+	if (want < 2L * e.block) want = 2L * e.block;
+	while (cap < want) cap <<= 1;
+	e.ring.cap = cap;
+	e.ring.n_ch = e.n_out;
+	e.ring.buf = calloc(cap * e.n_out, sizeof(float));
+	e.prefill = want - e.block < e.len ? want - e.block : e.len;
+
+	// Underruns take extra callbacks; past this many only the counters keep going
+	e.max_cb = 2 * ((e.len + o->period - 1) / o->period) + 16;
+	e.latency = calloc(e.max_cb, sizeof(double));
+	e.headroom = calloc(e.max_cb, sizeof(double));
+
+	int r = sink->open ? sink->open(sink, e.n_out, track->rate, o->period) : 0;
+	if (r < 0) {
+		free(e.ring.buf);
+		free(e.latency);
+		free(e.headroom);
+		return -4;
+	}
+
+	double start = now();
+	pthread_t prod, cons;
+	pthread_create(&prod, NULL, producer, &e);
+	pthread_create(&cons, NULL, consumer, &e);
+	pthread_join(cons, NULL);
+	pthread_join(prod, NULL);
+	double wall = now() - start;
+	if (sink->close) sink->close(sink);
+
+	if (st) {
+		memset(st, 0, sizeof(render_stats_t));
+		st->periods = e.n_cb;
+		st->frames = e.played;
+		st->xruns = e.xruns;
+		st->wall = wall;
+
+		long n = e.n_cb < e.max_cb ? e.n_cb : e.max_cb, skip = 0;
+		qsort(e.latency, n, sizeof(double), cmp_double);
+		qsort(e.headroom, n, sizeof(double), cmp_double);
+		while (skip < n && e.headroom[skip] < 0.0) skip++;
+
+		// Latency matters at the top end, headroom at the bottom
+		const double lq[] = {0.5, 0.9, 0.99, 0.999, 1.0}, hq[] = {0.0, 0.01, 0.1, 0.5, 1.0};
+		int i;
+		for (i = 0; i < 5; i++) {
+			st->latency[i] = pick(e.latency, n, lq[i]);
+			st->headroom[i] = pick(e.headroom + skip, n - skip, hq[i]);
+		}
+	}
+
+	free(e.ring.buf);
+	free(e.latency);
+	free(e.headroom);
+	return 0;
+}
+
+// Sinks
+
+static void null_write(render_sink_t *s, float *buf, int n) {
+	// Touch the period like a device would read it
+	volatile float x = buf[0] + buf[(long)n * s->n_ch - 1];
+	(void)x;
+}
+
+static int null_open(render_sink_t *s, int n_ch, int rate, int period) {
+	(void)period;
+	s->n_ch = n_ch;
+	s->rate = rate;
+	return 0;
+}
+
+void null_sink(render_sink_t *s) {
+	memset(s, 0, sizeof(render_sink_t));
+	s->open = null_open;
+	s->write = null_write;
+}
+
+// Writes 32-bit float WAV. The header is completed once the size is known
+static int file_open(render_sink_t *s, int n_ch, int rate, int period) {
+	(void)period;
+	s->f = fopen(s->path, "wb");
+	if (!s->f) {
+		log_message("Error: could not create \"%s\"\n", s->path);
+		return -1;
+	}
+	s->n_ch = n_ch;
+	s->rate = rate;
+	s->frames = 0;
+
+	wav_t h = {0};
+	fwrite(&h, sizeof(wav_t), 1, s->f);
+	return 0;
+}
+
+static void file_write(render_sink_t *s, float *buf, int n) {
+	s->frames += fwrite(buf, (long)s->n_ch * sizeof(float), n, s->f);
+}
+
+static void file_close(render_sink_t *s) {
+	if (!s->f) return;
+	int frame = s->n_ch * sizeof(float);
+	wav_t h = {0};
+	memcpy(h.riff_magic, "RIFF", 4);
+	h.riff_size = s->frames * frame + 36;
+	memcpy(h.riff_fmt, "WAVE", 4);
+	memcpy(h.fmt_magic, "fmt ", 4);
+	h.fmt_size = 16;
+	h.audio_fmt = 3;
+	h.n_channels = s->n_ch;
+	h.sample_rate = s->rate;
+	h.byte_rate = s->rate * frame;
+	h.block_align = frame;
+	h.bits_per_sample = 32;
+	memcpy(h.data_magic, "data", 4);
+	h.data_size = s->frames * frame;
+
+	fseek(s->f, 0, SEEK_SET);
+	fwrite(&h, sizeof(wav_t), 1, s->f);
+	fclose(s->f);
+	s->f = NULL;
+}
+
+void file_sink(render_sink_t *s, char *path) {
+	memset(s, 0, sizeof(render_sink_t));
+	s->path = path;
+	s->open = file_open;
+	s->write = file_write;
+	s->close = file_close;
+}
@@ -0,0 +1,233 @@
+#include "audio.h"
+
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+#define MAX_NOTE (16 << 20) // bytes of a cue, LIST or smpl chunk read at most; longer ones are truncated
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+
+typedef struct {
+	u32 id;
+	long pos;    // Frame
+	long len;    // From an ltxt note, -1 if none
+	char *name;  // From a labl note
+} cue_t;
+
+static u32 le32(const u8 *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+}
+
+static u16 le16(const u8 *p) {
+	return p[0] | p[1] << 8;
+}
+
+// The contents of a chunk, at most MAX_NOTE bytes of it. *len is set to how many were read
+static u8 *read_chunk(FILE *f, wav_chunk_t *c, long *len) {
+	*len = c->size < MAX_NOTE ? c->size : MAX_NOTE;
+	u8 *b = malloc(*len + 1);
+	fseek(f, c->off, SEEK_SET);
+	*len = fread(b, 1, *len, f);
+	return b;
+}
+
+static int by_id(const void *a, const void *b) {
+	const cue_t *x = a, *y = b;
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static int by_frame(const void *a, const void *b) {
+	const long *x = a, *y = b;
+	return *x < *y ? -1 : *x > *y;
+}
+
+// Cues are sorted by id, so broadcast files with thousands of them do not take quadratic time
+static cue_t *find_cue(cue_t *cues, int n, u32 id) {
+	cue_t key = {id, 0, 0, NULL};
+	return n ? bsearch(&key, cues, n, sizeof(cue_t), by_id) : NULL;
+}
+
+static int by_pos(const void *a, const void *b) {
+	const wav_marker_t *x = a, *y = b;
+	if (x->start != y->start) return x->start < y->start ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+static void add_marker(wav_index_t *idx, int *cap, const char *name, long start, long len) {
+	if (idx->n_markers == *cap) {
+		*cap = *cap ? *cap * 2 : 16;
+		idx->markers = realloc(idx->markers, *cap * sizeof(wav_marker_t));
+	}
+	wav_marker_t *m = &idx->markers[idx->n_markers++];
+	snprintf(m->name, sizeof(m->name), "%s", name);
+	m->start = start;
+	m->len = len;
+}
+
+int index_wav(FILE *f, wav_index_t *idx) {
+	if (!f || !idx) return -1;
+	memset(idx, 0, sizeof(wav_index_t));
+
+	fseek(f, 0, SEEK_END);
+	long sz = ftell(f), off = 12;
+	u8 h[40];
+	if (sz <= (long)sizeof(wav_t)) return -3;
+	rewind(f);
+	if (fread(h, 1, 12, f) != 12 || memcmp(h, "RIFF", 4) || memcmp(h + 8, "WAVE", 4)) return -4;
+
+	// Only the 8 byte header of every chunk is read, the fmt chunk and notes excepted. A size
+	// running past the end of the file is cut short there, which is what recorders that were
+	// stopped before finishing the header leave behind
+	int cap = 0, n_cap = 0, fmt = 0;
+	while (off + 8 <= sz) {
+		fseek(f, off, SEEK_SET);
+		if (fread(h, 1, 8, f) != 8) break;
+		wav_chunk_t c;
+		memcpy(c.id, h, 4);
+		c.off = off + 8;
+		c.size = le32(h + 4);
+		if (c.size > sz - c.off) c.size = sz - c.off;
+		if (idx->n_chunks == cap) {
+			cap = cap ? cap * 2 : 16;
+			idx->chunks = realloc(idx->chunks, cap * sizeof(wav_chunk_t));
+		}
+		idx->chunks[idx->n_chunks++] = c;
+		off = c.off + c.size + (c.size & 1);
+
+		if (!memcmp(c.id, "fmt ", 4) && c.size >= 16) {
+			memset(h, 0, sizeof(h));
+			if (fread(h, 1, c.size < 40 ? c.size : 40, f) < 16) return -4;
+			wav_t *w = &idx->header;
+			w->audio_fmt = le16(h);
+			w->n_channels = le16(h + 2);
+			w->sample_rate = le32(h + 4);
+			w->byte_rate = le32(h + 8);
+			w->block_align = le16(h + 12);
+			w->bits_per_sample = le16(h + 14);
+			w->fmt_size = c.size;
+
+			// WAVE_FORMAT_EXTENSIBLE carries the real format in the first two bytes of its sub-format GUID
+			if (w->audio_fmt == (short)WAVE_FORMAT_EXTENSIBLE && c.size >= 40) w->audio_fmt = le16(h + 24);
+			fmt = 1;
+		}
+		else if (!memcmp(c.id, "data", 4) && !idx->data_off) {
+			memcpy(idx->header.data_magic, "data", 4);
+			idx->header.data_size = c.size > 0x7fffffff ? 0x7fffffff : c.size;
+			idx->data_off = c.off;
+		}
+	}
+	if (!fmt) return -4;
+	if (!idx->data_off) return -5;
+
+	memcpy(idx->header.riff_magic, "RIFF", 4);
+	memcpy(idx->header.riff_fmt, "WAVE", 4);
+	memcpy(idx->header.fmt_magic, "fmt ", 4);
+	idx->header.riff_size = sz - 8;
+
+	// Markers: cue points, named by labl notes and given lengths by ltxt notes in a LIST adtl chunk,
+	// then the sampler chunk's loops
+	int frame = idx->header.block_align > 0 ? idx->header.block_align : 1, n_cue = 0, i;
+	long frames = idx->header.data_size / frame, len;
+	cue_t *cues = NULL;
+	for (i = 0; i < idx->n_chunks; i++) {
+		wav_chunk_t *c = &idx->chunks[i];
+		if (memcmp(c->id, "cue ", 4)) continue;
+		u8 *b = read_chunk(f, c, &len);
+		// Counts are clamped to the entries the chunk actually holds
+		long n = len >= 4 ? le32(b) : 0, k;
+		if (n > (len - 4) / 24) n = len >= 4 ? (len - 4) / 24 : 0;
+		cues = realloc(cues, (n_cue + n + 1) * sizeof(cue_t));
+		for (k = 0; k < n; k++) {
+			const u8 *p = b + 4 + k * 24;
+			cue_t e = {le32(p), le32(p + 20), -1, NULL};
+			cues[n_cue++] = e;
+		}
+		free(b);
+	}
+	if (n_cue) qsort(cues, n_cue, sizeof(cue_t), by_id);
+	for (i = 0; i < idx->n_chunks; i++) {
+		wav_chunk_t *c = &idx->chunks[i];
+		if (memcmp(c->id, "LIST", 4) || c->size < 4) continue;
+		u8 *b = read_chunk(f, c, &len);
+		long p = 4;
+		while (!memcmp(b, "adtl", 4) && p + 12 <= len) {
+			long n = le32(b + p + 4);
+			if (n > len - p - 8) n = len - p - 8;
+			cue_t *e = find_cue(cues, n_cue, le32(b + p + 8));
+			if (e && !memcmp(b + p, "labl", 4) && n > 4 && !e->name) e->name = strndup((char*)b + p + 12, n - 4);
+			if (e && !memcmp(b + p, "ltxt", 4) && n >= 8) e->len = le32(b + p + 12);
+			p += 8 + n + (n & 1);
+		}
+		free(b);
+	}
+
+	// A sampler loop with the id of a cue point is that cue's region, other loops are regions of their own
+	for (i = 0; i < idx->n_chunks; i++) {
+		wav_chunk_t *c = &idx->chunks[i];
+		if (memcmp(c->id, "smpl", 4)) continue;
+		u8 *b = read_chunk(f, c, &len);
+		long n = len >= 36 ? le32(b + 28) : 0, k;
+		if (n > (len - 36) / 24) n = len >= 36 ? (len - 36) / 24 : 0;
+		for (k = 0; k < n; k++) {
+			const u8 *p = b + 36 + k * 24;
+			long start = le32(p + 8), size = (long)le32(p + 12) - start + 1;
+			cue_t *e = find_cue(cues, n_cue, le32(p));
+			if (e) {
+				e->pos = start;
+				e->len = size;
+				continue;
+			}
+			char name[64];
+			snprintf(name, sizeof(name), "loop%ld", k + 1);
+			add_marker(idx, &n_cap, name, start, size);
+		}
+		free(b);
+	}
+
+	// Without a length a cue runs to the next one, or to the end
+	long *pos = malloc((n_cue + 1) * sizeof(long));
+	for (i = 0; i < n_cue; i++) pos[i] = cues[i].pos;
+	if (n_cue) qsort(pos, n_cue, sizeof(long), by_frame);
+	for (i = 0; i < n_cue; i++) {
+		int lo = 0, hi = n_cue;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (pos[mid] <= cues[i].pos) lo = mid + 1;
+			else hi = mid;
+		}
+		long end = lo < n_cue ? pos[lo] : frames;
+		char name[64];
+		if (cues[i].name && cues[i].name[0]) snprintf(name, sizeof(name), "%s", cues[i].name);
+		else snprintf(name, sizeof(name), "cue%u", cues[i].id);
+		add_marker(idx, &n_cap, name, cues[i].pos, cues[i].len >= 0 ? cues[i].len : end - cues[i].pos);
+	}
+	free(pos);
+
+	for (i = 0; i < n_cue; i++) free(cues[i].name);
+	free(cues);
+
+	// Markers are kept inside the data
+	for (i = 0; i < idx->n_markers; i++) {
+		wav_marker_t *m = &idx->markers[i];
+		if (m->start > frames) m->start = frames;
+		if (m->len < 0) m->len = 0;
+		if (m->len > frames - m->start) m->len = frames - m->start;
+	}
+	if (idx->n_markers) qsort(idx->markers, idx->n_markers, sizeof(wav_marker_t), by_pos);
+	return 0;
+}
+
+void free_wav_index(wav_index_t *idx) {
+	if (!idx) return;
+	free(idx->chunks);
+	free(idx->markers);
+	memset(idx, 0, sizeof(wav_index_t));
+}
+
+wav_marker_t *find_marker(wav_index_t *idx, char *name) {
+	int i;
+	for (i = 0; idx && name && i < idx->n_markers; i++) {
+		if (!strcmp(idx->markers[i].name, name)) return &idx->markers[i];
+	}
+	return NULL;
+}
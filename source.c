@@ -0,0 +1,132 @@
+#include <sys/stat.h>
+#include "audio.h"
+
+// A track loaded from a WAV file keeps a list of spans where its samples are still exactly the
+// file's. Edits cut or shift the spans, and whatever is not covered by one is dirty
+
+void set_source(audio_t *track, char *path, long data_off) {
+	if (!track || !path) return;
+	free_source(track);
+
+	struct stat st;
+	if (stat(path, &st) < 0) return;
+
+	source_t *s = calloc(1, sizeof(source_t));
+	s->path = strdup(path);
+	s->data_off = data_off;
+	s->n_ch = track->n_ch;
+	s->bps = track->bps;
+	s->fmt = track->fmt;
+	s->frames = track->sz;
+	s->size = st.st_size;
+	s->mtime = st.st_mtime;
+	s->dev = st.st_dev;
+	s->ino = st.st_ino;
+	s->span = malloc(sizeof(span_t));
+	s->span[0].start = 0;
+	s->span[0].len = track->sz;
+	s->span[0].src = 0;
+	s->n_span = 1;
+	track->source = s;
+}
+
+void free_source(audio_t *track) {
+	if (!track || !track->source) return;
+	free(track->source->path);
+	free(track->source->span);
+	free(track->source);
+	track->source = NULL;
+}
+
+void copy_source(audio_t *dst, audio_t *src) {
+	if (!dst || !src || !src->source) {
+		if (dst) dst->source = NULL;
+		return;
+	}
+	source_t *s = malloc(sizeof(source_t));
+	memcpy(s, src->source, sizeof(source_t));
+	s->path = strdup(s->path);
+	s->span = malloc((s->n_span + 1) * sizeof(span_t));
+	memcpy(s->span, src->source->span, s->n_span * sizeof(span_t));
+	dst->source = s;
+}
+
+void dirty_range(audio_t *track, long offset, long size) {
+	if (!track || !track->source || size < 1) return;
+	source_t *s = track->source;
+
+	// Cutting a hole out of the middle of a span leaves up to one more span than before
+	span_t *out = malloc((s->n_span + 1) * sizeof(span_t));
+	int i, n = 0;
+	long end = offset + size;
+	for (i = 0; i < s->n_span; i++) {
+		span_t sp = s->span[i];
+		long sp_end = sp.start + sp.len;
+		if (sp_end <= offset || sp.start >= end) {
+			out[n++] = sp;
+			continue;
+		}
+		if (sp.start < offset) out[n++] = (span_t){sp.start, offset - sp.start, sp.src};
+		if (sp_end > end) out[n++] = (span_t){end, sp_end - end, sp.src + (end - sp.start)};
+	}
+	free(s->span);
+	s->span = out;
+	s->n_span = n;
+	if (!n) free_source(track);
+}
+
+void shift_source(audio_t *track, long offset, long delta) {
+	if (!track || !delta) return;
+	forget_silent(track, offset, -1);
+	if (!track->source) return;
+
+	// A removal drops the spans over the removed range first; an insertion splits the span it lands in
+	if (delta < 0) dirty_range(track, offset, -delta);
+	if (!track->source) return;
+
+	source_t *s = track->source;
+	span_t *out = malloc((s->n_span + 1) * sizeof(span_t));
+	int i, n = 0;
+	for (i = 0; i < s->n_span; i++) {
+		span_t sp = s->span[i];
+		if (delta > 0 && sp.start < offset && sp.start + sp.len > offset) {
+			out[n++] = (span_t){sp.start, offset - sp.start, sp.src};
+			out[n++] = (span_t){offset + delta, sp.start + sp.len - offset, sp.src + (offset - sp.start)};
+			continue;
+		}
+		if (sp.start >= offset) sp.start += delta;
+		out[n++] = sp;
+	}
+	free(s->span);
+	s->span = out;
+	s->n_span = n;
+}
+
+void touch_range(audio_t *track, long offset, long size) {
+	if (!track) return;
+	track->version++;
+	if (track->stats) free(track->stats);
+	track->stats = NULL;
+	free_conversions(track);
+	forget_silent(track, offset, size);
+	dirty_range(track, offset, size);
+}
+
+int source_usable(audio_t *track) {
+	if (!track || !track->source) return 0;
+	source_t *s = track->source;
+	if (s->n_ch != track->n_ch || s->bps != track->bps || s->fmt != track->fmt) return 0;
+
+	// The file must still be the one the spans describe
+	struct stat st;
+	if (stat(s->path, &st) < 0 || st.st_size != s->size || st.st_mtime != s->mtime || st.st_ino != s->ino) return 0;
+	return 1;
+}
+
+long clean_frames(audio_t *track) {
+	if (!track || !track->source) return 0;
+	long n = 0;
+	int i;
+	for (i = 0; i < track->source->n_span; i++) n += track->source->span[i].len;
+	return n;
+}
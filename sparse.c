@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <unistd.h>
+#include "audio.h"
+
+typedef unsigned char u8;
+
+// A track keeps one byte per SILENT_BLOCK frames, set while the block is zero in every channel.
+// The flags are only ever a promise that the samples are zero, never a requirement: a block that
+// is not marked may still be silent. Changes go through touch_range()/touch_audio(), which forget
+// the blocks they cover, so kernels can trust a marked block without looking at it
+
+void zero_samples(void *p, long bytes) {
+	if (!p || bytes < 1) return;
+
+	// Whole pages inside the range are given back. The next read of one sees a shared page of
+	// zeros, and only a write allocates memory for it again
+	long page = sysconf(_SC_PAGESIZE);
+	u8 *a = p, *e = a + bytes;
+	u8 *pa = (u8*)(((unsigned long)a + page - 1) & ~(page - 1)), *pe = (u8*)((unsigned long)e & ~(page - 1));
+	if (bytes < 4 * page || pe <= pa) {
+		memset(p, 0, bytes);
+		return;
+	}
+	memset(a, 0, pa - a);
+	if (madvise(pa, pe - pa, MADV_DONTNEED) < 0) memset(pa, 0, pe - pa);
+	memset(pe, 0, e - pe);
+}
+
+void mark_silent(audio_t *track, long offset, long size) {
+	if (!track || track->sz < 1 || size < 1) return;
+	if (offset < 0) {
+		size += offset;
+		offset = 0;
+	}
+
+	// Only blocks completely inside the range; the last block of the track may be short
+	long n = ((long)track->sz + SILENT_BLOCK - 1) / SILENT_BLOCK, end = offset + size;
+	long first = (offset + SILENT_BLOCK - 1) / SILENT_BLOCK, last = end >= track->sz ? n : end / SILENT_BLOCK;
+	if (first >= last) return;
+
+	if (n > track->n_silent) {
+		track->silent = realloc(track->silent, n);
+		memset(track->silent + track->n_silent, 0, n - track->n_silent);
+		track->n_silent = n;
+	}
+	memset(track->silent + first, 1, last - first);
+}
+
+void forget_silent(audio_t *track, long offset, long size) {
+	if (!track || !track->silent) return;
+	if (offset < 0) offset = 0;
+
+	long first = offset / SILENT_BLOCK, last = size < 0 ? track->n_silent : (offset + size + SILENT_BLOCK - 1) / SILENT_BLOCK;
+	if (last > track->n_silent) last = track->n_silent;
+	if (first < last) memset(track->silent + first, 0, last - first);
+}
+
+void free_silent(audio_t *track) {
+	if (!track) return;
+	free(track->silent);
+	track->silent = NULL;
+	track->n_silent = 0;
+}
+
+void copy_silent(audio_t *dst, audio_t *src) {
+	if (!dst) return;
+	dst->silent = NULL;
+	dst->n_silent = 0;
+	if (!src || !src->silent) return;
+	dst->silent = malloc(src->n_silent);
+	memcpy(dst->silent, src->silent, src->n_silent);
+	dst->n_silent = src->n_silent;
+}
+
+int silent_run(audio_t *track, long offset, long end, long *next) {
+	long b = offset / SILENT_BLOCK, n = track ? track->n_silent : 0;
+	int quiet = b < n && track->silent[b];
+
+	for (b++; b * SILENT_BLOCK < end; b++) {
+		if (b >= n) {
+			if (!quiet) b = (end + SILENT_BLOCK - 1) / SILENT_BLOCK;
+			break;
+		}
+		if (track->silent[b] != quiet) break;
+	}
+	*next = b * SILENT_BLOCK < end ? b * SILENT_BLOCK : end;
+	return quiet;
+}
+
+long silent_frames(audio_t *track) {
+	if (!track || !track->silent) return 0;
+	long b, n = 0;
+	for (b = 0; b < track->n_silent && b * SILENT_BLOCK < track->sz; b++) {
+		if (!track->silent[b]) continue;
+		n += track->sz - b * SILENT_BLOCK < SILENT_BLOCK ? track->sz - b * SILENT_BLOCK : SILENT_BLOCK;
+	}
+	return n;
+}
+
+void copy_sound(audio_t *track, void *dst, void *src, int es, int fill) {
+	if (!track || !dst || !src) return;
+	u8 *d = dst, *s = src;
+	long p, next;
+	for (p = 0; p < track->sz; p = next) {
+		if (!silent_run(track, p, track->sz, &next)) memcpy(d + p * es, s + p * es, (next - p) * es);
+		else if (fill) zero_samples(d + p * es, (next - p) * es);
+	}
+}
+
+static int all_zero(const u8 *p, long n) {
+	long i, j;
+	for (i = 0; i < n; i += 4096) {
+		long len = n - i < 4096 ? n - i : 4096;
+		u8 acc = 0;
+		for (j = 0; j < len; j++) acc |= p[i + j];
+		if (acc) return 0;
+	}
+	return 1;
+}
+
+int find_silence(audio_t *track) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	use_audio(track);
+	if (!track || track->sz < 1 || (!track->buf && !track->packed && !track->frames)) return 0;
+
+	// Zero samples are zero bytes in every storage precision. A negative zero does not count
+	int es = track->packed ? store_size(track->store) : sizeof(float), c, found = 0;
+	long p;
+	for (p = 0; p < track->sz; p += SILENT_BLOCK) {
+		long n = track->sz - p < SILENT_BLOCK ? track->sz - p : SILENT_BLOCK, next;
+		if (silent_run(track, p, p + n, &next)) continue;
+		if (track->frames) {
+			u8 *x = (u8*)(track->frames + p * track->n_ch);
+			if (!all_zero(x, n * track->n_ch * es)) continue;
+			zero_samples(x, n * track->n_ch * es);
+			mark_silent(track, p, n);
+			found++;
+			continue;
+		}
+
+		for (c = 0; c < track->n_ch; c++) {
+			u8 *x = track->packed ? track->packed[c] : (void*)track->buf[c];
+			if (!all_zero(x + p * es, n * es)) break;
+		}
+		if (c < track->n_ch) continue;
+
+		for (c = 0; c < track->n_ch; c++) {
+			u8 *x = track->packed ? track->packed[c] : (void*)track->buf[c];
+			zero_samples(x + p * es, n * es);
+		}
+		mark_silent(track, p, n);
+		found++;
+	}
+	return found;
+}
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "audio.h"
+
+#define SNAPSHOT_MAGIC "WTSNAP01"
+
+typedef unsigned char u8;
+
+// A snapshot is this header, an index entry per track, the silent block maps, then one page
+// aligned segment of samples per track laid out like an eviction to the scratch file
+typedef struct {
+	char magic[8];
+	int n_tracks;
+	int page;        // Alignment of the segments
+} snap_header_t;
+
+typedef struct {
+	char name[256];
+	int n_ch, bps, rate, fmt, sz, dither, store, layout;
+	int spilled;     // What the segment holds, as audio_t.spilled. 0 = no samples
+	long off, len;   // Segment
+	long silent_off, n_silent;
+} snap_track_t;
+
+// One scratch file per process, shared by every track. Evicted tracks get a page aligned segment
+// at the end of the file, and the segment is punched out again once the track is faulted back in
+static int scratch_fd = -1;
+static long scratch_end = 0;
+static char scratch_dir[256] = "";
+static unsigned long use_clock = 0;
+static pthread_mutex_t scratch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Every track restored from one snapshot shares its descriptor, so a session of any size costs
+// one descriptor. The count of tracks still evicted to it is kept by descriptor number
+static int *snap_refs = NULL;
+static int n_snap_refs = 0;
+
+static void hold_snapshot(int fd, int n) {
+	pthread_mutex_lock(&scratch_lock);
+	if (fd >= n_snap_refs) {
+		snap_refs = realloc(snap_refs, (fd + 1) * sizeof(int));
+		memset(snap_refs + n_snap_refs, 0, (fd + 1 - n_snap_refs) * sizeof(int));
+		n_snap_refs = fd + 1;
+	}
+	snap_refs[fd] += n;
+	pthread_mutex_unlock(&scratch_lock);
+}
+
+static void drop_snapshot(int fd) {
+	pthread_mutex_lock(&scratch_lock);
+	if (fd < n_snap_refs && --snap_refs[fd] == 0) close(fd);
+	pthread_mutex_unlock(&scratch_lock);
+}
+
+int set_scratch_dir(char *dir) {
+	if (!dir) return -1;
+	pthread_mutex_lock(&scratch_lock);
+	int r = scratch_fd < 0 ? 0 : -2; // tracks may already live in the old file
+	if (r == 0) snprintf(scratch_dir, sizeof(scratch_dir), "%s", dir);
+	pthread_mutex_unlock(&scratch_lock);
+	return r;
+}
+
+// Reserve len bytes of the scratch file, creating it on first use. Returns the offset, or -1
+static long reserve(long len) {
+	pthread_mutex_lock(&scratch_lock);
+	if (scratch_fd < 0) {
+		char path[300];
+		char *dir = scratch_dir[0] ? scratch_dir : getenv("TMPDIR");
+		snprintf(path, sizeof(path), "%s/wavtool-XXXXXX", dir ? dir : "/tmp");
+		scratch_fd = mkstemp(path);
+		if (scratch_fd >= 0) unlink(path); // the file goes away with the process
+	}
+
+	long page = sysconf(_SC_PAGESIZE), off = -1;
+	if (scratch_fd >= 0) {
+		off = scratch_end;
+		if (ftruncate(scratch_fd, off + len) == 0) scratch_end = (off + len + page - 1) / page * page;
+		else off = -1;
+	}
+	pthread_mutex_unlock(&scratch_lock);
+	return off;
+}
+
+static long spill_size(audio_t *track) {
+	int es = track->spilled == 2 ? store_size(track->store) : sizeof(float);
+	return (long)track->n_ch * track->sz * es;
+}
+
+// Interleaved frames are written as a single array with a whole frame per element
+static int spill_arrays(audio_t *track) {
+	return track->spilled == 3 ? 1 : track->n_ch;
+}
+
+int spill_audio(audio_t *track) {
+	TRACE();
+	if (!track || track->spilled || (!track->buf && !track->packed && !track->frames) || track->sz < 1) return -1;
+	free_conversions(track); // cheaper to redo than to evict
+
+	void **chans = track->frames ? (void**)&track->frames : (track->packed ? track->packed : (void**)track->buf);
+	track->spilled = track->frames ? 3 : (track->packed ? 2 : 1);
+
+	int n_arr = spill_arrays(track);
+	long len = spill_size(track), per = len / n_arr;
+	long off = reserve(len);
+	if (off < 0) {
+		track->spilled = 0;
+		return -2;
+	}
+
+	u8 *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, scratch_fd, off);
+	if (map == MAP_FAILED) {
+		track->spilled = 0;
+		return -3;
+	}
+
+	// Silent blocks are neither written to the scratch file nor read back from it
+	int i;
+	for (i = 0; i < n_arr; i++) {
+		copy_sound(track, map + i * per, chans[i], per / track->sz, 0);
+		free(chans[i]);
+	}
+	if (!track->frames) free(chans);
+	munmap(map, len);
+
+	// Let the kernel start writing back now rather than when it runs short of memory
+	sync_file_range(scratch_fd, off, len, SYNC_FILE_RANGE_WRITE);
+
+	track->buf = NULL;
+	track->packed = NULL;
+	track->frames = NULL;
+	track->spill_off = off;
+	return 0;
+}
+
+void release_spill(audio_t *track) {
+	if (!track || !track->spilled) return;
+	if (track->spill_fd) drop_snapshot(track->spill_fd); // a snapshot is left as it is
+	else fallocate(scratch_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, track->spill_off, spill_size(track));
+	track->spill_fd = 0;
+	track->spilled = 0;
+}
+
+int fault_audio(audio_t *track) {
+	TRACE();
+	if (!track || !track->spilled) return 0;
+
+	int n_arr = spill_arrays(track);
+	long len = spill_size(track), per = len / n_arr;
+	u8 *map = mmap(NULL, len, PROT_READ, MAP_SHARED, track->spill_fd ? track->spill_fd : scratch_fd, track->spill_off);
+	if (map == MAP_FAILED) {
+		log_message("Error: could not read \"%s\" back from the %s file\n", track->name ? track->name : "", track->spill_fd ? "snapshot" : "scratch");
+		return -1;
+	}
+	madvise(map, len, MADV_SEQUENTIAL);
+
+	int i;
+	void **chans = calloc(n_arr, sizeof(void*));
+	for (i = 0; i < n_arr; i++) {
+		chans[i] = malloc(per + 1);
+		copy_sound(track, chans[i], map + i * per, per / track->sz, 1);
+	}
+	munmap(map, len);
+
+	if (track->spilled == 3) {
+		track->frames = chans[0];
+		free(chans);
+	}
+	else if (track->spilled == 2) track->packed = chans;
+	else track->buf = (float**)chans;
+	release_spill(track);
+	return 0;
+}
+
+void use_audio(audio_t *track) {
+	if (!track) return;
+	fault_audio(track);
+	track->used = __sync_add_and_fetch(&use_clock, 1);
+}
+
+int save_snapshot(char *fname, audio_t **tracks, int n) {
+	TRACE();
+	if (!fname || n < 0 || (n > 0 && !tracks)) return -1;
+
+	// Written next to the target and renamed over it, so tracks still backed by an older snapshot
+	// of the same name keep reading the file they were loaded from
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return -2;
+
+	long page = sysconf(_SC_PAGESIZE), pos = sizeof(snap_header_t) + (long)n * sizeof(snap_track_t);
+	snap_header_t h = {SNAPSHOT_MAGIC, n, page};
+	snap_track_t *idx = calloc(n + 1, sizeof(snap_track_t));
+	int i, r = 0;
+	for (i = 0; i < n; i++) {
+		audio_t *t = tracks[i];
+		snap_track_t *e = &idx[i];
+		snprintf(e->name, sizeof(e->name), "%s", t->name ? t->name : "Untitled");
+		e->n_ch = t->n_ch;
+		e->bps = t->bps;
+		e->rate = t->rate;
+		e->fmt = t->fmt;
+		e->sz = t->sz;
+		e->dither = t->dither;
+		e->store = t->store;
+		e->layout = t->layout;
+		if (t->sz > 0 && t->n_ch > 0) e->spilled = t->spilled ? t->spilled : (t->frames ? 3 : (t->packed ? 2 : (t->buf ? 1 : 0)));
+		e->silent_off = pos;
+		e->n_silent = t->silent ? t->n_silent : 0;
+		pos += e->n_silent;
+	}
+	for (i = 0; i < n; i++) {
+		if (!idx[i].spilled) continue;
+		pos = (pos + page - 1) / page * page;
+		idx[i].off = pos;
+		idx[i].len = (long)idx[i].n_ch * idx[i].sz * (idx[i].spilled == 2 ? store_size(idx[i].store) : sizeof(float));
+		pos += idx[i].len;
+	}
+
+	if (ftruncate(fd, pos) < 0 || pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    pwrite(fd, idx, n * sizeof(snap_track_t), sizeof(h)) != (long)(n * sizeof(snap_track_t))) r = -2;
+
+	// Silent blocks are not written, so they stay holes in the file
+	report_progress(0, n);
+	for (i = 0; i < n && r == 0; i++) {
+		audio_t *t = tracks[i];
+		snap_track_t *e = &idx[i];
+		if (e->n_silent && pwrite(fd, t->silent, e->n_silent, e->silent_off) != e->n_silent) r = -2;
+		if (r < 0 || !e->spilled) continue;
+
+		// Evicted tracks are copied from their file as they are, without faulting them back in
+		u8 *map = mmap(NULL, e->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, e->off), *from = NULL;
+		if (t->spilled) from = mmap(NULL, e->len, PROT_READ, MAP_SHARED, t->spill_fd ? t->spill_fd : scratch_fd, t->spill_off);
+		if (map == MAP_FAILED || from == MAP_FAILED) {
+			if (map != MAP_FAILED) munmap(map, e->len);
+			r = -2;
+			break;
+		}
+		int n_arr = e->spilled == 3 ? 1 : t->n_ch, k;
+		void **chans = t->frames ? (void**)&t->frames : (t->packed ? t->packed : (void**)t->buf);
+		long per = e->len / n_arr;
+		for (k = 0; k < n_arr; k++) copy_sound(t, map + k * per, from ? from + k * per : chans[k], per / t->sz, 0);
+		munmap(map, e->len);
+		if (from) munmap(from, e->len);
+		if (advance_progress(1)) r = -3;
+	}
+	free(idx);
+
+	if (close(fd) < 0 && r == 0) r = -2;
+	if (r == 0 && rename(tmp, fname) < 0) r = -2;
+	if (r < 0) unlink(tmp);
+	return r;
+}
+
+int load_snapshot(char *fname, audio_t **tracks) {
+	TRACE();
+	if (!fname || !tracks) return -1;
+	*tracks = NULL;
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) return -1;
+
+	struct stat st;
+	snap_header_t h;
+	long page = sysconf(_SC_PAGESIZE);
+	if (fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, SNAPSHOT_MAGIC, 8) ||
+	    h.n_tracks < 0 || h.page % page || sizeof(h) + (long)h.n_tracks * sizeof(snap_track_t) > st.st_size) {
+		close(fd);
+		return -2;
+	}
+
+	int n = h.n_tracks, i;
+	snap_track_t *idx = malloc((n + 1) * sizeof(snap_track_t));
+	if (pread(fd, idx, n * sizeof(snap_track_t), sizeof(h)) != (long)(n * sizeof(snap_track_t))) n = -1;
+	for (i = 0; i < n; i++) {
+		snap_track_t *e = &idx[i];
+		long es = e->spilled == 2 ? store_size(e->store) : sizeof(float);
+		e->name[sizeof(e->name) - 1] = 0;
+		if (e->n_ch < 0 || e->sz < 0 || e->spilled < 0 || e->spilled > 3 || e->n_silent < 0 || e->silent_off < 0 ||
+		    e->silent_off + e->n_silent > st.st_size ||
+		    (e->spilled && (e->off % page || e->off + e->len > st.st_size || e->len != (long)e->n_ch * e->sz * es || e->len < 1))) n = -1;
+	}
+	if (n < 0) {
+		free(idx);
+		close(fd);
+		return -2;
+	}
+
+	// Nothing is read but the index: each track starts out evicted to the snapshot, and use_audio()
+	// maps its segment in the first time the samples are needed
+	audio_t *t = calloc(n + 1, sizeof(audio_t));
+	int held = 0;
+	for (i = 0; i < n; i++) held += idx[i].spilled != 0;
+	if (held) hold_snapshot(fd, held);
+	for (i = 0; i < n; i++) {
+		snap_track_t *e = &idx[i];
+		t[i].name = strdup(e->name);
+		t[i].n_ch = e->n_ch;
+		t[i].bps = e->bps;
+		t[i].rate = e->rate;
+		t[i].fmt = e->fmt;
+		t[i].sz = e->sz;
+		t[i].dither = e->dither;
+		t[i].store = e->store;
+		t[i].layout = e->layout;
+		if (e->n_silent) {
+			t[i].silent = malloc(e->n_silent);
+			t[i].n_silent = e->n_silent;
+			if (pread(fd, t[i].silent, e->n_silent, e->silent_off) != e->n_silent) memset(t[i].silent, 0, e->n_silent);
+		}
+		if (e->spilled) {
+			t[i].spill_fd = fd;
+			t[i].spill_off = e->off;
+			t[i].spilled = e->spilled;
+		}
+	}
+	free(idx);
+	if (!held) close(fd);
+	*tracks = t;
+	return n;
+}
@@ -0,0 +1,241 @@
+#include <math.h>
+#include "audio.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define LANES 8
+
+// Per-channel accumulators for one chunk, kept in LANES partial sums so the loop vectorises
+static void scan_chunk(const float *restrict x, int n, float *peak, double *sum, double *sumsq, int *clips) {
+	float p[LANES] = {0}, s[LANES] = {0}, q[LANES] = {0};
+	int c[LANES] = {0};
+
+	int i, l;
+	for (i = 0; i + LANES <= n; i += LANES) {
+		for (l = 0; l < LANES; l++) {
+			float v = x[i+l], a = fabsf(v);
+			p[l] = a > p[l] ? a : p[l];
+			s[l] += v;
+			q[l] += v * v;
+			c[l] += a >= 1.0f;
+		}
+	}
+	for (l = 0; i < n; i++, l++) {
+		float v = x[i], a = fabsf(v);
+		p[l] = a > p[l] ? a : p[l];
+		s[l] += v;
+		q[l] += v * v;
+		c[l] += a >= 1.0f;
+	}
+
+	for (l = 0; l < LANES; l++) {
+		if (p[l] > *peak) *peak = p[l];
+		*sum += s[l];
+		*sumsq += q[l];
+		*clips += c[l];
+	}
+}
+
+static double mean_square(const float *restrict x, int n) {
+	float q[LANES] = {0};
+
+	int i, l;
+	for (i = 0; i + LANES <= n; i += LANES) {
+		for (l = 0; l < LANES; l++) q[l] += x[i+l] * x[i+l];
+	}
+	for (l = 0; i < n; i++, l++) q[l] += x[i] * x[i];
+
+	double sum = 0.0;
+	for (l = 0; l < LANES; l++) sum += q[l];
+	return sum / n;
+}
+
+// ITU-R BS.1770 K-weighting: a high shelf followed by a high-pass, designed for any sample rate
+static void k_weighting(filter_t *f, int rate) {
+	biquad_t q;
+	double k = tan(M_PI * 1681.974450955533 / rate), res = 0.7071752369554196;
+	double vh = pow(10.0, 3.999843853973347 / 20.0), vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / res + k * k;
+	q.b0 = (vh + vb * k / res + k * k) / a0;
+	q.b1 = 2.0 * (k * k - vh) / a0;
+	q.b2 = (vh - vb * k / res + k * k) / a0;
+	q.a1 = 2.0 * (k * k - 1.0) / a0;
+	q.a2 = (1.0 - k / res + k * k) / a0;
+	add_section(f, &q);
+
+	k = tan(M_PI * 38.13547087602444 / rate);
+	res = 0.5003270373238773;
+	a0 = 1.0 + k / res + k * k;
+	q.b0 = 1.0;
+	q.b1 = -2.0;
+	q.b2 = 1.0;
+	q.a1 = 2.0 * (k * k - 1.0) / a0;
+	q.a2 = (1.0 - k / res + k * k) / a0;
+	add_section(f, &q);
+}
+
+static double loudness(double z) {
+	return -0.691 + 10.0 * log10(z);
+}
+
+audio_stats_t *analyze_audio(audio_t *track) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	if (!track) return NULL;
+	if (track->stats && track->stats->version == track->version) return track->stats;
+
+	use_audio(track);
+	if (!is_valid(track) && !track->packed && !track->frames) return NULL;
+
+	int i, c, n_ch = track->n_ch;
+	free(track->stats);
+
+	// One allocation, so dropping the cache is a single free()
+	audio_stats_t *st = calloc(1, sizeof(audio_stats_t) + n_ch * (sizeof(float) + 2*sizeof(double) + sizeof(int)));
+	st->rms = (double*)(st + 1);
+	st->dc = st->rms + n_ch;
+	st->peak = (float*)(st->dc + n_ch);
+	st->clips = (int*)(st->peak + n_ch);
+	st->n_ch = n_ch;
+	st->version = track->version;
+	track->stats = st;
+
+	// Loudness is measured on 100 ms sub-blocks, four of which make up one 400 ms gating block
+	int chunk = track->rate / 10;
+	if (chunk < 1) chunk = 1;
+	int n_sub = track->sz / chunk;
+	double *sub = calloc(n_sub + 1, sizeof(double));
+	double *sumsq = calloc(n_ch, sizeof(double));
+
+	// Surround channels of a 5.1 track are weighted up and the LFE is left out
+	double *weight = malloc(n_ch * sizeof(double));
+	for (c = 0; c < n_ch; c++) weight[c] = 1.0;
+	if (n_ch == 6) {
+		weight[3] = 0.0;
+		weight[4] = weight[5] = 1.41;
+	}
+
+	filter_t kw = {0};
+	create_filter(&kw, n_ch);
+	k_weighting(&kw, track->rate);
+
+	float **tmp = calloc(n_ch, sizeof(void*));
+	for (c = 0; c < n_ch; c++) tmp[c] = malloc(chunk * sizeof(float));
+
+	// Every chunk is read from memory once: the plain statistics are taken and the chunk is
+	// K-weighted while it is still in cache. Compacted tracks are converted a chunk at a time
+	// Silent chunks add nothing to the plain statistics. The filter still rings out into the first
+	// one after sound; from the second on its output is far below the gate and it is skipped
+	int p, s, quiet = 0;
+	for (p = 0, s = 0; p < track->sz; p += chunk, s++) {
+		int n = track->sz - p < chunk ? track->sz - p : chunk;
+		long next;
+		int was_quiet = quiet;
+		quiet = silent_run(track, p, p + n, &next) && next == p + n;
+
+		for (c = 0; c < n_ch; c++) {
+			if (quiet) {
+				memset(tmp[c], 0, n * sizeof(float));
+				continue;
+			}
+			read_channel(track, c, p, n, tmp[c]);
+			scan_chunk(tmp[c], n, &st->peak[c], &st->dc[c], &sumsq[c], &st->clips[c]);
+		}
+		if (n < chunk) break;
+
+		if (quiet && was_quiet) {
+			reset_filter(&kw);
+			continue;
+		}
+		run_filter(&kw, tmp, n);
+		for (c = 0; c < n_ch; c++) {
+			if (weight[c] > 0.0) sub[s] += weight[c] * mean_square(tmp[c], n);
+		}
+	}
+
+	for (c = 0; c < n_ch; c++) {
+		st->rms[c] = sqrt(sumsq[c] / track->sz);
+		st->dc[c] /= track->sz;
+		if (st->peak[c] > st->peak_all) st->peak_all = st->peak[c];
+	}
+
+	// Gating: an absolute gate at -70 LUFS, then a relative gate 10 LU below the ungated mean
+	int n_blk = n_sub - 3;
+	double *blk = calloc(n_blk > 0 ? n_blk : 1, sizeof(double));
+	for (i = 0; i < n_blk; i++) blk[i] = (sub[i] + sub[i+1] + sub[i+2] + sub[i+3]) / 4.0;
+
+	double mean = 0.0, gated = 0.0;
+	int n = 0;
+	for (i = 0; i < n_blk; i++) {
+		if (blk[i] > 0.0 && loudness(blk[i]) > -70.0) {
+			mean += blk[i];
+			n++;
+		}
+	}
+	st->lufs = -INFINITY;
+	if (n) {
+		double rel = loudness(mean / n) - 10.0;
+		for (i = 0, n = 0; i < n_blk; i++) {
+			if (blk[i] > 0.0 && loudness(blk[i]) > -70.0 && loudness(blk[i]) > rel) {
+				gated += blk[i];
+				n++;
+			}
+		}
+		if (n) st->lufs = loudness(gated / n);
+	}
+
+	for (c = 0; c < n_ch; c++) free(tmp[c]);
+	free(tmp);
+	free(blk);
+	free(sub);
+	free(sumsq);
+	free(weight);
+	close_filter(&kw);
+	return st;
+}
+
+int normalize_audio(audio_t *track, float target, int mode) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	expand_audio(track);
+	if (!is_valid(track)) return -1;
+
+	audio_stats_t *st = analyze_audio(track);
+	double level = mode == NORMALIZE_LUFS ? st->lufs : 20.0 * log10(st->peak_all);
+	if (!isfinite(level)) return -2;
+
+	float g = pow(10.0, (target - level) / 20.0);
+
+	int c;
+	long i, p, next;
+	for (p = 0; p < track->sz; p = next) {
+		if (silent_run(track, p, track->sz, &next)) continue;
+		for (c = 0; c < track->n_ch; c++) {
+			float *restrict x = track->buf[c];
+			for (i = p; i < next; i++) x[i] *= g;
+		}
+	}
+
+	// A plain gain scales every statistic, so the cache can be carried over instead of rescanned.
+	// Only the clip count is unknown once a channel goes past full scale
+	audio_stats_t *keep = track->stats;
+	track->stats = NULL;
+	touch_audio(track);
+
+	if (keep->peak_all * g < 1.0f) {
+		for (c = 0; c < keep->n_ch; c++) {
+			keep->peak[c] *= g;
+			keep->rms[c] *= g;
+			keep->dc[c] *= g;
+			keep->clips[c] = 0;
+		}
+		keep->peak_all *= g;
+		keep->lufs += 20.0 * log10(g);
+		keep->version = track->version;
+		track->stats = keep;
+	}
+	else free(keep);
+	return 0;
+}
@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "audio.h"
+
+#define IO_BUFFERS 2           // number of buffers shared between the I/O thread and the converter
+#define IO_BUFFER_SIZE (1<<20) // bytes per buffer, rounded down to whole frames
+
+typedef unsigned char u8;
+
+typedef struct {
+	FILE *f;
+	int write;               // 1 = the I/O thread drains buffers into f, 0 = it fills them from f
+	int buf_sz;
+	u8 *buf[IO_BUFFERS];
+	int len[IO_BUFFERS];
+	int head, tail, count;   // ring of full buffers
+	int done;                // no more buffers will be produced
+	int cancel;              // the converter gave up early
+	long remaining;          // bytes left to read
+	double io;               // seconds the I/O thread spent in fread/fwrite
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+} io_pipe_t;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *reader(void *arg) {
+	io_pipe_t *p = arg;
+	while (1) {
+		pthread_mutex_lock(&p->lock);
+		while (p->count == IO_BUFFERS && !p->cancel) pthread_cond_wait(&p->cond, &p->lock);
+		int slot = p->tail, stop = p->cancel;
+		pthread_mutex_unlock(&p->lock);
+		if (stop) break;
+
+		int n = p->remaining < p->buf_sz ? p->remaining : p->buf_sz;
+		double t = now();
+		n = fread(p->buf[slot], 1, n, p->f);
+		p->io += now() - t;
+		p->remaining -= n;
+
+		pthread_mutex_lock(&p->lock);
+		p->len[slot] = n;
+		p->tail = (p->tail + 1) % IO_BUFFERS;
+		p->count++;
+		if (n < 1 || p->remaining < 1) p->done = 1;
+		pthread_cond_broadcast(&p->cond);
+		stop = p->done;
+		pthread_mutex_unlock(&p->lock);
+		if (stop) break;
+	}
+	return NULL;
+}
+
+static void *writer(void *arg) {
+	io_pipe_t *p = arg;
+	while (1) {
+		pthread_mutex_lock(&p->lock);
+		while (p->count == 0 && !p->done) pthread_cond_wait(&p->cond, &p->lock);
+		if (p->count == 0) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		int slot = p->head;
+		pthread_mutex_unlock(&p->lock);
+
+		double t = now();
+		fwrite(p->buf[slot], 1, p->len[slot], p->f);
+		p->io += now() - t;
+
+		pthread_mutex_lock(&p->lock);
+		p->head = (p->head + 1) % IO_BUFFERS;
+		p->count--;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+static void open_pipe(io_pipe_t *p, FILE *f, int write, int frame, long size) {
+	memset(p, 0, sizeof(io_pipe_t));
+	p->f = f;
+	p->write = write;
+	p->remaining = size;
+	p->buf_sz = IO_BUFFER_SIZE / frame * frame;
+	if (p->buf_sz < frame) p->buf_sz = frame;
+
+	int i;
+	for (i = 0; i < IO_BUFFERS; i++) p->buf[i] = malloc(p->buf_sz);
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	pthread_create(&p->thread, NULL, write ? writer : reader, p);
+}
+
+static void close_pipe(io_pipe_t *p) {
+	pthread_mutex_lock(&p->lock);
+	if (p->write) p->done = 1;
+	else p->cancel = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+
+	int i;
+	for (i = 0; i < IO_BUFFERS; i++) free(p->buf[i]);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+}
+
+// Reader side: wait for the next full buffer. Returns its slot, or -1 at the end of the data
+static int next_full(io_pipe_t *p) {
+	pthread_mutex_lock(&p->lock);
+	while (p->count == 0 && !p->done) pthread_cond_wait(&p->cond, &p->lock);
+	int slot = p->count ? p->head : -1;
+	pthread_mutex_unlock(&p->lock);
+	return slot;
+}
+
+// Writer side: wait for the next free buffer
+static int next_empty(io_pipe_t *p) {
+	pthread_mutex_lock(&p->lock);
+	while (p->count == IO_BUFFERS) pthread_cond_wait(&p->cond, &p->lock);
+	int slot = p->tail;
+	pthread_mutex_unlock(&p->lock);
+	return slot;
+}
+
+// Hand a buffer to the other side of the pipe
+static void release(io_pipe_t *p, int len) {
+	pthread_mutex_lock(&p->lock);
+	if (p->write) {
+		p->len[p->tail] = len;
+		p->tail = (p->tail + 1) % IO_BUFFERS;
+		p->count++;
+	}
+	else {
+		p->head = (p->head + 1) % IO_BUFFERS;
+		p->count--;
+	}
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+double io_overlap(io_stats_t *st) {
+	if (!st) return 0.0;
+
+	double shorter = st->io < st->cpu ? st->io : st->cpu;
+	if (shorter <= 0.0) return 0.0;
+
+	double hidden = (st->io + st->cpu - st->wall) / shorter;
+	if (hidden < 0.0) hidden = 0.0;
+	if (hidden > 1.0) hidden = 1.0;
+	return hidden;
+}
+
+int read_wav_header(FILE *f, wav_t *header, long *data_off) {
+	if (!f || !header) return -1;
+
+	wav_index_t idx;
+	int r = index_wav(f, &idx);
+	if (r == 0) {
+		*header = idx.header;
+		if (data_off) *data_off = idx.data_off;
+	}
+	free_wav_index(&idx);
+	return r;
+}
+
+int load_wav_stream(audio_t *track, char *fname, char *name, io_stats_t *st) {
+	return load_wav_region(track, fname, name, NULL, st);
+}
+
+int load_wav_region(audio_t *track, char *fname, char *name, char *region, io_stats_t *st) {
+	TRACE();
+	if (!track || !fname) return -1;
+
+	double start = now();
+	if (replay_journal(fname) < 0) return -2;
+	FILE *f = fopen(fname, "rb");
+	if (!f) {
+		log_message("Error: could not open \"%s\"\n", fname);
+		return -2;
+	}
+
+	wav_index_t idx;
+	int r = index_wav(f, &idx);
+	wav_t header = idx.header;
+	long off = idx.data_off, first = 0, len = -1;
+	if (r == -3) log_message("Error: \"%s\" is too small to be a WAV file\n", fname);
+	if (r == -4) log_message("Error: \"%s\" is not a valid WAV file\n", fname);
+	if (r == -5) log_message("Error: could not find data chunk\n");
+	if (r == 0 && region) {
+		wav_marker_t *m = find_marker(&idx, region);
+		if (m) first = m->start, len = m->len;
+		if (!m) log_message("Error: \"%s\" has no region \"%s\"\n", fname, region);
+		else if (len < 1) log_message("Error: region \"%s\" of \"%s\" is empty\n", region, fname);
+		if (!m || len < 1) r = -9;
+	}
+	free_wav_index(&idx);
+	if (r < 0) {
+		fclose(f);
+		return r;
+	}
+
+	//debug_header(&header);
+
+	int n_ch = header.n_channels, bps = (header.bits_per_sample + 7) / 8;
+	if (header.audio_fmt != 1 && header.audio_fmt != 3) r = -6;
+	else if (n_ch < 1) r = -7;
+	else if (bps < 1 || (header.audio_fmt == 1 && bps > 4) || (header.audio_fmt == 3 && bps != 4 && bps != 8)) r = -8;
+	if (r < 0) {
+		fclose(f);
+		return r;
+	}
+
+	int i, frame = n_ch * bps;
+	free_audio_data(track);
+	if (name) track->name = strdup(name);
+	track->n_ch = n_ch;
+	track->bps = bps;
+	track->rate = header.sample_rate;
+	track->fmt = header.audio_fmt;
+	track->sz = header.data_size / frame;
+	long frames = track->sz;
+	if (region) track->sz = len;
+	if (track->layout == LAYOUT_INTERLEAVED) track->frames = calloc((size_t)track->sz * n_ch + 1, sizeof(float));
+	else {
+		track->buf = calloc(n_ch, sizeof(void*));
+		for (i = 0; i < n_ch; i++) track->buf[i] = calloc(track->sz, sizeof(float));
+	}
+
+	// The I/O thread reads the next buffer while this one is being decoded
+	// A region is read from where it starts in the data, nothing before or after it
+	io_pipe_t p;
+	fseek(f, off + first * frame, SEEK_SET);
+	open_pipe(&p, f, 0, frame, (long)track->sz * frame);
+
+	double cpu = 0.0;
+	int pos = 0, slot;
+	int stop = 0;
+	while (!stop && (slot = next_full(&p)) >= 0) {
+		stop = report_progress(pos, track->sz);
+		int n = p.len[slot] / frame;
+		if (n > track->sz - pos) n = track->sz - pos;
+
+		double t = now();
+		if (n > 0) decode_samples(track, p.buf[slot], pos, n);
+		cpu += now() - t;
+
+		pos += n;
+		release(&p, 0);
+	}
+
+	close_pipe(&p);
+	fclose(f);
+	if (stop) {
+		free_audio_data(track);
+		return -6;
+	}
+
+	// A truncated file keeps what was read
+	if (pos < track->sz) resize_audio(track, pos > 0 ? pos : 1);
+	set_source(track, fname, off);
+	if (track->source && region) {
+		track->source->span[0].src = first;
+		track->source->frames = frames;
+	}
+	TRACE_SAMPLES((long)track->sz * track->n_ch);
+
+	if (st) {
+		st->wall = now() - start;
+		st->io = p.io;
+		st->cpu = cpu;
+		st->bytes = (long)pos * frame;
+	}
+	return 0;
+}
+
+// Copies len bytes from in at in_off to the current position of out, inside the kernel where possible
+static int copy_bytes(int in, long in_off, int out, long len) {
+	off_t off = in_off;
+	while (len > 0) {
+		ssize_t n = copy_file_range(in, &off, out, NULL, len, 0);
+		if (n <= 0) break;
+		len -= n;
+	}
+	while (len > 0) { // copy_file_range() is not available across file systems on older kernels
+		ssize_t n = sendfile(out, in, &off, len);
+		if (n <= 0) break;
+		len -= n;
+	}
+	if (len > 0) {
+		u8 *buf = malloc(IO_BUFFER_SIZE);
+		while (len > 0) {
+			ssize_t n = pread(in, buf, len < IO_BUFFER_SIZE ? len : IO_BUFFER_SIZE, off);
+			if (n <= 0 || write(out, buf, n) != n) break;
+			off += n;
+			len -= n;
+		}
+		free(buf);
+	}
+	return len > 0 ? -1 : 0;
+}
+
+// Saves a track whose unchanged spans can be copied from its source file. Only the frames in
+// between are encoded. Saving over the source itself goes through a temporary file
+static int write_spans(audio_t *track, char *fname, wav_t *header, io_stats_t *st, double start) {
+	source_t *s = track->source;
+	int frame = track->n_ch * track->bps;
+
+	struct stat ds;
+	int same = stat(fname, &ds) == 0 && ds.st_dev == s->dev && ds.st_ino == s->ino;
+	char tmp[1024];
+
+	int in = open(s->path, O_RDONLY), out;
+	if (same) {
+		snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fname);
+		out = mkstemp(tmp);
+		if (out >= 0) fchmod(out, 0644);
+	}
+	else out = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (in < 0 || out < 0) {
+		log_message("Error: could not create \"%s\"\n", fname);
+		if (in >= 0) close(in);
+		if (out >= 0) close(out);
+		return -2;
+	}
+
+	quantizer_t q;
+	init_quantizer(&q, track);
+	u8 *buf = malloc(IO_BUFFER_SIZE / frame * frame + frame);
+	int per = IO_BUFFER_SIZE / frame > 0 ? IO_BUFFER_SIZE / frame : 1;
+
+	double io = 0.0, cpu = 0.0, t;
+	int r = write(out, header, sizeof(wav_t)) == sizeof(wav_t) ? 0 : -3;
+	long pos = 0;
+	int i;
+	for (i = 0; i <= s->n_span && r == 0; i++) {
+		long end = i < s->n_span ? s->span[i].start : track->sz;
+
+		// Dirty frames before the next span
+		while (pos < end && r == 0) {
+			int n = end - pos < per ? end - pos : per;
+			t = now();
+			quantize_samples(&q, track, buf, pos, n);
+			cpu += now() - t;
+
+			t = now();
+			if (write(out, buf, (long)n * frame) != (long)n * frame) r = -3;
+			io += now() - t;
+			pos += n;
+		}
+		if (i == s->n_span || r < 0) break;
+
+		t = now();
+		if (copy_bytes(in, s->data_off + s->span[i].src * frame, out, s->span[i].len * frame) < 0) r = -3;
+		io += now() - t;
+		pos += s->span[i].len;
+	}
+
+	close_quantizer(&q);
+	free(buf);
+	close(in);
+	if (close(out) < 0) r = -3;
+	if (r == 0 && same && rename(tmp, fname) < 0) r = -3;
+	if (r < 0) {
+		log_message("Error: could not write \"%s\"\n", fname);
+		if (same) unlink(tmp);
+		return r;
+	}
+
+	// The copied spans are now exact in the new file at the same positions, so it becomes the source
+	span_t *keep = malloc((s->n_span + 1) * sizeof(span_t));
+	int n_keep = s->n_span;
+	memcpy(keep, s->span, n_keep * sizeof(span_t));
+	set_source(track, fname, sizeof(wav_t));
+	if (track->source) {
+		for (i = 0; i < n_keep; i++) keep[i].src = keep[i].start;
+		free(track->source->span);
+		track->source->span = keep;
+		track->source->n_span = n_keep;
+		if (!n_keep) free_source(track);
+	}
+	else free(keep);
+
+	if (st) {
+		st->wall = now() - start;
+		st->io = io;
+		st->cpu = cpu;
+		st->bytes = (long)track->sz * frame;
+	}
+	return 0;
+}
+
+void make_wav_header(audio_t *track, wav_t *header) {
+	int frame = track->n_ch * track->bps, sz = track->sz * frame;
+	memset(header, 0, sizeof(wav_t));
+
+	memcpy(header->riff_magic, "RIFF", 4);
+	header->riff_size = sz + 36;
+	memcpy(header->riff_fmt, "WAVE", 4);
+	memcpy(header->fmt_magic, "fmt ", 4);
+	header->fmt_size = 16;
+	header->audio_fmt = track->fmt;
+	header->n_channels = track->n_ch;
+	header->sample_rate = track->rate;
+	header->byte_rate = track->rate * frame;
+	header->block_align = frame;
+	header->bits_per_sample = track->bps * 8;
+	memcpy(header->data_magic, "data", 4);
+	header->data_size = sz;
+}
+
+int write_wav_stream(audio_t *track, char *fname, io_stats_t *st) {
+	TRACE();
+	TRACE_SAMPLES(track ? (long)track->sz * track->n_ch : 0);
+	use_audio(track);
+	if (!fname || !track || (!track->buf && !track->packed && !track->frames) || !track->name || track->n_ch < 1 || track->bps < 1 || !track->fmt || track->sz < 1 ||
+	    (track->fmt == 3 && track->bps != 4 && track->bps != 8) || (track->fmt != 3 && track->bps > 4)) {
+		log_message("Error: invalid audio track\n");
+		return -1;
+	}
+
+	double start = now();
+	int frame = track->n_ch * track->bps, sz = track->sz * frame, r;
+	wav_t header;
+	make_wav_header(track, &header);
+
+	if (replay_journal(fname) < 0) return -2;
+	// Without a journal the file is not touched, and is rewritten as if it could not be patched
+	if (can_save_in_place(track, fname) && (r = save_in_place(track, fname, st)) != -2) return r;
+	if (source_usable(track)) return write_spans(track, fname, &header, st, start);
+
+	FILE *f = fopen(fname, "wb");
+	if (!f) {
+		log_message("Error: could not create \"%s\"\n", fname);
+		return -2;
+	}
+	fwrite(&header, sizeof(wav_t), 1, f);
+
+	// The I/O thread writes the previous buffer while the next one is being encoded
+	io_pipe_t p;
+	open_pipe(&p, f, 1, frame, sz);
+
+	quantizer_t q;
+	init_quantizer(&q, track);
+
+	double cpu = 0.0;
+	int pos, per = p.buf_sz / frame;
+	for (pos = 0; pos < track->sz; pos += per) {
+		int n = track->sz - pos < per ? track->sz - pos : per;
+		int slot = next_empty(&p);
+		report_progress(pos, track->sz); // a save that was started is finished
+
+		double t = now();
+		quantize_samples(&q, track, p.buf[slot], pos, n);
+		cpu += now() - t;
+
+		release(&p, n * frame);
+	}
+
+	close_pipe(&p);
+	close_quantizer(&q);
+	fclose(f);
+
+	if (st) {
+		st->wall = now() - start;
+		st->io = p.io;
+		st->cpu = cpu;
+		st->bytes = sz;
+	}
+	return 0;
+}
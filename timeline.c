@@ -0,0 +1,227 @@
+#include "audio.h"
+
+#define TIMELINE_TILE 65536 // output frames rendered per task, a multiple of SILENT_BLOCK
+#define RAMP 4096           // frames of fade gains computed at a time
+
+typedef struct {
+	audio_t *src;   // Source at the output rate and channel count
+	long off, len;  // Frames of src the part plays
+	long at;        // First output frame
+	float gain;
+	long fade_in, fade_out;
+	int order;      // Position in the clip list, so parts starting together keep it
+} part_t;
+
+typedef struct {
+	audio_t *out;
+	part_t *parts;  // Sorted by start
+	int *list;      // Per tile, the parts overlapping it in time order: list[first[t]...first[t+1]-1]
+	long *first;
+} timeline_ctx_t;
+
+static int by_start(const void *a, const void *b) {
+	const part_t *x = a, *y = b;
+	if (x->at != y->at) return x->at < y->at ? -1 : 1;
+	return x->order - y->order;
+}
+
+// Linear ramps over the fades, multiplied where they overlap
+static float part_gain(part_t *p, long k) {
+	float g = p->gain;
+	if (k < p->fade_in) g *= (float)k / p->fade_in;
+	if (p->len - 1 - k < p->fade_out) g *= (float)(p->len - 1 - k) / p->fade_out;
+	return g;
+}
+
+// Adds output frames [a, b) of a part
+static void mix_part(part_t *p, audio_t *out, long a, long b) {
+	float g[RAMP];
+	long pos, n, i;
+	int ch;
+	for (pos = a; pos < b; pos += n) {
+		long k = pos - p->at;
+		n = b - pos < RAMP ? b - pos : RAMP;
+		int ramp = k < p->fade_in || p->len - k - n < p->fade_out;
+		if (ramp) for (i = 0; i < n; i++) g[i] = part_gain(p, k + i);
+
+		for (ch = 0; ch < out->n_ch; ch++) {
+			float *restrict y = out->buf[ch] + pos, gain = p->gain;
+			const float *restrict x = p->src->buf[ch] + p->off + k;
+			if (ramp) for (i = 0; i < n; i++) y[i] += g[i] * x[i];
+			else for (i = 0; i < n; i++) y[i] += gain * x[i];
+		}
+	}
+}
+
+static void render_tile(void *ctx, int task, int thread) {
+	(void)thread;
+	timeline_ctx_t *c = ctx;
+	audio_t *out = c->out;
+	long t0 = (long)task * TIMELINE_TILE, n = out->sz - t0 < TIMELINE_TILE ? out->sz - t0 : TIMELINE_TILE, k;
+	if (advance_progress(n)) return;
+
+	int ch, empty = c->first[task] == c->first[task + 1];
+	for (ch = 0; ch < out->n_ch; ch++) {
+		if (empty) zero_samples(out->buf[ch] + t0, n * sizeof(float));
+		else memset(out->buf[ch] + t0, 0, n * sizeof(float));
+	}
+
+	for (k = c->first[task]; k < c->first[task + 1]; k++) {
+		part_t *p = &c->parts[c->list[k]];
+		long a = p->at > t0 ? p->at : t0, b = p->at + p->len < t0 + n ? p->at + p->len : t0 + n, next;
+
+		// Silence in the source adds nothing
+		while (a < b) {
+			long s = p->off + a - p->at;
+			int quiet = silent_run(p->src, s, s + b - a, &next);
+			next = a + next - s;
+			if (!quiet) mix_part(p, out, a, next);
+			a = next;
+		}
+	}
+}
+
+int render_timeline(audio_t *dst, char *name, clip_t *clips, int n, int n_ch, int rate) {
+	TRACE();
+	if (!dst || !clips || n < 1) return -1;
+
+	int i, j;
+	for (i = 0; i < n; i++) {
+		if (!clips[i].src || clips[i].src == dst) return -1;
+		expand_audio(clips[i].src);
+		if (!is_valid(clips[i].src)) return -2;
+	}
+	if (n_ch < 1) n_ch = clips[0].src->n_ch;
+	if (rate < 1) rate = clips[0].src->rate;
+
+	// Every source that does not match the output is converted once, however many clips use it
+	audio_t **orig = calloc(n, sizeof(void*)), **conv = calloc(n, sizeof(void*));
+	part_t *parts = calloc(n, sizeof(part_t));
+	int n_src = 0, stop = 0;
+	long total = 0;
+	for (i = 0; i < n && !stop; i++) {
+		audio_t *s = clips[i].src;
+		for (j = 0; j < n_src && orig[j] != s; j++);
+		if (j == n_src) {
+			orig[n_src++] = s;
+			if (s->rate != rate || s->n_ch != n_ch) {
+				conv[j] = calloc(1, sizeof(audio_t));
+				transfer_audio(conv[j], s);
+				if (s->rate != rate) resample_audio(conv[j], (float)s->rate / (float)rate);
+				conv[j]->rate = rate;
+				if (s->n_ch != n_ch) mix_audio(conv[j], n_ch);
+				stop = advance_progress(0);
+			}
+		}
+
+		// Source positions are in source frames, everything else is in output frames
+		part_t *p = &parts[i];
+		p->src = conv[j] ? conv[j] : s;
+		p->off = clips[i].src_off < 0 ? 0 : (long)((double)clips[i].src_off * rate / s->rate + 0.5);
+		p->len = clips[i].len < 1 ? p->src->sz : (long)((double)clips[i].len * rate / s->rate + 0.5);
+		if (p->off > p->src->sz) p->off = p->src->sz;
+		if (p->len > p->src->sz - p->off) p->len = p->src->sz - p->off;
+		p->at = clips[i].dst_off < 0 ? 0 : clips[i].dst_off;
+		p->gain = clips[i].gain;
+		p->fade_in = clips[i].fade_in;
+		p->fade_out = clips[i].fade_out;
+		p->order = i;
+		if (p->at + p->len > total) total = p->at + p->len;
+	}
+	if (!stop && (total < 1 || total > 0x7fffffff)) stop = -1;
+	TRACE_SAMPLES(total * n_ch);
+
+	int r = 0;
+	if (!stop) {
+		qsort(parts, n, sizeof(part_t), by_start);
+
+		// Tile lists: every part is listed in each tile it overlaps, in order of start
+		long n_tiles = (total + TIMELINE_TILE - 1) / TIMELINE_TILE, t;
+		timeline_ctx_t c = {dst, parts, NULL, calloc(n_tiles + 1, sizeof(long))};
+		for (i = 0; i < n; i++) {
+			if (parts[i].len < 1) continue;
+			for (t = parts[i].at / TIMELINE_TILE; t <= (parts[i].at + parts[i].len - 1) / TIMELINE_TILE; t++) c.first[t + 1]++;
+		}
+		for (t = 0; t < n_tiles; t++) c.first[t + 1] += c.first[t];
+		long *fill = malloc(n_tiles * sizeof(long));
+		memcpy(fill, c.first, n_tiles * sizeof(long));
+		c.list = malloc((c.first[n_tiles] + 1) * sizeof(int));
+		for (i = 0; i < n; i++) {
+			if (parts[i].len < 1) continue;
+			for (t = parts[i].at / TIMELINE_TILE; t <= (parts[i].at + parts[i].len - 1) / TIMELINE_TILE; t++) c.list[fill[t]++] = i;
+		}
+		free(fill);
+
+		close_audio(dst);
+		create_audio(dst, n_ch, clips[0].src->bps, rate, clips[0].src->fmt, 0, name);
+		for (i = 0; i < n_ch; i++) dst->buf[i] = malloc(total * sizeof(float) + 1);
+		dst->sz = total;
+
+		report_progress(0, total);
+		run_parallel(n_tiles, 0, render_tile, &c);
+		if (advance_progress(0)) {
+			close_audio(dst);
+			r = -3;
+		}
+		else {
+			for (t = 0; t < n_tiles; t++) {
+				if (c.first[t] == c.first[t + 1]) mark_silent(dst, t * TIMELINE_TILE, TIMELINE_TILE);
+			}
+		}
+		free(c.list);
+		free(c.first);
+	}
+	else r = stop < 0 ? -4 : -3;
+
+	for (j = 0; j < n_src; j++) {
+		if (!conv[j]) continue;
+		close_audio(conv[j]);
+		free(conv[j]);
+	}
+	free(orig);
+	free(conv);
+	free(parts);
+	return r;
+}
+
+int read_edl(char *fname, clip_t **clips) {
+	TRACE();
+	if (!fname || !clips) return -1;
+	*clips = NULL;
+	FILE *f = fopen(fname, "r");
+	if (!f) return -1;
+
+	char line[1024], name[256];
+	int n = 0, cap = 0, ln = 0;
+	clip_t *c = NULL;
+	while (fgets(line, sizeof(line), f)) {
+		ln++;
+		char *s = line + strspn(line, " \t");
+		if (*s == '#' || *s == '\r' || *s == '\n' || !*s) continue;
+
+		clip_t e = {0};
+		e.gain = 1.0;
+		if (sscanf(s, "%255s %ld %ld %ld %f %ld %ld", name, &e.src_off, &e.len, &e.dst_off, &e.gain, &e.fade_in, &e.fade_out) < 4 ||
+		   e.fade_in < 0 || e.fade_out < 0) {
+			log_message("Error: line %d of \"%s\" is not a clip\n", ln, fname);
+			free_edl(c, n);
+			fclose(f);
+			return -2;
+		}
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			c = realloc(c, cap * sizeof(clip_t));
+		}
+		e.name = strdup(name);
+		c[n++] = e;
+	}
+	fclose(f);
+	*clips = c;
+	return n;
+}
+
+void free_edl(clip_t *clips, int n) {
+	int i;
+	for (i = 0; clips && i < n; i++) free(clips[i].name);
+	free(clips);
+}
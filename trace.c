@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "audio.h"
+
+#undef malloc
+#undef calloc
+#undef realloc
+
+// Every thread that records spans owns a ring of the most recent ones. A thread's ring goes back
+// on a free list when the thread exits, so the short-lived pool workers reuse a few rings
+#define TRACE_EVENTS 16384
+
+typedef struct {
+	const char *name;
+	double start, dur; // seconds since trace_start()
+	long samples, bytes;
+	int tid;
+} trace_event_t;
+
+typedef struct trace_ring_s {
+	trace_event_t ev[TRACE_EVENTS];
+	long n;                    // events recorded, the last TRACE_EVENTS of which are kept
+	int in_use;
+	struct trace_ring_s *next; // every ring ever made
+} trace_ring_t;
+
+static int tracing = 0;
+static double epoch = 0.0;
+static trace_ring_t *rings = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread trace_ring_t *ring = NULL;
+static __thread long allocated = 0;
+static __thread int tid = 0;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void *trace_malloc(size_t n) {
+	allocated += n;
+	return malloc(n);
+}
+
+void *trace_calloc(size_t n, size_t sz) {
+	allocated += n * sz;
+	return calloc(n, sz);
+}
+
+void *trace_realloc(void *p, size_t n) {
+	allocated += n;
+	return realloc(p, n);
+}
+
+static void release_ring(void *r) {
+	pthread_mutex_lock(&trace_lock);
+	((trace_ring_t*)r)->in_use = 0;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void make_key() {
+	pthread_key_create(&ring_key, release_ring);
+}
+
+static trace_ring_t *get_ring() {
+	if (ring) return ring;
+	pthread_once(&key_once, make_key);
+
+	pthread_mutex_lock(&trace_lock);
+	trace_ring_t *r;
+	for (r = rings; r && r->in_use; r = r->next);
+	if (!r) {
+		r = calloc(1, sizeof(trace_ring_t));
+		r->next = rings;
+		rings = r;
+	}
+	r->in_use = 1;
+	pthread_mutex_unlock(&trace_lock);
+
+	pthread_setspecific(ring_key, r);
+	tid = gettid();
+	ring = r;
+	return r;
+}
+
+trace_span_t trace_begin(const char *name) {
+	trace_span_t s = {0};
+	if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED)) return s;
+	s.name = name;
+	s.start = now();
+	s.bytes = allocated;
+	return s;
+}
+
+void trace_end(trace_span_t *s) {
+	if (!s->name) return;
+	trace_ring_t *r = get_ring();
+	long n = r->n;
+	trace_event_t *e = &r->ev[n % TRACE_EVENTS];
+	e->name = s->name;
+	e->start = s->start - epoch;
+	e->dur = now() - s->start;
+	e->samples = s->samples;
+	e->bytes = allocated - s->bytes;
+	e->tid = tid;
+	__atomic_store_n(&r->n, n + 1, __ATOMIC_RELEASE);
+}
+
+int trace_start() {
+#ifndef AUDIO_TRACE
+	return -1;
+#endif
+	pthread_mutex_lock(&trace_lock);
+	trace_ring_t *r;
+	for (r = rings; r; r = r->next) r->n = 0;
+	epoch = now();
+	pthread_mutex_unlock(&trace_lock);
+	__atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void trace_stop() {
+	__atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+}
+
+static void json_name(FILE *f, const char *s) {
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') fputc('\\', f);
+		fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+// Chrome trace event format: complete ("X") events with microsecond timestamps. Spans of one
+// thread nest by time, which chrome://tracing and Perfetto draw as a call tree
+int trace_dump(char *fname) {
+	FILE *f = fopen(fname, "w");
+	if (!f) {
+		log_message("Error: could not create \"%s\"\n", fname);
+		return -1;
+	}
+
+	fprintf(f, "{\"traceEvents\":[");
+	pthread_mutex_lock(&trace_lock);
+	trace_ring_t *r;
+	int pid = getpid(), first = 1, count = 0;
+	for (r = rings; r; r = r->next) {
+		long n = __atomic_load_n(&r->n, __ATOMIC_ACQUIRE), i;
+		for (i = n > TRACE_EVENTS ? n - TRACE_EVENTS : 0; i < n; i++) {
+			trace_event_t *e = &r->ev[i % TRACE_EVENTS];
+			fprintf(f, "%s\n{\"name\":", first ? "" : ",");
+			json_name(f, e->name);
+			fprintf(f, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"samples\":%ld,\"bytes\":%ld}}",
+				e->start * 1e6, e->dur * 1e6, pid, e->tid, e->samples, e->bytes);
+			first = 0;
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(f);
+	return count;
+}
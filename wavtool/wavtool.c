@@ -1,6 +1,11 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <math.h>
+#include <time.h>
 #include "../audio.h"
 
-#define MAX_ARGS 5
+#define MAX_ARGS 8
 
 typedef unsigned char u8;
 typedef unsigned int u32;
@@ -36,12 +41,50 @@ cmd_t cmds[] = {
 	{"remove", 21},
 	{"reverse", 22},
 	{"insertchannel", 23}, {"ic", 23},
-	{"deletechannel", 24}, {"dc", 24}
+	{"deletechannel", 24}, {"dc", 24},
+	{"convolve", 25},
+	{"filter", 26}, {"eq", 26},
+	{"iostat", 27},
+	{"stats", 28},
+	{"normalize", 29}, {"norm", 29},
+	{"dither", 30},
+	{"store", 31},
+	{"memory", 32}, {"mem", 32},
+	{"render", 33}, {"play", 33},
+	{"jobs", 34},
+	{"wait", 35},
+	{"cancel", 36},
+	{"trace", 37},
+	{"sparse", 38},
+	{"detect", 39},
+	{"split", 40},
+	{"layout", 41},
+	{"timeline", 42}, {"edl", 42},
+	{"compress", 43},
+	{"limit", 44},
+	{"gate", 45},
+	{"align", 46},
+	{"session", 47},
+	{"fade", 48},
+	{"markers", 49}
 };
 int n_cmd_names = sizeof(cmds) / sizeof(cmd_t);
 
-audio_t **tracks = NULL;
-int n_tracks = 0;
+typedef struct {
+	audio_t **tracks;
+	int n_tracks;
+	io_stats_t last_io;  // Statistics of the last WAV load or save
+	char last_io_op[8];
+	FILE *out;           // Where command output is written
+	int batch;           // 1 = running a recipe, so nothing may prompt for input
+	int failed;          // Number of errors reported
+	int store;           // Storage given to tracks loaded by "open". STORE_*, or -1 for their native precision
+	int layout;          // Layout given to tracks loaded by "open". LAYOUT_*
+	long budget;         // Bytes of samples kept in memory between commands, 0 = no limit
+} session_t;
+
+// Every thread works on its own session, so batch workers never share a track table
+__thread session_t *ses = NULL;
 
 const char *help_str[] = {
 	"List of commands:",
@@ -59,14 +102,17 @@ const char *help_str[] = {
 	"    info <track>\n"
 	"        display the audio information of <track>\n",
 
-	"    open/load <track> <file>\n"
-	"        load the WAV from <file> into <track>\n",
+	"    open/load <track> <file> [region]\n"
+	"        load the WAV or FLAC (.flac) file <file> into <track>\n"
+	"        [region] loads only that cue or loop of a WAV file. See markers\n",
 
 	"    openraw/loadraw <track> <file>\n"
 	"        load raw sample data from <file> into <track>\n",
 
 	"    save/write <track> <file>\n"
-	"        save contents of <track> as a WAV file\n",
+	"        save contents of <track> as a WAV file, or as FLAC if <file> ends in .flac\n"
+	"        saving an edited track over the file it was opened from only rewrites\n"
+	"        the changed samples when its length and format are the same\n",
 
 	"    saveraw/writeraw <track> <file>\n"
 	"        write raw sample data from <track> to <file>\n",
@@ -75,9 +121,19 @@ const char *help_str[] = {
 	"        copy contents of <source track> to <dest track>\n"
 	"        <dest track> doesn't need to be defined beforehand\n",
 
-	"    generate/g <track> <size>\n"
+	"    generate/g <track> <size> [kind] [parameters...]\n"
 	"        add <size> number of samples to the end of <track>\n"
-	"        if <track> doesn't exist, you will be prompted for a list of properties\n",
+	"        if <track> doesn't exist, you will be prompted for a list of properties\n"
+	"        [kind] chooses what the new samples hold (levels default to 0.5):\n"
+	"            silence                        - zeros, the default\n"
+	"            sine <freq> [level]\n"
+	"            tones <freq> <freq>... [level] - several tones sharing [level]; a\n"
+	"                                             last number of at most 1 is the level\n"
+	"            sweep <from freq> <to freq> [level] - exponential sweep\n"
+	"            white [level] [seed]\n"
+	"            pink [level] [seed]\n"
+	"            impulse [level] [period]       - level defaults to 1.0, one impulse\n"
+	"                                             unless [period] is set\n",
 
 	"    mix <track> <new number of samples>\n"
 	"        update the number of channels of <track>\n",
@@ -97,8 +153,9 @@ const char *help_str[] = {
 	"    speed <track> <multiplier>\n"
 	"        multiply the speed (pitch & tempo) of <track> by the factor <multiplier>\n",
 
-	"    volume/amp <track> <multiplier>\n"
-	"        multiply the amplitude of <track> by <multiplier>\n",
+	"    volume/amp <track> <multiplier> [sample offset] [size]\n"
+	"        multiply the amplitude of <track> by <multiplier>, or only of [size]\n"
+	"        samples from [sample offset] on\n",
 
 	"    get <track> <channel index> <sample index>\n"
 	"        print the sample at position <sample index> in channel <channel index>\n",
@@ -136,9 +193,161 @@ const char *help_str[] = {
 
 	"    deletechannel/dc <track> <channel index>\n"
 	"        delete the channel <channel index> from the list of\n"
-	"        channels in <track>\n"
+	"        channels in <track>\n",
+
+	"    convolve <dest track> <src track> <impulse response track> [block size]\n"
+	"        convolve <src track> with <impulse response track> into <dest track>\n"
+	"        a mono IR is applied to every channel, an IR with one channel per source\n"
+	"        channel is applied channel by channel, and an IR with (channels squared)\n"
+	"        channels is applied as a true-stereo matrix (LL, LR, RL, RR)\n"
+	"        [block size] defaults to 1024 samples\n",
+
+	"    filter/eq <track> <type> <frequency> [q] [gain]\n"
+	"        apply a biquad filter to every channel of <track>\n"
+	"        <type> can be lowpass, highpass, bandpass, notch, peak, lowshelf or highshelf\n"
+	"        [q] defaults to 0.707, [gain] (in dB) is used by peak and shelf filters\n"
+	"    filter/eq <track> eq <gain>,<gain>,...\n"
+	"        apply a 10 band graphic EQ with octave bands from 31 Hz to 16 kHz,\n"
+	"        with the gain of each band given in dB\n",
+
+	"    iostat\n"
+	"        show the throughput of the last WAV load or save and how much of\n"
+	"        the disk and conversion time overlapped\n",
+
+	"    stats <track>\n"
+	"        show the peak, RMS, DC offset and clip count of each channel of <track>\n"
+	"        and its integrated loudness. The results are kept until <track> changes\n",
+
+	"    normalize/norm <track> <peak|lufs> <target>\n"
+	"        scale <track> so its peak level (in dBFS) or its integrated loudness\n"
+	"        (in LUFS) matches <target>\n",
+
+	"    dither <track> <off|tpdf|shaped>\n"
+	"        choose how <track> is quantized when it is saved as integer PCM\n"
+	"            \"off\"    - round to the nearest value\n"
+	"            \"tpdf\"   - add triangular dither\n"
+	"            \"shaped\" - add triangular dither and shape the noise towards high frequencies\n",
+
+	"    store <track|default> <float|int8|int16|int24|int32|half|native>\n"
+	"        keep the samples of <track> in a smaller precision between commands\n"
+	"        \"native\" uses the precision of the track's own sample format, which is lossless\n"
+	"        copies, cuts, inserts, reversing and saving work on the stored samples directly\n"
+	"        \"default\" sets the storage of tracks loaded by \"open\" from now on\n",
+
+	"    memory/mem [budget in MB|off] [scratch directory]\n"
+	"        limit the memory used by track samples between commands\n"
+	"        the least recently used tracks over the budget are moved to a scratch file\n"
+	"        and read back when a command uses them\n"
+	"        without arguments, prints how much is in memory and how much is evicted\n"
+	"        in a batch, the budget applies to each file's session separately\n",
+
+	"    render/play <track> [file|null] [period] [speed] [ir track]\n"
+	"        play <track> through the real-time engine, one [period] of frames\n"
+	"        (default 256) per callback, into a float WAV [file] or nowhere (null)\n"
+	"        [speed] is 1 for real time (default) or 0 to run as fast as possible\n"
+	"        [ir track] convolves the output with an impulse response on the way\n"
+	"        reports underruns (xruns), callback latency and buffered headroom\n",
+
+	"    jobs\n"
+	"        list the commands running in the background and how far they are\n"
+	"        end any command with & to run it in the background, on copies of the\n"
+	"        tracks it names; those tracks can't be used until the job is done\n",
+
+	"    wait [job]\n"
+	"        wait for [job], or for every background job, to finish\n",
+
+	"    cancel <job>\n"
+	"        stop <job> early and throw away what it did\n",
+
+	"    trace <start|stop|dump> [file]\n"
+	"        record how long each library call takes, how many samples it\n"
+	"        processed and how much it allocated, and write the calls to [file]\n"
+	"        as Chrome trace JSON (chrome://tracing or ui.perfetto.dev)\n"
+	"        needs a build with -DAUDIO_TRACE\n",
+
+	"    sparse <track>\n"
+	"        find the silent stretches of <track> and stop keeping them in memory\n"
+	"        silence made by generate, resizing or inserting past either end is\n"
+	"        already stored this way\n",
+
+	"    detect <track> [threshold] [hangover] [min length]\n"
+	"        list the stretches of <track> louder than [threshold] dBFS (default -50),\n"
+	"        measured every 10 ms. a stretch ends once it has been quieter for\n"
+	"        [hangover] ms (default 200); stretches shorter than [min length] ms are\n"
+	"        left out\n",
+
+	"    split <track> <prefix> [threshold] [hangover] [min length]\n"
+	"        write every stretch \"detect\" finds to its own WAV file, named <prefix>\n"
+	"        followed by a four digit number, all at once on every core\n",
+
+	"    layout <track|default> <planar|interleaved>\n"
+	"        keep the samples of <track> one channel after another (planar) or one\n"
+	"        frame after another (interleaved) between commands. interleaved suits\n"
+	"        tracks with many channels: mixing and WAV I/O read whole frames at once\n"
+	"        it keeps the samples as floats. \"default\" sets the layout of tracks\n"
+	"        loaded by \"open\" from now on\n",
+
+	"    timeline/edl <track> <edl file> [rate] [channels]\n"
+	"        build <track> from the clips listed in <edl file>, one per line:\n"
+	"            <source track> <start> <length> <position> [gain] [fade in] [fade out]\n"
+	"        <start> and <length> are in frames of the source, a <length> of 0 plays\n"
+	"        to its end; <position> and the fades are in frames of <track>\n"
+	"        every clip is mixed in one pass on every core. <track> has the format of\n"
+	"        the first clip's source unless [rate] or [channels] are given\n",
+
+	"    compress <track> <threshold> <ratio> [attack] [release] [makeup] [linked|unlinked]\n"
+	"        reduce the level of <track> above <threshold> dBFS by <ratio>, following\n"
+	"        the peaks within [attack] ms (default 10) and letting go over [release]\n"
+	"        ms (default 100), then add [makeup] dB. the level is the highest peak\n"
+	"        in the next 5 ms. channels share one gain unless \"unlinked\" is given\n",
+
+	"    limit <track> <ceiling> [release] [lookahead] [linked|unlinked]\n"
+	"        keep every peak of <track> at or below <ceiling> dBFS. the gain comes down\n"
+	"        over [lookahead] ms (default 5) before a peak and recovers over [release]\n"
+	"        ms (default 50)\n",
+
+	"    gate <track> <threshold> [range] [attack] [release] [linked|unlinked]\n"
+	"        turn <track> down by [range] dB (default -80) wherever it is below\n"
+	"        <threshold> dBFS, opening within [attack] ms (default 1) and closing\n"
+	"        over [release] ms (default 100)\n",
+
+	"    align <dst> <src> [max offset] [polarity]\n"
+	"        find where <src> lines up with <dst> by cross-correlation, searching\n"
+	"        up to [max offset] seconds either way (default any). With \"polarity\"\n"
+	"        an inverted <src> is also matched\n",
+
+	"    session <save|load> <file>\n"
+	"        save every track to the snapshot <file>, or load the tracks of one,\n"
+	"        replacing those of the same name. Loading reads no samples: each track\n"
+	"        is mapped in from <file> when it is first used. Never runs in the background\n",
+
+	"    fade <in|out> <track> <size> [shape]\n"
+	"    fade cross <dest track> <src track> <dest sample offset> <size> [shape]\n"
+	"        ramp the first or last <size> samples of <track> up from or down to\n"
+	"        silence, or insert all of <src track> at <dest sample offset> crossfaded\n"
+	"        over <size> samples on each side. [shape] is linear (default), exp or scurve\n",
+
+	"    markers <file>\n"
+	"        list the cue points and loops of the WAV file <file>, which open loads\n"
+	"        by name. Only the chunk headers and markers are read\n"
 };
 
+void print(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(ses->out, fmt, ap);
+	va_end(ap);
+}
+
+// Print an error and count it against the session
+void fail(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(ses->out, fmt, ap);
+	va_end(ap);
+	ses->failed++;
+}
+
 void printff(const char *msg) {
 	printf("%s", msg);
 	fflush(stdout);
@@ -175,23 +384,27 @@ void sprintt(char *str, float t) {
 
 int find_var(char *str, int verbose) {
 	if (!str) return -1;
-	if (!tracks || n_tracks < 1) {
+	if (!ses->tracks || ses->n_tracks < 1) {
 		if (verbose) {
-			printf("No tracks have currently been loaded\n"
+			fail("No tracks have currently been loaded\n"
 			       "Use the \"load\" command to load a WAV file into a variable\n");
 		}
 		return -2;
 	}
 	int i;
-	for (i = 0; i < n_tracks; i++) {
-		if (!strcmp(tracks[i]->name, str)) return i;
+	for (i = 0; i < ses->n_tracks; i++) {
+		if (!strcmp(ses->tracks[i]->name, str)) return i;
 	}
-	if (verbose) printf("Error: undefined variable \"%s\"\n", str);
+	if (verbose) fail("Error: undefined variable \"%s\"\n", str);
 	return -3;
 }
 
 void prompt(char *str, char *msg) {
 	memset(str, 0, 80);
+	if (ses->batch) {
+		fail("Error: cannot prompt for \"%s\" while running a batch\n", msg);
+		return;
+	}
 	printf("%s", msg);
 	fgets(str, 80, stdin);
 }
@@ -207,7 +420,7 @@ int enough_args(char **args, int n_args) {
 	int i;
 	for (i = 0; i < n_args+1; i++) {
 		if (!args[i]) {
-			printf("Error: insufficient arguments\n");
+			fail("Error: insufficient arguments\n");
 			return 0;
 		}
 	}
@@ -216,7 +429,7 @@ int enough_args(char **args, int n_args) {
 
 int find_cmd(char *name) {
 	if (!name) {
-		printf("No command given\n");
+		fail("No command given\n");
 		return -2;
 	}
 	int i, cid = -1;
@@ -227,7 +440,7 @@ int find_cmd(char *name) {
 		}
 	}
 	if (cid < 0) {
-		printf("Unrecognised command \"%s\"\n", name);
+		fail("Unrecognised command \"%s\"\n", name);
 	}
 	return cid;
 }
@@ -236,34 +449,37 @@ void help(char **args) {
 	if (args[1]) {
 		int cid = find_cmd(args[1]);
 		if (cid < 0) return;
-		puts(help_str[cid+1]);
+		print("%s\n", help_str[cid+1]);
 	}
 	else {
 		int i, n_cmds = cmds[n_cmd_names-1].index + 1;
-		for (i = 0; i < n_cmds+1; i++) puts(help_str[i]);
+		for (i = 0; i < n_cmds+1; i++) print("%s\n", help_str[i]);
 	}
 }
 
 void list(char **args) {
-	if (n_tracks < 1) {
-		printf("No tracks have currently been loaded\n");
+	if (ses->n_tracks < 1) {
+		print("No tracks have currently been loaded\n");
 	}
 	else {
 		int i;
-		for (i = 0; i < n_tracks; i++) {
-			printf("    %s\n", tracks[i]->name);
+		for (i = 0; i < ses->n_tracks; i++) {
+			print("    %s\n", ses->tracks[i]->name);
 		}
 	}
 }
 
+const char *store_names[] = {"float", "int8", "int16", "int24", "int32", "half"};
+const char *layout_names[] = {"planar", "interleaved"};
+
 void info(char **args) {
 	if (!enough_args(args, 1)) return;
 
 	int idx = find_var(args[1], 1);
 	if (idx < 0) return;
 
-	int n_ch = tracks[idx]->n_ch, bps = tracks[idx]->bps, rate = tracks[idx]->rate,
-		sz = tracks[idx]->sz, fmt = tracks[idx]->fmt;
+	int n_ch = ses->tracks[idx]->n_ch, bps = ses->tracks[idx]->bps, rate = ses->tracks[idx]->rate,
+		sz = ses->tracks[idx]->sz, fmt = ses->tracks[idx]->fmt;
 
 	char fmt_str[20];
 	if (fmt == 1) strcpy(fmt_str, "Integer PCM");
@@ -273,38 +489,58 @@ void info(char **args) {
 	char time_str[20] = {0};
 	sprintt(time_str, (float)sz / (float)rate);
 
-	printf("    Number of Channels: %d\n"
+	char src_str[300] = "none";
+	audio_t *t = ses->tracks[idx];
+	if (t->source) snprintf(src_str, sizeof(src_str), "%s (%.1f%% unchanged)", t->source->path, 100.0 * clean_frames(t) / t->sz);
+
+	char mem_str[40];
+	if (t->spilled) strcpy(mem_str, t->spill_fd ? "in the snapshot file" : "evicted to the scratch file");
+	else if (t->silent && sz > 0) sprintf(mem_str, "%.1f MB, %.1f%% silent", audio_memory(t) / 1048576.0, 100.0 * silent_frames(t) / sz);
+	else sprintf(mem_str, "%.1f MB", audio_memory(t) / 1048576.0);
+
+	print("    Number of Channels: %d\n"
 		"    Bytes per Sample: %d\n"
 		"    Sample Rate: %d\n"
 		"    Sample Format: %s\n"
-		"    Number of Samples: %d (%s)\n",
-		n_ch, bps, rate, fmt_str, sz, time_str);
+		"    Number of Samples: %d (%s)\n"
+		"    Storage: %s, %s (%s)\n"
+		"    Source: %s\n",
+		n_ch, bps, rate, fmt_str, sz, time_str,
+		store_names[ses->tracks[idx]->store], layout_names[t->layout], mem_str, src_str);
 }
 
 void add_track(audio_t *t, char *name) {
 	int idx = find_var(name, 0);
 	if (idx < 0) {
-		tracks = realloc(tracks, ++n_tracks * sizeof(audio_t));
-		idx = n_tracks-1;
-		tracks[idx] = calloc(1, sizeof(audio_t));
+		ses->tracks = realloc(ses->tracks, ++ses->n_tracks * sizeof(audio_t));
+		idx = ses->n_tracks-1;
+		ses->tracks[idx] = calloc(1, sizeof(audio_t));
 	}
 	else {
-		close_audio(tracks[idx]);
+		close_audio(ses->tracks[idx]);
 	}
-	transfer_audio(tracks[idx], t);
-	rename_audio(tracks[idx], name);
+	transfer_audio(ses->tracks[idx], t);
+	rename_audio(ses->tracks[idx], name);
 }
 
 void open_wav(char **args) {
 	if (!enough_args(args, 2)) return;
 
 	audio_t temp = {0};
-	int r = load_wav(&temp, args[2], args[1]);
+	temp.layout = ses->layout;
+	if (args[3] && is_flac(args[2])) {
+		fail("Error: FLAC files have no regions\n");
+		return;
+	}
+	int r = is_flac(args[2]) ? load_flac(&temp, args[2], args[1], &ses->last_io) : load_wav_region(&temp, args[2], args[1], args[3], &ses->last_io);
 	if (r < 0) {
-		printf("Failed to load WAV file (%d)\n", r);
+		fail("Failed to load \"%s\" (%d)\n", args[2], r);
 		return;
 	}
+	strcpy(ses->last_io_op, "load");
 
+	if (temp.layout == LAYOUT_INTERLEAVED) interleave_audio(&temp);
+	else compact_audio(&temp, ses->store < 0 ? native_store(&temp) : ses->store);
 	add_track(&temp, temp.name);
 	close_audio(&temp);
 }
@@ -316,21 +552,21 @@ int prompt_properties(audio_t *t) {
 	prompt(query, "Number of channels: ");
 	int n_ch = atoi(query);
 	if (n_ch < 1) {
-		printf("Error: must be greater than 0\n");
+		fail("Error: must be greater than 0\n");
 		return -2;
 	}
 
 	prompt(query, "Bytes per sample: ");
 	int bps = atoi(query);
 	if (bps < 1 || (bps > 4 && bps != 8)) {
-		printf("Error: if PCM, must be from 1-4. If floating-point, must be 4 or 8\n");
+		fail("Error: if PCM, must be from 1-4. If floating-point, must be 4 or 8\n");
 		return -3;
 	}
 
 	prompt(query, "Sample rate: ");
 	int rate = atoi(query);
 	if (rate < 1) {
-		printf("Error: must be greater than 0\n");
+		fail("Error: must be greater than 0\n");
 		return -4;
 	}
 
@@ -341,20 +577,20 @@ int prompt_properties(audio_t *t) {
 	int fmt = 0;
 	if (!strncmp(ptr, "int", 3) || !strncmp(ptr, "1", 1)) {
 		if (bps > 4) {
-			printf("Error: bytes per sample (%d) can only be from 1-4\n", bps);
+			fail("Error: bytes per sample (%d) can only be from 1-4\n", bps);
 			return -5;
 		}
 		fmt = 1;
 	}
 	else if (!strncmp(ptr, "float", 5) || !strncmp(ptr, "3", 1)) {
 		if (bps != 4 && bps != 8) {
-			printf("Error: bytes per sample (%d) must be 4 or 8\n", bps);
+			fail("Error: bytes per sample (%d) must be 4 or 8\n", bps);
 			return -6;
 		}
 		fmt = 3;
 	}
 	else {
-		printf("Unrecognised sample format\n");
+		fail("Unrecognised sample format\n");
 		return -7;
 	}
 
@@ -371,7 +607,7 @@ void open_raw(char **args) {
 	audio_t temp = {0};
 	FILE *f = fopen(args[2], "rb");
 	if (!f) {
-		printf("Error: could not open \"%s\"\n", args[2]);
+		fail("Error: could not open \"%s\"\n", args[2]);
 		return;
 	}
 
@@ -379,7 +615,7 @@ void open_raw(char **args) {
 	int sz = ftell(f);
 	rewind(f);
 	if (sz < 1) {
-		printf("Error: \"%s\" is an empty file\n", args[2]);
+		fail("Error: \"%s\" is an empty file\n", args[2]);
 		return;
 	}
 
@@ -405,7 +641,7 @@ void transfer(char **args) {
 	int idx2 = find_var(args[2], 1);
 	if (idx2 < 0) return;
 
-	add_track(tracks[idx2], args[1]);
+	add_track(ses->tracks[idx2], args[1]);
 }
 
 void save_wav(char **args) {
@@ -414,7 +650,9 @@ void save_wav(char **args) {
 	int idx = find_var(args[1], 1);
 	if (idx < 0) return;
 
-	write_wav(tracks[idx], args[2]);
+	int patch = !is_flac(args[2]) && can_save_in_place(ses->tracks[idx], args[2]);
+	int r = is_flac(args[2]) ? write_flac(ses->tracks[idx], args[2], &ses->last_io) : write_wav_stream(ses->tracks[idx], args[2], &ses->last_io);
+	if (r == 0) strcpy(ses->last_io_op, patch ? "patch" : "save");
 }
 
 void save_raw(char **args) {
@@ -423,14 +661,18 @@ void save_raw(char **args) {
 	int idx = find_var(args[1], 1);
 	if (idx < 0) return;
 
-	int sz = tracks[idx]->sz, n_ch = tracks[idx]->n_ch, bps = tracks[idx]->bps, fmt = tracks[idx]->fmt;
+	int sz = ses->tracks[idx]->sz, n_ch = ses->tracks[idx]->n_ch, bps = ses->tracks[idx]->bps, fmt = ses->tracks[idx]->fmt;
 	int p = 0, s = n_ch * bps * sz;
 	u8 *file = calloc(s, 1);
-	save_samples(tracks[idx], file);
+	if (save_samples(ses->tracks[idx], file) < 0) {
+		fail("Error: \"%s\" holds no samples\n", args[1]);
+		free(file);
+		return;
+	}
 
 	FILE *f = fopen(args[2], "wb");
 	if (!f) {
-		printf("Could not create \"%s\"\n", tracks[idx]->name);
+		fail("Could not create \"%s\"\n", ses->tracks[idx]->name);
 		free(file);
 		return;
 	}
@@ -439,6 +681,41 @@ void save_raw(char **args) {
 	fclose(f);
 }
 
+// <kind> [parameters...] as given to generate, see its help text
+int parse_signal(gen_t *g, char **args) {
+	static const char *kinds[] = {"silence", "sine", "tones", "sweep", "white", "pink", "impulse"};
+	int i;
+	g->kind = -1;
+	for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+		if (!strcmp(args[0], kinds[i])) g->kind = i;
+	}
+	if (g->kind < 0) {
+		fail("Unrecognised signal \"%s\"\n", args[0]);
+		return -1;
+	}
+
+	// Tones take a list of frequencies, sine and sweep one or two, and the rest start with the level
+	int n = 0;
+	if (g->kind == GEN_SINE || g->kind == GEN_TONES || g->kind == GEN_SWEEP) {
+		int max = g->kind == GEN_SINE ? 1 : (g->kind == GEN_SWEEP ? 2 : GEN_MAX_TONES);
+		while (n < max && args[n+1] && !(g->kind == GEN_TONES && n > 0 && atof(args[n+1]) <= 1.0)) {
+			g->freq[n] = atof(args[n+1]);
+			n++;
+		}
+		g->n_freq = n;
+		if (n < (g->kind == GEN_SWEEP ? 2 : 1)) {
+			fail("Error: missing frequency\n");
+			return -2;
+		}
+	}
+
+	g->amp = g->kind == GEN_IMPULSE ? 1.0 : 0.5;
+	if (args[n+1]) g->amp = atof(args[n+1]);
+	if (g->kind == GEN_WHITE || g->kind == GEN_PINK) g->seed = args[n+1] && args[n+2] ? atoi(args[n+2]) : 1;
+	if (g->kind == GEN_IMPULSE) g->period = args[n+1] && args[n+2] ? atol(args[n+2]) : 0;
+	return 0;
+}
+
 void generate(char **args) {
 	if (!enough_args(args, 2)) return;
 
@@ -449,12 +726,22 @@ void generate(char **args) {
 		if (!prompt_properties(&temp) < 0) return;
 	}
 	else {
-		transfer_audio(&temp, tracks[idx]);
+		transfer_audio(&temp, ses->tracks[idx]);
 	}
 
 	int size = atoi(args[2]);
-	resize_audio(&temp, temp.sz + size);
+	gen_t g = {0};
+	if (args[3] && parse_signal(&g, args + 3) < 0) {
+		close_audio(&temp);
+		return;
+	}
+	if (generate_audio(&temp, size, &g) < 0) {
+		fail("Error: could not generate %d samples\n", size);
+		close_audio(&temp);
+		return;
+	}
 	add_track(&temp, args[1]);
+	close_audio(&temp);
 }
 
 void mix(char **args) {
@@ -464,8 +751,8 @@ void mix(char **args) {
 	if (idx < 0) return;
 
 	int n_ch = atoi(args[2]);
-	if (n_ch < 1) printf("Invalid new number of channels\n");
-	else mix_audio(tracks[idx], n_ch);
+	if (n_ch < 1) fail("Invalid new number of channels\n");
+	else mix_audio(ses->tracks[idx], n_ch);
 }
 
 void bps_cmd(char **args) {
@@ -475,8 +762,8 @@ void bps_cmd(char **args) {
 	if (idx < 0) return;
 
 	int bps = atoi(args[2]);
-	if (bps < 1 || bps > 8) printf("Invalid new number of bytes per sample\n");
-	else tracks[idx]->bps = bps;
+	if (bps < 1 || bps > 8) fail("Invalid new number of bytes per sample\n");
+	else ses->tracks[idx]->bps = bps;
 }
 
 void rate_cmd(char **args) {
@@ -486,10 +773,11 @@ void rate_cmd(char **args) {
 	if (idx < 0) return;
 
 	int rate = atoi(args[2]);
-	if (rate < 1) printf("Invalid new sample rate\n");
+	if (rate < 1) fail("Invalid new sample rate\n");
 	else {
-		resample_audio(tracks[idx], (float)tracks[idx]->rate / (float)rate);
-		tracks[idx]->rate = rate;
+		antialias_audio(ses->tracks[idx], rate);
+		resample_audio(ses->tracks[idx], (float)ses->tracks[idx]->rate / (float)rate);
+		ses->tracks[idx]->rate = rate;
 	}
 }
 
@@ -500,10 +788,10 @@ void fmt_cmd(char **args) {
 	if (idx < 0) return;
 
 	if (!strcmp(args[2], "int") || !strcmp(args[2], "1"))
-		tracks[idx]->fmt = 1;
+		ses->tracks[idx]->fmt = 1;
 	else if (!strncmp(args[2], "float", 5) || !strcmp(args[2], "3"))
-		tracks[idx]->fmt = 3;
-	else printf("Unrecognised sample format\n");
+		ses->tracks[idx]->fmt = 3;
+	else fail("Unrecognised sample format\n");
 }
 
 void speed(char **args) {
@@ -513,8 +801,8 @@ void speed(char **args) {
 	if (idx < 0) return;
 
 	float factor = atof(args[2]);
-	if (factor <= 0.0) printf("Invalid pitch factor\n");
-	else resample_audio(tracks[idx], factor);
+	if (factor <= 0.0) fail("Invalid pitch factor\n");
+	else resample_audio(ses->tracks[idx], factor);
 }
 
 void amplify(char **args) {
@@ -523,10 +811,26 @@ void amplify(char **args) {
 	int idx = find_var(args[1], 1);
 	if (idx < 0) return;
 
-	int i, j;
+	// An optional range keeps the rest of the track clean, so saving it back can patch the file in place
+	audio_t *t = ses->tracks[idx];
+	int offset = args[3] ? atoi(args[3]) : 0;
+	int size = args[4] ? atoi(args[4]) : t->sz - offset;
+	if (args[3] && (offset < 0 || offset >= t->sz)) {
+		fail("Error: sample offset is outside the track (size: %d)\n", t->sz);
+		return;
+	}
+	if (size < 1 || offset + size > t->sz) size = t->sz - offset;
+
+	int i;
+	long j, p, next;
 	float factor = atof(args[2]);
-	for (i = 0; i < tracks[idx]->n_ch; i++) {
-		for (j = 0; j < tracks[idx]->sz; j++) tracks[idx]->buf[i][j] = smooth_sample(tracks[idx]->buf[i][j] * factor);
+	expand_audio(t);
+	for (p = offset; p < offset + size; p = next) {
+		if (silent_run(t, p, offset + size, &next)) continue;
+		for (i = 0; i < t->n_ch; i++) {
+			for (j = p; j < next; j++) t->buf[i][j] = smooth_sample(t->buf[i][j] * factor);
+		}
+		touch_range(t, p, next - p);
 	}
 }
 
@@ -538,25 +842,27 @@ void get_cmd(char **args) {
 
 	int ch = atoi(args[2]);
 	if (ch < 0) return;
-	if (ch >= tracks[idx]->n_ch) {
-		printf("Error: invalid channel index (number of channels: %d)\n", tracks[idx]->n_ch);
+	if (ch >= ses->tracks[idx]->n_ch) {
+		fail("Error: invalid channel index (number of channels: %d)\n", ses->tracks[idx]->n_ch);
 		return;
 	}
 
 	int pos = atoi(args[3]);
 	if (pos < 0) return;
-	if (pos >= tracks[idx]->sz) {
-		printf("Error: sample index is too large for track size (%d)\n", tracks[idx]->sz);
+	if (pos >= ses->tracks[idx]->sz) {
+		fail("Error: sample index is too large for track size (%d)\n", ses->tracks[idx]->sz);
 		return;
 	}
 
-	printf("%.3f", tracks[idx]->buf[ch][pos]);
-	if (tracks[idx]->fmt == 1) {
+	float s;
+	read_channel(ses->tracks[idx], ch, pos, 1, &s);
+	print("%.3f", s);
+	if (ses->tracks[idx]->fmt == 1) {
 		u32 x = 0;
-		write_sample(&x, tracks[idx]->buf[ch][pos], tracks[idx]->bps, 1);
-		printf(" (%u)", x);
+		write_sample(&x, s, ses->tracks[idx]->bps, 1);
+		print(" (%u)", x);
 	}
-	printf("\n");
+	print("\n");
 }
 
 void set_cmd(char **args) {
@@ -567,15 +873,15 @@ void set_cmd(char **args) {
 
 	int ch = atoi(args[2]);
 	if (ch < 0) return;
-	if (ch >= tracks[idx]->n_ch) {
-		printf("Error: invalid channel index (number of channels: %d)\n", tracks[idx]->n_ch);
+	if (ch >= ses->tracks[idx]->n_ch) {
+		fail("Error: invalid channel index (number of channels: %d)\n", ses->tracks[idx]->n_ch);
 		return;
 	}
 
 	int pos = atoi(args[3]);
 	if (pos < 0) return;
-	if (pos >= tracks[idx]->sz) {
-		printf("Error: sample index is too large for track size (%d)\n", tracks[idx]->sz);
+	if (pos >= ses->tracks[idx]->sz) {
+		fail("Error: sample index is too large for track size (%d)\n", ses->tracks[idx]->sz);
 		return;
 	}
 
@@ -583,9 +889,14 @@ void set_cmd(char **args) {
 	if (s < -1.0) s = -1.0;
 	if (s > 1.0) s = 1.0;
 
-	float old = tracks[idx]->buf[ch][pos];
-	tracks[idx]->buf[ch][pos] = s;
-	printf("%s[%d][%d]: %.3f -> %.3f\n", args[1], ch, pos, old, s);
+	audio_t *t = ses->tracks[idx];
+	float old;
+	read_channel(t, ch, pos, 1, &old);
+	if (t->packed) pack_block((u8*)t->packed[ch] + (size_t)pos * store_size(t->store), &s, 1, t->store);
+	else if (t->frames) t->frames[(size_t)pos * t->n_ch + ch] = s;
+	else t->buf[ch][pos] = s;
+	touch_range(ses->tracks[idx], pos, 1);
+	print("%s[%d][%d]: %.3f -> %.3f\n", args[1], ch, pos, old, s);
 }
 
 void display(char **args) {
@@ -596,8 +907,8 @@ void display(char **args) {
 
 	int pos = atoi(args[2]);
 	if (pos < 0) return;
-	if (pos >= tracks[idx]->sz) {
-		printf("Error: sample index is too large for track size (%d)\n", tracks[idx]->sz);
+	if (pos >= ses->tracks[idx]->sz) {
+		fail("Error: sample index is too large for track size (%d)\n", ses->tracks[idx]->sz);
 		return;
 	}
 
@@ -605,27 +916,28 @@ void display(char **args) {
 	if (scale <= 0.0) scale = 1.0;
 
 	int ch = args[4] ? atoi(args[4]) : -1;
-	if (ch >= tracks[idx]->n_ch) ch = -1;
+	if (ch >= ses->tracks[idx]->n_ch) ch = -1;
 
-	if (pos >= tracks[idx]->sz) return;
+	if (pos >= ses->tracks[idx]->sz) return;
 
 	audio_t temp = {0};
-	if (ch >= 0) insert_channel(&temp, tracks[idx], 0, ch);
-	else transfer_audio(&temp, tracks[idx]);
+	if (ch >= 0) insert_channel(&temp, ses->tracks[idx], 0, ch);
+	else transfer_audio(&temp, ses->tracks[idx]);
 
 	remove_audio(&temp, 0, pos);
 
 	int sz = (int)(scale * 72.0) + 1;
 	if (sz < temp.sz) remove_audio(&temp, sz, 0);
 	resample_audio(&temp, scale);
+	expand_audio(&temp);
 
 	sz = temp.sz < 72 ? temp.sz : 72;
 	int *set = calloc(sz, sizeof(int));
 
 	int i, j, c;
-	printf("    ");
-	for (i = 0; i < sz; i++) putchar('_');
-	printf("\n");
+	print("    ");
+	for (i = 0; i < sz; i++) fputc('_', ses->out);
+	print("\n");
 
 	for (c = 0; c < temp.n_ch; c++) {
 		for (i = 0; i < sz; i++) {
@@ -635,14 +947,14 @@ void display(char **args) {
 		}
 
 		for (i = 8; i >= 0; i--) {
-			printf("   |");
+			print("   |");
 			char e = i ? ' ' : '_';
 			e = i == 4 ? '-' : e;
-			for (j = 0; j < sz; j++) putchar(set[j] == i ? '#' : e);
-			printf("|\n");
+			for (j = 0; j < sz; j++) fputc(set[j] == i ? '#' : e, ses->out);
+			print("|\n");
 		}
 	}
-	printf("\n");
+	print("\n");
 	close_audio(&temp);
 }
 
@@ -653,7 +965,7 @@ void apply(char **args, int mode) {
 	if (idx < 0) {
 		audio_t temp = {0};
 		add_track(&temp, args[1]);
-		idx = n_tracks-1;
+		idx = ses->n_tracks-1;
 	}
 
 	int idx2 = find_var(args[2], 1);
@@ -663,8 +975,8 @@ void apply(char **args, int mode) {
 	int size = args[4] ? atoi(args[4]) : 0;
 	float amp = args[5] ? atof(args[5]) : 1.0;
 
-	if (mode) insert_audio(tracks[idx], tracks[idx2], offset, size, amp);
-	else add_audio(tracks[idx], tracks[idx2], offset, size, amp);
+	if (mode) insert_audio(ses->tracks[idx], ses->tracks[idx2], offset, size, amp);
+	else add_audio(ses->tracks[idx], ses->tracks[idx2], offset, size, amp);
 }
 
 void insert(char **args) {
@@ -683,7 +995,7 @@ void remove_cmd(char **args) {
 
 	int offset = atoi(args[2]);
 	int size = args[3] ? atoi(args[3]) : 0;
-	remove_audio(tracks[idx], offset, size);
+	remove_audio(ses->tracks[idx], offset, size);
 }
 
 void reverse(char **args) {
@@ -692,7 +1004,7 @@ void reverse(char **args) {
 	int idx = find_var(args[1], 1);
 	if (idx < 0) return;
 
-	reverse_audio(tracks[idx]);
+	reverse_audio(ses->tracks[idx]);
 }
 
 void insert_ch(char **args) {
@@ -703,11 +1015,11 @@ void insert_ch(char **args) {
 
 	audio_t temp = {0};
 	int idx = find_var(args[1], 0);
-	if (idx >= 0 && tracks[idx]->n_ch > 0) transfer_audio(&temp, tracks[idx]);
+	if (idx >= 0 && ses->tracks[idx]->n_ch > 0) transfer_audio(&temp, ses->tracks[idx]);
 
 	int dst_ch = atoi(args[3]);
 	int src_ch = atoi(args[4]);
-	insert_channel(&temp, tracks[idx2], dst_ch, src_ch);
+	insert_channel(&temp, ses->tracks[idx2], dst_ch, src_ch);
 
 	add_track(&temp, args[1]);
 	close_audio(&temp);
@@ -720,41 +1032,1095 @@ void delete_ch(char **args) {
 	if (idx < 0) return;
 
 	int ch = atoi(args[2]);
-	remove_channel(tracks[idx], ch);
+	remove_channel(ses->tracks[idx], ch);
+}
+
+void convolve(char **args) {
+	if (!enough_args(args, 3)) return;
+
+	int idx2 = find_var(args[2], 1);
+	if (idx2 < 0) return;
+
+	int idx3 = find_var(args[3], 1);
+	if (idx3 < 0) return;
+
+	int block = args[4] ? atoi(args[4]) : 0;
+
+	audio_t temp = {0};
+	int r = convolve_audio(&temp, ses->tracks[idx2], ses->tracks[idx3], block);
+	if (r < 0) {
+		fail("Failed to convolve \"%s\" with \"%s\" (%d)\n", args[2], args[3], r);
+		return;
+	}
+
+	add_track(&temp, args[1]);
+	close_audio(&temp);
+}
+
+int filter_type(char *str) {
+	const char *names[] = {"lowpass", "highpass", "bandpass", "notch", "peak", "lowshelf", "highshelf"};
+	const char *short_names[] = {"lpf", "hpf", "bpf", "notch", "peq", "ls", "hs"};
+
+	int i;
+	for (i = 0; i < 7; i++) {
+		if (!strcmp(str, names[i]) || !strcmp(str, short_names[i])) return i;
+	}
+	return -1;
+}
+
+void filter(char **args) {
+	if (!enough_args(args, 3)) return;
+
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+
+	audio_t *t = ses->tracks[idx];
+	filter_t f;
+	if (create_filter(&f, t->n_ch) < 0) return;
+
+	int r = 0;
+	if (!strcmp(args[2], "eq")) {
+		char *str = args[3];
+		float freq = 31.25;
+		int i;
+		for (i = 0; i < 10 && str && *str && r == 0; i++, freq *= 2.0) {
+			float gain = atof(str);
+			if (gain != 0.0 && freq < t->rate / 2) r = add_biquad(&f, FILTER_PEAK, freq, 1.414, gain, t->rate);
+			str = strchr(str, ',');
+			if (str) str++;
+		}
+	}
+	else {
+		int type = filter_type(args[2]);
+		if (type < 0) {
+			fail("Unrecognised filter type \"%s\"\n", args[2]);
+			close_filter(&f);
+			return;
+		}
+		float freq = atof(args[3]);
+		float q = args[4] ? atof(args[4]) : 0.0;
+		float gain = args[4] && args[5] ? atof(args[5]) : 0.0;
+		r = add_biquad(&f, type, freq, q, gain, t->rate);
+	}
+
+	if (r < 0) fail("Invalid filter parameters (%d)\n", r);
+	else filter_audio(t, &f);
+	close_filter(&f);
+}
+
+void iostat(char **args) {
+	if (!ses->last_io_op[0]) {
+		print("No WAV file has been loaded or saved yet\n");
+		return;
+	}
+
+	double mb = ses->last_io.bytes / 1048576.0;
+	print("    Last %s: %.1f MB in %.3fs (%.1f MB/s)\n"
+		"    Disk: %.3fs (%.1f MB/s)\n"
+		"    Conversion: %.3fs (%.1f MB/s)\n"
+		"    Overlap: %.0f%%\n",
+		ses->last_io_op, mb, ses->last_io.wall, ses->last_io.wall > 0.0 ? mb / ses->last_io.wall : 0.0,
+		ses->last_io.io, ses->last_io.io > 0.0 ? mb / ses->last_io.io : 0.0,
+		ses->last_io.cpu, ses->last_io.cpu > 0.0 ? mb / ses->last_io.cpu : 0.0,
+		io_overlap(&ses->last_io) * 100.0);
+}
+
+void stats(char **args) {
+	if (!enough_args(args, 1)) return;
+
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+
+	audio_t *t = ses->tracks[idx];
+	int cached = t->stats && t->stats->version == t->version;
+	audio_stats_t *st = analyze_audio(t);
+	if (!st) {
+		fail("Error: \"%s\" has no samples\n", args[1]);
+		return;
+	}
+
+	int c;
+	print("    Channel   Peak (dBFS)   RMS (dBFS)   DC Offset   Clipped\n");
+	for (c = 0; c < st->n_ch; c++) {
+		print("    %7d   %11.2f   %10.2f   %9.5f   %7d\n",
+			c, 20.0 * log10(st->peak[c]), 20.0 * log10(st->rms[c]), st->dc[c], st->clips[c]);
+	}
+	print("    Integrated Loudness: %.1f LUFS%s\n", st->lufs, cached ? " (cached)" : "");
+}
+
+void normalize(char **args) {
+	if (!enough_args(args, 3)) return;
+
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+
+	int mode;
+	if (!strcmp(args[2], "peak")) mode = NORMALIZE_PEAK;
+	else if (!strcmp(args[2], "lufs")) mode = NORMALIZE_LUFS;
+	else {
+		fail("Unrecognised normalization mode \"%s\"\n", args[2]);
+		return;
+	}
+
+	if (normalize_audio(ses->tracks[idx], atof(args[3]), mode) < 0) fail("Error: \"%s\" is silent\n", args[1]);
+}
+
+void dither(char **args) {
+	if (!enough_args(args, 2)) return;
+
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+
+	if (!strcmp(args[2], "off") || !strcmp(args[2], "none")) ses->tracks[idx]->dither = DITHER_NONE;
+	else if (!strcmp(args[2], "tpdf")) ses->tracks[idx]->dither = DITHER_TPDF;
+	else if (!strcmp(args[2], "shaped")) ses->tracks[idx]->dither = DITHER_SHAPED;
+	else fail("Unrecognised dither mode \"%s\"\n", args[2]);
+}
+
+int find_store(char *str) {
+	if (!strcmp(str, "native")) return -1;
+
+	int i;
+	for (i = 0; i < sizeof(store_names) / sizeof(char*); i++) {
+		if (!strcmp(str, store_names[i])) return i;
+	}
+	fail("Unrecognised storage mode \"%s\"\n", str);
+	return -2;
+}
+
+void store(char **args) {
+	if (!enough_args(args, 2)) return;
+
+	int mode = find_store(args[2]);
+	if (mode < -1) return;
+
+	if (!strcmp(args[1], "default")) {
+		ses->store = mode;
+		return;
+	}
+
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+
+	audio_t *t = ses->tracks[idx];
+	long before = audio_memory(t);
+	compact_audio(t, mode < 0 ? native_store(t) : mode);
+	print("%s: %s, %.1f MB -> %.1f MB\n", args[1], store_names[t->store], before / 1048576.0, audio_memory(t) / 1048576.0);
+}
+
+void sparse(char **args) {
+	if (!enough_args(args, 1)) return;
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+
+	audio_t *t = ses->tracks[idx];
+	long before = audio_memory(t);
+	find_silence(t);
+	print("%s: %.1f%% silent, %.1f MB -> %.1f MB\n", args[1], t->sz > 0 ? 100.0 * silent_frames(t) / t->sz : 0.0,
+		before / 1048576.0, audio_memory(t) / 1048576.0);
+}
+
+void layout(char **args) {
+	if (!enough_args(args, 2)) return;
+
+	int mode = !strcmp(args[2], "planar") ? LAYOUT_PLANAR : (!strcmp(args[2], "interleaved") ? LAYOUT_INTERLEAVED : -1);
+	if (mode < 0) {
+		fail("Unrecognised layout \"%s\"\n", args[2]);
+		return;
+	}
+
+	if (!strcmp(args[1], "default")) {
+		ses->layout = mode;
+		return;
+	}
+
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+
+	audio_t *t = ses->tracks[idx];
+	if (mode == LAYOUT_INTERLEAVED) interleave_audio(t);
+	else {
+		t->layout = LAYOUT_PLANAR;
+		deinterleave_audio(t);
+	}
+	print("%s: %s, %s, %.1f MB\n", args[1], layout_names[t->layout], store_names[t->store], audio_memory(t) / 1048576.0);
+}
+
+// Evict the least recently used tracks until the rest fit in the budget
+void enforce_budget() {
+	if (ses->budget <= 0) return;
+
+	long total = 0;
+	int i;
+	for (i = 0; i < ses->n_tracks; i++) total += audio_memory(ses->tracks[i]);
+
+	while (total > ses->budget) {
+		audio_t *lru = NULL;
+		for (i = 0; i < ses->n_tracks; i++) {
+			audio_t *t = ses->tracks[i];
+			if (!t->spilled && audio_memory(t) > 0 && (!lru || t->used < lru->used)) lru = t;
+		}
+		if (!lru) break;
+
+		long sz = audio_memory(lru);
+		if (spill_audio(lru) < 0) {
+			fail("Error: could not evict \"%s\" to the scratch file\n", lru->name);
+			break;
+		}
+		total -= sz;
+	}
+}
+
+void memory(char **args) {
+	if (args[1]) {
+		if (!strcmp(args[1], "off")) ses->budget = 0;
+		else if (atof(args[1]) > 0.0) ses->budget = (long)(atof(args[1]) * 1048576.0);
+		else {
+			fail("Error: invalid memory budget \"%s\"\n", args[1]);
+			return;
+		}
+		if (args[2] && set_scratch_dir(args[2]) < 0) fail("Error: the scratch file is already in use\n");
+		return;
+	}
+
+	long resident = 0, evicted = 0;
+	int i, n = 0;
+	for (i = 0; i < ses->n_tracks; i++) {
+		audio_t *t = ses->tracks[i];
+		if (t->spilled) {
+			evicted += (long)t->n_ch * (t->sz - silent_frames(t)) * (t->spilled == 2 ? store_size(t->store) : sizeof(float));
+			n++;
+		}
+		else resident += audio_memory(t);
+	}
+
+	if (ses->budget > 0) print("    Budget: %.1f MB\n", ses->budget / 1048576.0);
+	else print("    Budget: none\n");
+	print("    In memory: %.1f MB\n"
+	      "    Evicted: %.1f MB in %d tracks\n", resident / 1048576.0, evicted / 1048576.0, n);
+}
+
+void render(char **args) {
+	if (!enough_args(args, 1)) return;
+
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+	audio_t *t = ses->tracks[idx];
+
+	render_sink_t sink;
+	if (!args[2] || !strcmp(args[2], "null")) null_sink(&sink);
+	else file_sink(&sink, args[2]);
+
+	render_opts_t o = {0};
+	o.period = args[2] && args[3] ? atoi(args[3]) : 256;
+	o.speed = args[2] && args[3] && args[4] ? atof(args[4]) : 1.0;
+	o.gain = 1.0;
+	if (o.period < 1 || o.speed < 0.0) {
+		fail("Error: invalid period or speed\n");
+		return;
+	}
+
+	convolver_t c;
+	if (args[2] && args[3] && args[4] && args[5]) {
+		int ir = find_var(args[5], 1);
+		if (ir < 0) return;
+		if (create_convolver(&c, ses->tracks[ir], t->n_ch, o.period, ses->tracks[ir]->n_ch > t->n_ch) < 0) {
+			fail("Error: \"%s\" can't be used as an impulse response for \"%s\"\n", args[5], args[1]);
+			return;
+		}
+		o.conv = &c;
+	}
+
+	render_stats_t st;
+	int r = render_audio(t, &sink, &o, &st);
+	if (o.conv) close_convolver(&c);
+	if (r < 0) {
+		fail("Error: could not render \"%s\" (%d)\n", args[1], r);
+		return;
+	}
+
+	double sec = (double)st.frames / t->rate;
+	print("    Rendered %.2fs in %ld periods of %d frames (%.2fx real time)\n"
+		"    Xruns: %ld\n"
+		"    Callback latency: %.0f / %.0f / %.0f / %.0f us (50th / 90th / 99th / 99.9th), max %.0f us\n"
+		"    Headroom: %.1f / %.1f / %.1f ms buffered (min / 1st / 10th), median %.1f ms\n",
+		sec, st.periods, o.period, st.wall > 0.0 ? sec / st.wall : 0.0, st.xruns,
+		st.latency[0] * 1e6, st.latency[1] * 1e6, st.latency[2] * 1e6, st.latency[3] * 1e6, st.latency[4] * 1e6,
+		st.headroom[0] * 1e3, st.headroom[1] * 1e3, st.headroom[2] * 1e3, st.headroom[3] * 1e3);
+}
+
+// A command run in the background. It works on copies of the tracks it names, held in its own
+// session, while the originals stay locked in the main session until the copies replace them
+typedef struct {
+	int id;
+	char line[80];
+	char **names;   // Tracks locked in the main session
+	int n_names;
+	session_t s;
+	progress_t prog;
+	pthread_t thread;
+	int done;
+	double start;
+	char *log;      // What the command printed
+	size_t log_sz;
+} job_t;
+
+job_t **jobs = NULL;
+int n_jobs = 0, next_job = 1;
+
+int run_line(char *line);
+void close_session(session_t *s);
+void timeline(char **args);
+extern command commands[];
+
+double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Returns the id of the job holding the track called name, or 0
+int track_job(char *name) {
+	int i, k;
+	for (i = 0; name && i < n_jobs; i++) {
+		for (k = 0; k < jobs[i]->n_names; k++) {
+			if (!strcmp(jobs[i]->names[k], name)) return jobs[i]->id;
+		}
+	}
+	return 0;
+}
+
+void *run_job(void *arg) {
+	job_t *j = arg;
+	ses = &j->s;
+	set_progress(&j->prog);
+	set_log(j->s.out);
+
+	char line[80];
+	strcpy(line, j->line);
+	run_line(line);
+
+	set_progress(NULL);
+	set_log(NULL);
+	fflush(j->s.out);
+	__atomic_store_n(&j->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+void start_job(char *line) {
+	char copy[80], *args[MAX_ARGS], *save = NULL;
+	snprintf(copy, sizeof(copy), "%s", line);
+	args[0] = strtok_r(copy, " \r\n", &save);
+	int i, k;
+	for (i = 1; i < MAX_ARGS; i++) args[i] = strtok_r(NULL, " \r\n", &save);
+	if (!args[0] || find_cmd(args[0]) < 0) return;
+
+	job_t *j = calloc(1, sizeof(job_t));
+	j->id = next_job++;
+	snprintf(j->line, sizeof(j->line), "%s", line);
+
+	// Lock the destination (always the first argument) and every other track the command names.
+	// A timeline also uses the sources its EDL file names
+	clip_t *clips = NULL;
+	int n_clips = commands[find_cmd(args[0])] == timeline && args[2] ? read_edl(args[2], &clips) : 0;
+	if (n_clips < 0) n_clips = 0;
+	j->names = calloc(MAX_ARGS + n_clips, sizeof(char*));
+	for (i = 1; i < MAX_ARGS && args[i]; i++) {
+		if (i > 1 && find_var(args[i], 0) < 0) continue;
+		for (k = 0; k < j->n_names && strcmp(j->names[k], args[i]); k++);
+		if (k == j->n_names) j->names[j->n_names++] = strdup(args[i]);
+	}
+	for (i = 0; i < n_clips; i++) {
+		if (find_var(clips[i].name, 0) < 0) continue;
+		for (k = 0; k < j->n_names && strcmp(j->names[k], clips[i].name); k++);
+		if (k == j->n_names) j->names[j->n_names++] = strdup(clips[i].name);
+	}
+	free_edl(clips, n_clips);
+
+	j->s.batch = 1; // nothing to prompt with
+	j->s.store = ses->store;
+	j->s.layout = ses->layout;
+	j->s.out = open_memstream(&j->log, &j->log_sz);
+	for (k = 0; k < j->n_names; k++) {
+		int idx = find_var(j->names[k], 0);
+		if (idx < 0) continue;
+
+		audio_t *t = calloc(1, sizeof(audio_t));
+		transfer_audio(t, ses->tracks[idx]);
+		j->s.tracks = realloc(j->s.tracks, ++j->s.n_tracks * sizeof(audio_t*));
+		j->s.tracks[j->s.n_tracks-1] = t;
+	}
+
+	j->start = seconds();
+	jobs = realloc(jobs, ++n_jobs * sizeof(job_t*));
+	jobs[n_jobs-1] = j;
+	pthread_create(&j->thread, NULL, run_job, j);
+	print("[%d] %s\n", j->id, j->line);
+}
+
+// Moves the results of a finished job into the main session, or drops them if it was cancelled
+void finish_job(int n) {
+	job_t *j = jobs[n];
+	pthread_join(j->thread, NULL);
+	fclose(j->s.out);
+
+	int i;
+	if (j->prog.cancel) {
+		print("[%d] cancelled: %s\n", j->id, j->line);
+		close_session(&j->s);
+	}
+	else {
+		print("[%d] %s after %.1fs: %s\n", j->id, j->s.failed ? "failed" : "done", seconds() - j->start, j->line);
+		if (j->log_sz) print("%s", j->log);
+		for (i = 0; i < j->s.n_tracks; i++) {
+			audio_t *t = j->s.tracks[i];
+			int idx = find_var(t->name, 0);
+			if (idx < 0) {
+				ses->tracks = realloc(ses->tracks, ++ses->n_tracks * sizeof(audio_t*));
+				idx = ses->n_tracks-1;
+			}
+			else {
+				close_audio(ses->tracks[idx]);
+				free(ses->tracks[idx]);
+			}
+			ses->tracks[idx] = t;
+		}
+		free(j->s.tracks);
+		if (j->s.last_io_op[0]) {
+			ses->last_io = j->s.last_io;
+			strcpy(ses->last_io_op, j->s.last_io_op);
+		}
+		ses->failed += j->s.failed;
+	}
+
+	for (i = 0; i < j->n_names; i++) free(j->names[i]);
+	free(j->names);
+	free(j->log);
+	free(j);
+	memmove(jobs + n, jobs + n + 1, (--n_jobs - n) * sizeof(job_t*));
+}
+
+void reap_jobs() {
+	int i;
+	for (i = 0; i < n_jobs; i++) {
+		if (__atomic_load_n(&jobs[i]->done, __ATOMIC_ACQUIRE)) finish_job(i--);
+	}
+}
+
+double job_progress(job_t *j) {
+	long total = __atomic_load_n(&j->prog.total, __ATOMIC_RELAXED), done = __atomic_load_n(&j->prog.done, __ATOMIC_RELAXED);
+	return total > 0 ? 100.0 * done / total : 0.0;
+}
+
+void jobs_cmd(char **args) {
+	reap_jobs();
+	if (n_jobs < 1) {
+		print("No background jobs\n");
+		return;
+	}
+	int i;
+	for (i = 0; i < n_jobs; i++) {
+		print("    [%d] %3.0f%% %6.1fs  %s%s\n", jobs[i]->id, job_progress(jobs[i]), seconds() - jobs[i]->start,
+			jobs[i]->line, jobs[i]->prog.cancel ? " (cancelling)" : "");
+	}
+}
+
+void wait_cmd(char **args) {
+	int id = args[1] ? atoi(args[1]) : 0, i, found = 0;
+	for (i = 0; i < n_jobs; i++) found |= !id || jobs[i]->id == id;
+	if (id && !found) {
+		fail("Error: no job %d\n", id);
+		return;
+	}
+
+	// Show the progress of what is being waited for on one line until it is done
+	while (1) {
+		int left = 0;
+		for (i = 0; i < n_jobs; i++) {
+			if ((!id || jobs[i]->id == id) && !__atomic_load_n(&jobs[i]->done, __ATOMIC_ACQUIRE)) {
+				if (!left++ && ses->out == stdout) printf("\r    [%d] %3.0f%%", jobs[i]->id, job_progress(jobs[i]));
+			}
+		}
+		if (ses->out == stdout) fflush(stdout);
+		if (!left) break;
+		struct timespec ts = {0, 200000000};
+		nanosleep(&ts, NULL);
+	}
+	if (ses->out == stdout) printf("\r%20s\r", "");
+	reap_jobs();
+}
+
+void cancel_cmd(char **args) {
+	if (!enough_args(args, 1)) return;
+
+	int id = atoi(args[1]), i;
+	for (i = 0; i < n_jobs; i++) {
+		if (jobs[i]->id != id) continue;
+		__atomic_store_n(&jobs[i]->prog.cancel, 1, __ATOMIC_RELAXED);
+		print("Cancelling job %d\n", id);
+		return;
+	}
+	fail("Error: no job %d\n", id);
+}
+
+// Detection settings from [threshold] [hangover] [min length], in dBFS and milliseconds
+int find_regions(audio_t *t, char **args, region_t **regions) {
+	detect_t d = {0};
+	d.threshold = args[0] ? atof(args[0]) : -50.0;
+	d.hangover = (long)(args[0] && args[1] ? atof(args[1]) : 200.0) * t->rate / 1000;
+	d.min_len = (long)(args[0] && args[1] && args[2] ? atof(args[2]) : 0.0) * t->rate / 1000;
+	if (d.threshold >= 0.0 || d.hangover < 0 || d.min_len < 0) {
+		fail("Error: invalid detection settings\n");
+		return -1;
+	}
+
+	int n = detect_activity(t, &d, regions);
+	if (n < 0) fail("Error: could not scan \"%s\"\n", t->name);
+	return n;
+}
+
+void detect(char **args) {
+	if (!enough_args(args, 1)) return;
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+
+	audio_t *t = ses->tracks[idx];
+	region_t *r;
+	int n = find_regions(t, args + 2, &r), i;
+	if (n < 0) return;
+
+	long total = 0;
+	for (i = 0; i < n; i++) {
+		char from[20] = {0}, len[20] = {0};
+		sprintt(from, (float)r[i].start / t->rate);
+		sprintt(len, (float)r[i].len / t->rate);
+		print("    %4d: %ld + %ld (%s + %s)\n", i + 1, r[i].start, r[i].len, from, len);
+		total += r[i].len;
+	}
+	print("%d regions, %.1f%% of \"%s\"\n", n, t->sz > 0 ? 100.0 * total / t->sz : 0.0, args[1]);
+	free(r);
+}
+
+void split(char **args) {
+	if (!enough_args(args, 2)) return;
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+
+	region_t *r;
+	int n = find_regions(ses->tracks[idx], args + 3, &r);
+	if (n < 0) return;
+	if (n == 0) {
+		print("Nothing in \"%s\" is above the threshold\n", args[1]);
+		return;
+	}
+
+	double start = seconds();
+	int written = split_audio(ses->tracks[idx], r, n, args[2]);
+	if (written < 0) fail("Error: could not split \"%s\"\n", args[1]);
+	else print("Wrote %d files in %.3f s\n", written, seconds() - start);
+	free(r);
+}
+
+// Numbers after the track fill in the settings in order; "linked" or "unlinked" may come anywhere
+void dynamics(char **args, dynamics_t *d, float **opt, int n_opt) {
+	int idx = find_var(args[1], 1);
+	if (idx < 0) return;
+
+	int i, k = 0;
+	d->link = 1;
+	for (i = 2; i < MAX_ARGS && args[i]; i++) {
+		if (!strcmp(args[i], "linked")) d->link = 1;
+		else if (!strcmp(args[i], "unlinked")) d->link = 0;
+		else if (k < n_opt) *opt[k++] = atof(args[i]);
+	}
+
+	double start = seconds();
+	int r = dynamics_audio(ses->tracks[idx], d);
+	if (r < 0) fail("Error: could not process \"%s\" (%d)\n", args[1], r);
+	else print("%s: up to %.1f dB of gain reduction, in %.3f s\n", args[1], -d->reduction, seconds() - start);
+}
+
+void compress(char **args) {
+	if (!enough_args(args, 3)) return;
+	dynamics_t d = {DYN_COMPRESS, 0.0, 1.0, 0.0, 10.0, 100.0, 5.0, 0.0};
+	dynamics(args, &d, (float*[]){&d.threshold, &d.ratio, &d.attack, &d.release, &d.makeup}, 5);
+}
+
+void limit(char **args) {
+	if (!enough_args(args, 2)) return;
+	dynamics_t d = {DYN_LIMIT, 0.0, 1.0, 0.0, 0.0, 50.0, 5.0, 0.0};
+	dynamics(args, &d, (float*[]){&d.threshold, &d.release, &d.lookahead}, 3);
+}
+
+void gate(char **args) {
+	if (!enough_args(args, 2)) return;
+	dynamics_t d = {DYN_GATE, 0.0, 1.0, -80.0, 1.0, 100.0, 0.0, 0.0};
+	dynamics(args, &d, (float*[]){&d.threshold, &d.range, &d.attack, &d.release}, 4);
+}
+
+void align(char **args) {
+	if (!enough_args(args, 2)) return;
+	int dst = find_var(args[1], 1), src = find_var(args[2], 1), i;
+	if (dst < 0 || src < 0) return;
+
+	audio_t *t = ses->tracks[dst];
+	align_t a = {0};
+	for (i = 3; i < MAX_ARGS && args[i]; i++) {
+		if (!strcmp(args[i], "polarity")) a.any_polarity = 1;
+		else a.max_offset = (long)(atof(args[i]) * t->rate + 0.5);
+	}
+
+	double start = seconds();
+	int r = align_audio(t, ses->tracks[src], &a);
+	if (r == -2) fail("Error: \"%s\" and \"%s\" have different sample rates\n", args[1], args[2]);
+	else if (r < 0) fail("Error: could not align \"%s\" with \"%s\" (%d)\n", args[2], args[1], r);
+	else {
+		char at[20] = {0};
+		sprintt(at, (float)(a.offset < 0 ? -a.offset : a.offset) / t->rate);
+		print("%s lines up with %s at %ld (%s%s)%s, confidence %.3f, in %.3f s\n", args[2], args[1], a.offset,
+		      a.offset < 0 ? "-" : "", at, a.polarity < 0 ? " inverted" : "", a.confidence, seconds() - start);
+	}
+}
+
+void fade(char **args) {
+	if (!enough_args(args, 3)) return;
+	int cross = !strcmp(args[1], "cross");
+	if (!cross && strcmp(args[1], "in") && strcmp(args[1], "out")) {
+		fail("Error: expected in, out or cross\n");
+		return;
+	}
+	if (cross && !enough_args(args, 5)) return;
+
+	char *name = args[cross ? 6 : 4];
+	int shape = RAMP_LINEAR;
+	if (name && !strcmp(name, "exp")) shape = RAMP_EXP;
+	else if (name && !strcmp(name, "scurve")) shape = RAMP_SCURVE;
+	else if (name && strcmp(name, "linear")) {
+		fail("Error: unknown shape \"%s\"\n", name);
+		return;
+	}
+
+	int idx = find_var(args[2], 1);
+	if (idx < 0) return;
+	audio_t *t = ses->tracks[idx];
+	long size = atol(args[cross ? 5 : 3]);
+	if (size < 1) {
+		fail("Error: invalid size\n");
+		return;
+	}
+
+	int r;
+	double start = seconds();
+	if (cross) {
+		int idx2 = find_var(args[3], 1);
+		if (idx2 < 0) return;
+
+		// The whole source goes in, at the length it has once converted to the track's rate
+		audio_t *src = ses->tracks[idx2];
+		int offset = atoi(args[4]), len = src->sz;
+		if (t->sz > 0 && (src->rate != t->rate || src->n_ch != t->n_ch)) {
+			audio_t *conv = convert_source(src, t->rate, t->n_ch);
+			len = conv ? conv->sz : 0;
+		}
+		r = offset < 0 || len < 1 ? -1 : insert_crossfade(t, src, offset, len, 1.0, size, shape);
+	}
+	else {
+		if (size > t->sz) size = t->sz;
+		if (!strcmp(args[1], "in")) r = fade_audio(t, 0, size, 0.0, 1.0, shape);
+		else r = fade_audio(t, t->sz - size, size, 1.0, 0.0, shape);
+	}
+	if (r < 0) fail("Error: could not fade \"%s\" (%d)\n", args[2], r);
+	else print("Faded \"%s\" in %.3f s\n", args[2], seconds() - start);
+}
+
+void session(char **args) {
+	if (!enough_args(args, 2)) return;
+
+	double start = seconds();
+	if (!strcmp(args[1], "save")) {
+		int r = save_snapshot(args[2], ses->tracks, ses->n_tracks);
+		if (r < 0) fail("Error: could not write \"%s\" (%d)\n", args[2], r);
+		else print("Saved %d tracks to \"%s\" in %.3f s\n", ses->n_tracks, args[2], seconds() - start);
+	}
+	else if (!strcmp(args[1], "load")) {
+		audio_t *t;
+		int n = load_snapshot(args[2], &t), i;
+		if (n < 0) {
+			fail("Failed to load \"%s\" (%d)\n", args[2], n);
+			return;
+		}
+
+		// A track a job is working on would be freed under it, and replaced by its result later
+		for (i = 0; !ses->batch && i < n; i++) {
+			int id = track_job(t[i].name);
+			if (!id) continue;
+			fail("Error: \"%s\" is in use by job %d\n", t[i].name, id);
+			for (i = 0; i < n; i++) close_audio(&t[i]);
+			free(t);
+			return;
+		}
+
+		// The tracks are moved in, as copying them would read every sample
+		for (i = 0; i < n; i++) {
+			int idx = find_var(t[i].name, 0);
+			if (idx < 0) {
+				ses->tracks = realloc(ses->tracks, ++ses->n_tracks * sizeof(audio_t*));
+				idx = ses->n_tracks-1;
+				ses->tracks[idx] = calloc(1, sizeof(audio_t));
+			}
+			else close_audio(ses->tracks[idx]);
+			*ses->tracks[idx] = t[i];
+		}
+		free(t);
+		print("Restored %d tracks from \"%s\" in %.3f s\n", n, args[2], seconds() - start);
+	}
+	else fail("Error: expected save or load\n");
+}
+
+void timeline(char **args) {
+	if (!enough_args(args, 2)) return;
+
+	clip_t *clips;
+	int n = read_edl(args[2], &clips), i;
+	if (n < 0) {
+		fail("Failed to read \"%s\" (%d)\n", args[2], n);
+		return;
+	}
+	if (n == 0) {
+		free_edl(clips, n);
+		fail("Error: \"%s\" has no clips\n", args[2]);
+		return;
+	}
+
+	// The sources are not on the command line, so the checks for tracks in use by a job happen here
+	for (i = 0; i < n; i++) {
+		int idx = find_var(clips[i].name, 1), id = ses->batch ? 0 : track_job(clips[i].name);
+		if (idx < 0 || id) {
+			if (id) fail("Error: \"%s\" is in use by job %d\n", clips[i].name, id);
+			free_edl(clips, n);
+			return;
+		}
+		clips[i].src = ses->tracks[idx];
+	}
+
+	audio_t temp = {0};
+	double start = seconds();
+	int r = render_timeline(&temp, args[1], clips, n, args[3] && args[4] ? atoi(args[4]) : 0, args[3] ? atoi(args[3]) : 0);
+	if (r < 0) fail("Error: could not render \"%s\" (%d)\n", args[2], r);
+	else {
+		char len[20] = {0};
+		sprintt(len, (float)temp.sz / temp.rate);
+		print("%s: %d clips, %d frames (%s) in %.3f s\n", args[1], n, temp.sz, len, seconds() - start);
+		add_track(&temp, args[1]);
+	}
+	close_audio(&temp);
+	free_edl(clips, n);
+}
+
+void markers(char **args) {
+	if (!enough_args(args, 1)) return;
+
+	FILE *f = fopen(args[1], "rb");
+	if (!f) {
+		fail("Error: could not open \"%s\"\n", args[1]);
+		return;
+	}
+	wav_index_t idx;
+	double start = seconds();
+	int r = index_wav(f, &idx), i;
+	fclose(f);
+	if (r < 0) {
+		free_wav_index(&idx);
+		fail("Failed to read \"%s\" (%d)\n", args[1], r);
+		return;
+	}
+
+	int rate = idx.header.sample_rate > 0 ? idx.header.sample_rate : 1;
+	for (i = 0; i < idx.n_markers; i++) {
+		wav_marker_t *m = &idx.markers[i];
+		char from[20] = {0}, len[20] = {0};
+		sprintt(from, (float)m->start / rate);
+		sprintt(len, (float)m->len / rate);
+		print("    %-24s %ld + %ld (%s + %s)\n", m->name, m->start, m->len, from, len);
+	}
+	print("%d markers in %d chunks of \"%s\", in %.3f s\n", idx.n_markers, idx.n_chunks, args[1], seconds() - start);
+	free_wav_index(&idx);
+}
+
+void trace(char **args) {
+	if (!enough_args(args, 1)) return;
+
+	if (!strcmp(args[1], "start")) {
+		if (trace_start() < 0) fail("Error: tracing is not compiled in (rebuild with -DAUDIO_TRACE)\n");
+	}
+	else if (!strcmp(args[1], "stop")) trace_stop();
+	else if (!strcmp(args[1], "dump")) {
+		if (!enough_args(args, 2)) return;
+		int n = trace_dump(args[2]);
+		if (n < 0) fail("Error: could not write \"%s\"\n", args[2]);
+		else print("Wrote %d spans to \"%s\"\n", n, args[2]);
+	}
+	else fail("Error: expected start, stop or dump\n");
 }
 
 command commands[] = {
 	NULL, help, list, info, open_wav, open_raw, save_wav, save_raw, transfer,
 	generate, mix, bps_cmd, rate_cmd, fmt_cmd, speed, amplify,
 	get_cmd, set_cmd, display, insert, add, remove_cmd, reverse,
-	insert_ch, delete_ch
+	insert_ch, delete_ch, convolve, filter, iostat, stats,
+	normalize, dither, store, memory, render, jobs_cmd,
+	wait_cmd, cancel_cmd, trace, sparse, detect, split, layout, timeline,
+	compress, limit, gate, align, session, fade, markers
 };
 
+// Tokenise and run one command line. Returns 1 if the line asks to quit
+int run_line(char *line) {
+	char *args[MAX_ARGS], *save = NULL;
+	int i;
+
+	// A trailing & runs the command on a worker thread. Batches and jobs just run it
+	int len = strlen(line), bg = 0;
+	while (len > 0 && strchr(" \t\r\n", line[len-1])) line[--len] = 0;
+	if (len > 0 && line[len-1] == '&') {
+		line[--len] = 0;
+		while (len > 0 && strchr(" \t", line[len-1])) line[--len] = 0;
+		bg = 1;
+	}
+	if (!ses->batch) reap_jobs();
+
+	char full[80];
+	snprintf(full, sizeof(full), "%s", line);
+	args[0] = strtok_r(line, " \r\n", &save);
+	for (i = 1; i < MAX_ARGS; i++) args[i] = strtok_r(NULL, " \r\n", &save);
+	if (!args[0]) {
+		if (!ses->batch) print("Type \"help\" for the list of commands (no quotation marks)\n");
+		return 0;
+	}
+
+	int cid = find_cmd(args[0]);
+	if (cid < 0) return 0;
+
+	// Quitting lets running jobs finish first; they can be cancelled beforehand
+	if (!commands[cid]) {
+		if (n_jobs > 0 && !ses->batch) {
+			print("Waiting for %d background job%s\n", n_jobs, n_jobs == 1 ? "" : "s");
+			wait_cmd((char*[]){"wait", NULL});
+		}
+		return 1;
+	}
+
+	// Sessions work on the whole track table, which a job does not have. session load checks the
+	// tracks it restores itself, as their names are in the snapshot rather than on the command line
+	if (!ses->batch && commands[cid] != jobs_cmd && commands[cid] != wait_cmd && commands[cid] != cancel_cmd && commands[cid] != session) {
+		for (i = 1; i < MAX_ARGS && args[i]; i++) {
+			int id = track_job(args[i]);
+			if (id) {
+				fail("Error: \"%s\" is in use by job %d\n", args[i], id);
+				return 0;
+			}
+		}
+		if (bg) {
+			start_job(full);
+			return 0;
+		}
+	}
+	commands[cid](args);
+
+	// Commands work on planar floats where they need to, so compacted and interleaved tracks are
+	// converted back afterwards
+	for (i = 0; i < ses->n_tracks; i++) {
+		audio_t *t = ses->tracks[i];
+		if (t->store != STORE_FLOAT && t->buf) compact_audio(t, t->store);
+		else if (t->layout == LAYOUT_INTERLEAVED && t->buf) interleave_audio(t);
+	}
+	enforce_budget();
+	return 0;
+}
+
+void close_session(session_t *s) {
+	if (!s || !s->tracks) return;
+
+	int i;
+	for (i = 0; i < s->n_tracks; i++) {
+		close_audio(s->tracks[i]);
+		free(s->tracks[i]);
+	}
+	free(s->tracks);
+	s->tracks = NULL;
+	s->n_tracks = 0;
+}
+
+typedef struct {
+	char **recipe;     // Recipe lines
+	int n_lines;
+	char **files;      // Input files, one task each
+	int n_files;
+	int *failed;       // Number of errors reported for each file
+	char **logs;       // Output of each failed file
+	long bytes;        // Total size of the input files
+	int n_done;
+	pthread_mutex_t lock;
+} batch_t;
+
+// Replace $in, $name and $base in a recipe line with the path, file name and extensionless file name
+void expand_line(char *dst, int sz, char *line, char *file) {
+	char *name = strrchr(file, '/');
+	name = name ? name+1 : file;
+	char *ext = strrchr(name, '.');
+	int base_len = ext ? ext - name : strlen(name);
+
+	int p = 0;
+	while (*line && p < sz-1) {
+		char *sub = NULL;
+		int len = 0;
+		if (!strncmp(line, "$in", 3)) { sub = file; len = strlen(file); line += 3; }
+		else if (!strncmp(line, "$name", 5)) { sub = name; len = strlen(name); line += 5; }
+		else if (!strncmp(line, "$base", 5)) { sub = name; len = base_len; line += 5; }
+
+		if (sub) {
+			if (len > sz-1 - p) len = sz-1 - p;
+			memcpy(dst + p, sub, len);
+			p += len;
+		}
+		else dst[p++] = *line++;
+	}
+	dst[p] = 0;
+}
+
+void run_file(void *ctx, int task, int thread) {
+	batch_t *b = ctx;
+
+	char *log = NULL;
+	size_t log_sz = 0;
+	session_t s = {0};
+	s.batch = 1;
+	s.out = open_memstream(&log, &log_sz);
+	ses = &s;
+	set_log(s.out);
+
+	char line[1024];
+	int i;
+	for (i = 0; i < b->n_lines; i++) {
+		expand_line(line, sizeof(line), b->recipe[i], b->files[task]);
+		if (run_line(line)) break;
+
+		// Later commands would only pile up errors about the same file
+		if (s.failed) {
+			print("Stopped at recipe line %d\n", i+1);
+			break;
+		}
+	}
+
+	close_session(&s);
+	set_log(NULL);
+	fclose(s.out);
+	ses = NULL;
+
+	struct stat st;
+	pthread_mutex_lock(&b->lock);
+	b->failed[task] = s.failed;
+	if (s.failed) {
+		printf("FAILED %s\n", b->files[task]);
+		b->logs[task] = log;
+		log = NULL;
+	}
+	if (!stat(b->files[task], &st)) b->bytes += st.st_size;
+	b->n_done++;
+	pthread_mutex_unlock(&b->lock);
+	free(log);
+}
+
+int batch(int argc, char **argv) {
+	int i, n_threads = 0;
+	char **arg = argv + 2, **end = argv + argc;
+	if (arg < end && !strncmp(*arg, "-j", 2)) {
+		n_threads = (*arg)[2] ? atoi(*arg + 2) : (arg+1 < end ? atoi(*++arg) : 0);
+		arg++;
+	}
+	if (end - arg < 2) {
+		printf("Usage: %s batch [-j <threads>] <recipe> <file>...\n"
+		       "Runs the commands in <recipe> once for each <file>.\n"
+		       "In the recipe, $in is replaced by the file path, $name by the file name\n"
+		       "and $base by the file name without its extension\n", argv[0]);
+		return 1;
+	}
+
+	FILE *f = fopen(*arg, "r");
+	if (!f) {
+		printf("Error: could not open \"%s\"\n", *arg);
+		return 1;
+	}
+
+	batch_t b = {0};
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (!*p || *p == '#' || *p == '\n' || *p == '\r') continue;
+		b.recipe = realloc(b.recipe, (b.n_lines + 1) * sizeof(char*));
+		b.recipe[b.n_lines++] = strdup(p);
+	}
+	fclose(f);
+
+	b.files = arg + 1;
+	b.n_files = end - b.files;
+	b.failed = calloc(b.n_files, sizeof(int));
+	b.logs = calloc(b.n_files, sizeof(char*));
+	pthread_mutex_init(&b.lock, NULL);
+
+	if (n_threads < 1) n_threads = n_cores();
+	if (n_threads > b.n_files) n_threads = b.n_files;
+	printf("Running \"%s\" on %d files with %d threads\n", *arg, b.n_files, n_threads);
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	run_parallel(b.n_files, n_threads, run_file, &b);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+	int n_failed = 0;
+	for (i = 0; i < b.n_files; i++) {
+		if (!b.failed[i]) continue;
+		if (!n_failed++) printf("\nFailures:\n");
+		printf("  %s (%d error%s)\n", b.files[i], b.failed[i], b.failed[i] == 1 ? "" : "s");
+
+		char *p = b.logs[i], *nl;
+		while (p && *p) {
+			nl = strchr(p, '\n');
+			int len = nl ? nl - p : strlen(p);
+			printf("      %.*s\n", len, p);
+			p += len + (nl ? 1 : 0);
+		}
+		free(b.logs[i]);
+	}
+
+	double mb = b.bytes / 1048576.0;
+	printf("\n%d files, %.1f MB in %.2fs: %.1f files/s, %.1f MB/s, %d failed\n",
+		b.n_files, mb, secs, secs > 0.0 ? b.n_files / secs : 0.0, secs > 0.0 ? mb / secs : 0.0, n_failed);
+
+	for (i = 0; i < b.n_lines; i++) free(b.recipe[i]);
+	free(b.recipe);
+	free(b.failed);
+	free(b.logs);
+	pthread_mutex_destroy(&b.lock);
+	return n_failed ? 2 : 0;
+}
+
 int main(int argc, char **argv) {
+	if (argc > 1 && !strcmp(argv[1], "batch")) return batch(argc, argv);
+
 	printf("WAV Tool\n\n");
 
-	int i, j;
+	session_t s = {0};
+	s.out = stdout;
+	ses = &s;
+
 	char cmd[80] = {0};
-	char *args[MAX_ARGS];
 	while (1) {
 		prompt(cmd, "> ");
-		args[0] = strtok(cmd, " \n");
-		for (i = 1; i < MAX_ARGS; i++) args[i] = strtok(NULL, " \n");
-		if (!args[0]) {
-			printf("Type \"help\" for the list of commands (no quotation marks)\n");
-			continue;
-		}
-
-		int cid = find_cmd(args[0]);
-		if (cid < 0) continue;
-
-		if (!commands[cid]) break;
-		commands[cid](args);
+		if (run_line(cmd)) break;
 	}
 
-	if (tracks) {
-		for (i = 0; i < n_tracks; i++) close_audio(tracks[i]);
-		free(tracks);
-	}
+	close_session(&s);
 	return 0;
 }